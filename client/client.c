@@ -15,6 +15,19 @@ static struct lws *client_wsi = NULL;
 static volatile int force_exit = 0;
 static char *username = NULL;
 
+// Reconexion pedida por el servidor al reiniciarse: momento en ms en que se debe reconectar, 0 si no hay
+static long long reconnect_at_ms = 0;
+static int reconnect_attempts = 0;   // Intentos fallidos de reconexion seguidos
+static struct lws_client_connect_info connect_info; // Datos de conexion para reconectar
+#define MAX_RECONNECT_ATTEMPTS 10
+
+// Reloj monotono en milisegundos
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 
 // Hilo encargado de leer entrada desde stdin y actualiza el timestamp de actividad en cada comando.
 void *stdin_thread(void *arg) {
@@ -48,6 +61,7 @@ static int callback_client(struct lws *wsi, enum lws_callback_reasons reason, vo
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
             printf("Conexión establecida con el servidor WebSocket.\n");
             client_wsi = wsi; // guarda la conexion WebSocket en la variable global.
+            reconnect_attempts = 0;
             {
                 // Enviar mensaje de registro.
                 ProtocolMessage reg_msg;
@@ -61,11 +75,36 @@ static int callback_client(struct lws *wsi, enum lws_callback_reasons reason, vo
             break;
         case LWS_CALLBACK_CLIENT_RECEIVE:
             printf("Mensaje recibido: %s\n", (char *)in); // Imprime el mensaje recibido del servidor
+            {
+                // Si el servidor avisa que se reinicia se programa la reconexion con el retraso indicado
+                char type[MAX_FIELD_LENGTH];
+                char delay[MAX_FIELD_LENGTH];
+                if (extract_json_value((const char *)in, "type", type, sizeof(type)) == 0 &&
+                    strcmp(type, MSG_TYPE_SERVER_RESTART) == 0 &&
+                    extract_json_value((const char *)in, "reconnect_ms", delay, sizeof(delay)) == 0) {
+                    reconnect_at_ms = now_ms() + atol(delay);
+                    reconnect_attempts = 0;
+                }
+            }
+            break;
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            // No se pudo conectar, si se estaba reconectando se reintenta en un segundo
+            client_wsi = NULL;
+            if (reconnect_attempts > 0 && reconnect_attempts < MAX_RECONNECT_ATTEMPTS) {
+                reconnect_at_ms = now_ms() + 1000;
+            } else {
+                fprintf(stderr, "Error al conectarse al servidor.\n");
+                force_exit = 1;
+            }
             break;
         case LWS_CALLBACK_CLIENT_CLOSED:
             printf("Conexión cerrada.\n");
-            force_exit = 1;  // Forzar la salida para cerrar la sesion del cliente
             client_wsi = NULL;// Limpia la referencia a la conexion cerrada
+            // Si el servidor pidio reconectar no se termina la sesion
+            if (reconnect_at_ms == 0)
+                force_exit = 1;  // Forzar la salida para cerrar la sesion del cliente
+            else
+                printf("El servidor se está actualizando, reconectando...\n");
             break;
         default:
             break;
@@ -80,19 +119,34 @@ static struct lws_protocols protocols[] = {
         "chat-protocol", // Nombre del protocolo para el chat.
         callback_client,
         0,
-        MAX_MESSAGE_LENGTH,
+        MAX_JSON_LENGTH,
     },
     { NULL, NULL, 0, 0 }
 };
 
 int main(int argc, char **argv) {
-    if (argc < 4) {
-        fprintf(stderr, "Uso: %s <nombredeusuario> <IPdelservidor> <puertodelservidor>\n", argv[0]);
+    // -t activa TLS (wss) verificando el certificado y el nombre del servidor
+    // -C usa otra autoridad certificante, por ejemplo el certificado autofirmado de una prueba local
+    // -k no verifica el certificado, solo para pruebas
+    int use_tls = 0, insecure = 0, bad_option = 0;
+    const char *ca_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "tkC:")) != -1) {
+        switch (opt) {
+            case 't': use_tls = 1; break;
+            case 'k': use_tls = insecure = 1; break;
+            case 'C': use_tls = 1; ca_file = optarg; break;
+            default: bad_option = 1; break;
+        }
+    }
+    if (bad_option || argc - optind < 3) {
+        fprintf(stderr, "Uso: %s [-t] [-C ca.pem] [-k] <nombredeusuario> <IPdelservidor> <puertodelservidor>\n", argv[0]);
+        fprintf(stderr, "  -k acepta cualquier certificado, solo para pruebas\n");
         return EXIT_FAILURE; // Finaliza si no se proporcionan los tres argumentos necesarios
     }
-    username = argv[1]; // Establece el nombre de usuario a partir del primer argumento
-    const char *server_address = argv[2]; // Asigna la direccion IP del servidor desde el segundo argumento
-    int port = atoi(argv[3]); // Convierte el tercer argumento en el número de puerto
+    username = argv[optind]; // Establece el nombre de usuario a partir del primer argumento
+    const char *server_address = argv[optind + 1]; // Asigna la direccion IP del servidor desde el segundo argumento
+    int port = atoi(argv[optind + 2]); // Convierte el tercer argumento en el número de puerto
     if (port <= 0) {
         fprintf(stderr, "Puerto inválido.\n");
         return EXIT_FAILURE; // Finaliza si el número de puerto no es valido
@@ -103,7 +157,8 @@ int main(int argc, char **argv) {
     memset(&info, 0, sizeof(info));
     info.port = CONTEXT_PORT_NO_LISTEN;
     info.protocols = protocols;
-    info.options = 0;
+    info.options = use_tls ? LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT : 0;
+    info.client_ssl_ca_filepath = ca_file; // NULL usa las autoridades del sistema
     
     // Crear el contexto de libwebsockets
     struct lws_context *context = lws_create_context(&info);
@@ -113,16 +168,19 @@ int main(int argc, char **argv) {
     }
     
     // Configurar la indo de conexion del cliente
-    struct lws_client_connect_info connect_info;
     memset(&connect_info, 0, sizeof(connect_info));
     connect_info.context      = context;
     connect_info.address      = server_address;
     connect_info.port         = port;
     connect_info.path         = "/chat";  // el protocolo
-    connect_info.host         = lws_canonical_hostname(context);
+    connect_info.host         = server_address; // Nombre con el que se verifica el certificado
     connect_info.origin       = "origin";
     connect_info.protocol     = protocols[0].name;
-    connect_info.ssl_connection = 0;        // Sin SSL
+    // Con TLS se verifica el certificado salvo que se pida -k
+    connect_info.ssl_connection = use_tls ? LCCSCF_USE_SSL : 0;
+    if (insecure)
+        connect_info.ssl_connection |= LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK |
+                                       LCCSCF_ALLOW_EXPIRED | LCCSCF_ALLOW_INSECURE;
     
     // Intentar establecer la conexion con el servidor
     client_wsi = lws_client_connect_via_info(&connect_info);
@@ -145,6 +203,16 @@ int main(int argc, char **argv) {
     // Bucle principal del cliente atender eventos de libwebsockets
     while (!force_exit) {
         lws_service(context, 50);
+        // Reconecta cuando se cumple el retraso escalonado indicado por el servidor
+        if (client_wsi == NULL && reconnect_at_ms != 0 && now_ms() >= reconnect_at_ms) {
+            reconnect_at_ms = 0;
+            reconnect_attempts++;
+            client_wsi = lws_client_connect_via_info(&connect_info);
+            if (client_wsi == NULL && reconnect_attempts < MAX_RECONNECT_ATTEMPTS)
+                reconnect_at_ms = now_ms() + 1000;
+            else if (client_wsi == NULL)
+                force_exit = 1;
+        }
     }
     
     // Esperar a que terminen ambos hilos.
@@ -38,7 +38,7 @@ static inline int client_send_message(struct lws *wsi, const ProtocolMessage *ms
     if (!json)
         return -1; // Retorna error si falla la serializacion
     int len = strlen(json);
-    unsigned char buffer[LWS_PRE + MAX_MESSAGE_LENGTH];
+    unsigned char buffer[LWS_PRE + MAX_JSON_LENGTH];
     // Inicializa el buffer con ceros
     memset(buffer, 0, sizeof(buffer));
     // Copia el JSON en el buffer respetando el offset LWS_PRE.
@@ -50,14 +50,40 @@ static inline int client_send_message(struct lws *wsi, const ProtocolMessage *ms
     return n;
 }
 
+// Guarda en target un usuario o, si vienen varios separados por coma, un arreglo JSON de usuarios
+// Retorna -1 si la lista no cabe en target
+static inline int set_message_target(ProtocolMessage *msg, char *names) {
+    if (!strchr(names, ',')) {
+        strncpy(msg->target, names, MAX_FIELD_LENGTH - 1);
+        return 0;
+    }
+    size_t off = 0;
+    int ok = json_put_raw(msg->target, MAX_FIELD_LENGTH - 1, &off, "[") == 0;
+    char *saveptr = NULL;
+    for (char *name = strtok_r(names, ",", &saveptr); ok && name; name = strtok_r(NULL, ",", &saveptr)) {
+        ok = (off == 1 || json_put_raw(msg->target, MAX_FIELD_LENGTH - 1, &off, ",") == 0) &&
+             json_put_string(msg->target, MAX_FIELD_LENGTH - 1, &off, name) == 0;
+    }
+    if (!ok) return -1;
+    msg->target[off++] = ']';
+    msg->target[off] = '\0';
+    msg->targetIsList = 1;
+    return 0;
+}
+
 // Funcion para mostrar en pantalla los comandos disponibles al usuario
 static inline void display_help(void) {
     printf("\nComandos disponibles:\n");
     printf("broadcast <mensaje>         - Enviar mensaje a todos los usuarios.\n");
     printf("private <usuario> <mensaje> - Enviar mensaje privado a un usuario.\n");
+    printf("private <u1,u2,...> <msg>   - Enviar el mismo mensaje privado a varios usuarios.\n");
     printf("list_users                  - Solicitar listado de usuarios conectados.\n");
-    printf("user_info <usuario>         - Solicitar información de un usuario.\n");
+    printf("list_users [clave=valor]    - Filtrar con prefix=, status=, limit= y cursor= (paginado).\n");
+    printf("user_info <usuario>         - Solicitar información de un usuario (u1,u2,... para varios).\n");
     printf("change_status <status>      - Cambiar estado (ACTIVO, OCUPADO, INACTIVO).\n");
+    printf("subscribe <u1> [u2 ...]     - Recibir solo la presencia de esos usuarios (* para todos).\n");
+    printf("unsubscribe <u1> [u2 ...]   - Dejar de recibir su presencia (* para ninguna).\n");
+    printf("search <palabras>           - Buscar en los broadcasts recientes (from:<u> since:/until:<fecha>).\n");
     printf("disconnect / exit           - Cerrar la conexión y salir.\n");
     printf("help                        - Mostrar esta ayuda.\n\n");
 }
@@ -99,11 +125,15 @@ static inline void process_user_input(const char *input, const char *username, s
             free(input_copy);
             return;
         }
+        char *message_text = strtok(NULL, ""); // Resto del mensaje
         // Define el tipo de mensaje como privado
         strncpy(msg.type, MSG_TYPE_PRIVATE, MAX_FIELD_LENGTH);
         // Guarda el destinatario en el campo target
-        strncpy(msg.target, token, MAX_FIELD_LENGTH);
-        char *message_text = strtok(NULL, ""); // Resto del mensaje
+        if (set_message_target(&msg, token) != 0) {
+            printf("Demasiados destinatarios para un solo mensaje.\n");
+            free(input_copy);
+            return;
+        }
         if (message_text)
             strncpy(msg.content, message_text, MAX_MESSAGE_LENGTH); // Asigna el contenido del mensaje.
         client_send_message(wsi, &msg);// Manda el mensaje privado
@@ -115,6 +145,35 @@ static inline void process_user_input(const char *input, const char *username, s
         strncpy(msg.type, MSG_TYPE_LIST_USERS, MAX_FIELD_LENGTH);
         client_send_message(wsi, &msg);
     }
+    // list_users con filtros clave=valor: prefix, status, limit y cursor
+    else if (strncmp(input, "list_users ", 11) == 0) {
+        char *input_copy = strdup(input);
+        if (!input_copy)
+            return;
+        strncpy(msg.type, MSG_TYPE_LIST_USERS, MAX_FIELD_LENGTH);
+        // Los filtros viajan como objeto JSON en content
+        size_t off = 0;
+        int ok = json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, "{") == 0;
+        int first = 1;
+        strtok(input_copy, " "); // list_users
+        for (char *token = strtok(NULL, " "); ok && token; token = strtok(NULL, " ")) {
+            char *eq = strchr(token, '=');
+            if (!eq || eq == token) continue;
+            *eq = '\0';
+            ok = (first || json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, ", ") == 0) &&
+                 json_put_string(msg.content, MAX_MESSAGE_LENGTH, &off, token) == 0 &&
+                 json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, ": ") == 0 &&
+                 // limit es numero, los demas filtros son cadenas
+                 (strcmp(token, "limit") == 0 && eq[1] && strspn(eq + 1, "0123456789") == strlen(eq + 1)
+                      ? json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, eq + 1)
+                                              : json_put_string(msg.content, MAX_MESSAGE_LENGTH, &off, eq + 1)) == 0;
+            first = 0;
+        }
+        msg.contentIsJson = 1;
+        if (ok && json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, "}") == 0)
+            client_send_message(wsi, &msg);
+        free(input_copy);
+    }
     // Si el comando empieza con user_info solicita info de un usuario especifico
     else if (strncmp(input, "user_info ", 10) == 0) {
         // Formato user_info <usuario>
@@ -129,9 +188,11 @@ static inline void process_user_input(const char *input, const char *username, s
         }
         // Define el tipo de mensaje como solicitud de info de usuario
         strncpy(msg.type, MSG_TYPE_USER_INFO, MAX_FIELD_LENGTH); 
-        // Guarda el nombre del usuario en target
-        strncpy(msg.target, token, MAX_FIELD_LENGTH);
-        client_send_message(wsi, &msg); // Manda la solicitud al servidor
+        // Guarda el nombre del usuario en target, o la lista si vienen varios separados por coma
+        if (set_message_target(&msg, token) != 0)
+            printf("Demasiados usuarios para una sola consulta.\n");
+        else
+            client_send_message(wsi, &msg); // Manda la solicitud al servidor
         free(input_copy);
     }
     // Si el comando empieza con change_status manda un mensaje para cambiar el estado
@@ -151,6 +212,45 @@ static inline void process_user_input(const char *input, const char *username, s
         client_send_message(wsi, &msg); // Manda el mensaje al servidor
         free(input_copy);
     }
+    // Si el comando empieza con subscribe o unsubscribe cambia las suscripciones de presencia
+    else if (strncmp(input, "subscribe ", 10) == 0 || strncmp(input, "unsubscribe ", 12) == 0) {
+        // Formato subscribe <usuario> [usuario ...] o subscribe *
+        int subscribe = input[0] == 's';
+        char *input_copy = strdup(input);
+        if (!input_copy)
+            return;
+        strncpy(msg.type, subscribe ? MSG_TYPE_SUBSCRIBE_PRESENCE : MSG_TYPE_UNSUBSCRIBE_PRESENCE, MAX_FIELD_LENGTH);
+        char *token = strtok(input_copy, " "); // subscribe o unsubscribe
+        token = strtok(NULL, " "); // primer usuario
+        if (token != NULL && strcmp(token, "*") == 0) {
+            strncpy(msg.content, "*", MAX_MESSAGE_LENGTH);
+        } else {
+            // Construye el arreglo JSON con los usuarios indicados, escapados; se reserva lugar para el cierre
+            size_t off = 0;
+            json_put_raw(msg.content, MAX_MESSAGE_LENGTH - 1, &off, "[");
+            while (token != NULL) {
+                size_t mark = off;
+                if ((off > 1 && json_put_raw(msg.content, MAX_MESSAGE_LENGTH - 1, &off, ",") < 0) ||
+                    json_put_string(msg.content, MAX_MESSAGE_LENGTH - 1, &off, token) < 0) {
+                    off = mark; // Los usuarios que no entran se descartan
+                    break;
+                }
+                token = strtok(NULL, " ");
+            }
+            msg.content[off++] = ']';
+            msg.content[off] = '\0';
+            msg.contentIsJson = 1;
+        }
+        client_send_message(wsi, &msg); // Manda la suscripcion al servidor
+        free(input_copy);
+    }
+    // Si el comando empieza con search busca en los broadcasts recientes
+    else if (strncmp(input, "search ", 7) == 0) {
+        // Formato search <palabras> [from:<usuario>] [since:<fecha>] [until:<fecha>]
+        strncpy(msg.type, MSG_TYPE_SEARCH, MAX_FIELD_LENGTH);
+        strncpy(msg.content, input + 7, MAX_MESSAGE_LENGTH - 1);
+        client_send_message(wsi, &msg); // Manda la consulta al servidor
+    }
     // Si el comando es disconnect o exit se manda un mensaje para cerrar la conexion
     else if (strcmp(input, "disconnect") == 0 || strcmp(input, "exit") == 0) {
         // Cierre de conexion
@@ -0,0 +1,23 @@
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <stdint.h>
+
+// Formato del archivo de captura de trafico que escribe el servidor y lee chat_replay
+// Encabezado de 8 bytes CAPTURE_MAGIC seguido de registros, en el orden de bytes de la maquina que capturo:
+//   uint64 t_ns  nanosegundos monotonicos desde que empezo la captura
+//   uint32 conn  identificador de la conexion
+//   uint32 len   bytes de la trama que siguen; CAPTURE_CLOSE en el bit alto marca el cierre de la conexion
+
+#define CAPTURE_MAGIC      "CHATCAP1"
+#define CAPTURE_MAGIC_LEN  8
+#define CAPTURE_CLOSE      0x80000000u // Registro sin datos: la conexion se cerro
+#define CAPTURE_LEN_MASK   0x7FFFFFFFu
+
+typedef struct {
+    uint64_t t_ns;  // Momento de llegada relativo al inicio de la captura
+    uint32_t conn;  // Conexion que mando la trama
+    uint32_t len;   // Longitud de la trama y bandera CAPTURE_CLOSE
+} CaptureRecord;
+
+#endif
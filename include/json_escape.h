@@ -0,0 +1,373 @@
+#ifndef JSON_ESCAPE_H
+#define JSON_ESCAPE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Escape de cadenas JSON y validacion UTF-8 para el camino de los mensajes
+// Los recorridos buscan de a 16 (SSE2) o 32 (AVX2) bytes el primer byte que necesita tratamiento;
+// el texto comun de chat es ASCII sin comillas, asi que casi todo se copia en bloque con memcpy.
+// En x86-64 el nivel se elige al primer uso segun el procesador; en otras arquitecturas se usa la version escalar
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(JSON_NO_SIMD)
+#define JSON_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Niveles de vectorizacion disponibles
+enum { JSON_SIMD_SCALAR = 0, JSON_SIMD_SSE2 = 1, JSON_SIMD_AVX2 = 2 };
+
+static int json_simd_level = -1; // -1 hasta detectar el procesador
+
+// Retorna el nivel de vectorizacion que se usa, detectandolo la primera vez
+static inline int json_simd(void) {
+    int level = __atomic_load_n(&json_simd_level, __ATOMIC_RELAXED);
+    if (level >= 0) return level;
+#ifdef JSON_SIMD_X86
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2") ? JSON_SIMD_AVX2 : JSON_SIMD_SSE2;
+#else
+    level = JSON_SIMD_SCALAR;
+#endif
+    __atomic_store_n(&json_simd_level, level, __ATOMIC_RELAXED);
+    return level;
+}
+
+// Version escalar: posicion del primer byte que hay que escapar (comilla, barra invertida o control), len si no hay
+static inline size_t json_scan_escape_scalar(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c < 0x20 || c == '"' || c == '\\') return i;
+    }
+    return len;
+}
+
+// Version escalar: posicion de la primera comilla o barra invertida, len si no hay
+static inline size_t json_scan_quote_scalar(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '"' || s[i] == '\\') return i;
+    }
+    return len;
+}
+
+// Version escalar: posicion del primer byte no ASCII, len si no hay
+static inline size_t json_scan_ascii_scalar(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)s[i] >= 0x80) return i;
+    }
+    return len;
+}
+
+#ifdef JSON_SIMD_X86
+static inline size_t json_scan_escape_sse2(const char *s, size_t len) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        // Un byte es de control si max(v, 0x1F) == 0x1F en comparacion sin signo
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                   _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+    return i + json_scan_escape_scalar(s + i, len - i);
+}
+
+static inline size_t json_scan_quote_sse2(const char *s, size_t len) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+    return i + json_scan_quote_scalar(s + i, len - i);
+}
+
+static inline size_t json_scan_ascii_sse2(const char *s, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        // El bit alto de cada byte indica un byte no ASCII
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+    return i + json_scan_ascii_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t json_scan_escape_avx2(const char *s, size_t len) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+                                      _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + json_scan_escape_sse2(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t json_scan_quote_avx2(const char *s, size_t len) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                                        _mm256_cmpeq_epi8(v, backslash)));
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + json_scan_quote_sse2(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t json_scan_ascii_avx2(const char *s, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + json_scan_ascii_sse2(s + i, len - i);
+}
+#endif
+
+// Posicion del primer byte de s que hay que escapar en una cadena JSON, len si no hay ninguno
+static inline size_t json_scan_escape(const char *s, size_t len) {
+#ifdef JSON_SIMD_X86
+    if (json_simd() == JSON_SIMD_AVX2) return json_scan_escape_avx2(s, len);
+    return json_scan_escape_sse2(s, len);
+#else
+    return json_scan_escape_scalar(s, len);
+#endif
+}
+
+// Posicion de la primera comilla o barra invertida de s, len si no hay ninguna
+static inline size_t json_scan_quote(const char *s, size_t len) {
+#ifdef JSON_SIMD_X86
+    if (json_simd() == JSON_SIMD_AVX2) return json_scan_quote_avx2(s, len);
+    return json_scan_quote_sse2(s, len);
+#else
+    return json_scan_quote_scalar(s, len);
+#endif
+}
+
+// Posicion del primer byte no ASCII de s, len si es todo ASCII
+static inline size_t json_scan_ascii(const char *s, size_t len) {
+#ifdef JSON_SIMD_X86
+    if (json_simd() == JSON_SIMD_AVX2) return json_scan_ascii_avx2(s, len);
+    return json_scan_ascii_sse2(s, len);
+#else
+    return json_scan_ascii_scalar(s, len);
+#endif
+}
+
+// Longitud de la secuencia UTF-8 valida que empieza en s, 0 si es invalida
+// Rechaza formas sobrelargas, sustitutos UTF-16 y valores mayores a U+10FFFF
+static inline size_t utf8_sequence_length(const unsigned char *s, size_t len) {
+    unsigned char c = s[0];
+    if (c < 0x80) return 1;
+    if (c >= 0xC2 && c <= 0xDF) {
+        return len >= 2 && (s[1] & 0xC0) == 0x80 ? 2 : 0;
+    }
+    if (c >= 0xE0 && c <= 0xEF) {
+        if (len < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) return 0;
+        if (c == 0xE0 && s[1] < 0xA0) return 0; // Sobrelarga
+        if (c == 0xED && s[1] > 0x9F) return 0; // Sustituto
+        return 3;
+    }
+    if (c >= 0xF0 && c <= 0xF4) {
+        if (len < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80) return 0;
+        if (c == 0xF0 && s[1] < 0x90) return 0; // Sobrelarga
+        if (c == 0xF4 && s[1] > 0x8F) return 0; // Mayor a U+10FFFF
+        return 4;
+    }
+    return 0;
+}
+
+// Retorna 1 si s es UTF-8 valido; los tramos ASCII se saltan con el recorrido vectorizado
+static inline int utf8_validate(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        i += json_scan_ascii(s + i, len - i);
+        // Valida las secuencias multibyte hasta volver a texto ASCII
+        while (i < len && (unsigned char)s[i] >= 0x80) {
+            size_t n = utf8_sequence_length((const unsigned char *)s + i, len - i);
+            if (n == 0) return 0;
+            i += n;
+        }
+    }
+    return 1;
+}
+
+// Escribe src escapado para una cadena JSON (sin las comillas) en dst, que tiene dst_size bytes
+// Retorna la longitud escrita, o -1 si no cabe; dst siempre queda terminado en '\0'
+static inline int json_escape(char *dst, size_t dst_size, const char *src, size_t src_len) {
+    static const char hex[] = "0123456789abcdef";
+    if (dst_size == 0) return -1;
+    size_t out = 0;
+    size_t i = 0;
+    while (i < src_len) {
+        // Copia en bloque el tramo que no necesita escape
+        size_t run = json_scan_escape(src + i, src_len - i);
+        if (out + run >= dst_size) {
+            dst[out] = '\0';
+            return -1;
+        }
+        memcpy(dst + out, src + i, run);
+        out += run;
+        i += run;
+        if (i == src_len) break;
+        unsigned char c = (unsigned char)src[i++];
+        char esc[7];
+        size_t n = 2;
+        esc[0] = '\\';
+        switch (c) {
+            case '"':  esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            default:
+                memcpy(esc + 1, "u00", 3);
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xF];
+                n = 6;
+                break;
+        }
+        if (out + n >= dst_size) {
+            dst[out] = '\0';
+            return -1;
+        }
+        memcpy(dst + out, esc, n);
+        out += n;
+    }
+    dst[out] = '\0';
+    return (int)out;
+}
+
+// Valor de 4 digitos hexadecimales, -1 si alguno no es valido
+static inline long json_hex4(const char *s) {
+    long v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+// Escribe el codigo cp en UTF-8 en out, retorna los bytes escritos
+static inline size_t utf8_encode(unsigned long cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// Longitud del prefijo de s[0..len) que no termina en una secuencia UTF-8 cortada
+static inline size_t utf8_complete_prefix(const char *s, size_t len) {
+    size_t lead = len;
+    // Retrocede sobre los bytes de continuacion hasta el byte inicial de la ultima secuencia
+    while (lead > 0 && len - lead < 3 && ((unsigned char)s[lead - 1] & 0xC0) == 0x80) lead--;
+    if (lead == 0) return len;
+    unsigned char c = (unsigned char)s[lead - 1];
+    size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return len - (lead - 1) < need ? lead - 1 : len;
+}
+
+// Decodifica la cadena JSON que empieza en src (despues de la comilla de apertura) hasta su comilla de cierre
+// Escribe el texto en dst recortandolo a dst_size - 1 bytes; retorna un puntero a la comilla de cierre o NULL si es invalida
+static inline const char *json_unescape(const char *src, size_t src_len, char *dst, size_t dst_size) {
+    size_t out = 0;
+    size_t i = 0;
+    int truncated = 0;
+    while (1) {
+        // Copia en bloque hasta la proxima comilla o barra invertida
+        size_t run = json_scan_quote(src + i, src_len - i);
+        // Despues del primer recorte no se copia nada mas, el texto no queda con huecos en el medio
+        size_t room = !truncated && out < dst_size - 1 ? dst_size - 1 - out : 0;
+        if (run > room) truncated = 1;
+        memcpy(dst + out, src + i, run < room ? run : room);
+        out += run < room ? run : room;
+        i += run;
+        if (i >= src_len) return NULL; // Sin comilla de cierre
+        if (src[i] == '"') break;
+        // Secuencia de escape
+        if (i + 1 >= src_len) return NULL;
+        char c = src[i + 1];
+        char buf[4];
+        size_t n = 1;
+        i += 2;
+        switch (c) {
+            case '"':  buf[0] = '"'; break;
+            case '\\': buf[0] = '\\'; break;
+            case '/':  buf[0] = '/'; break;
+            case 'n':  buf[0] = '\n'; break;
+            case 'r':  buf[0] = '\r'; break;
+            case 't':  buf[0] = '\t'; break;
+            case 'b':  buf[0] = '\b'; break;
+            case 'f':  buf[0] = '\f'; break;
+            case 'u': {
+                if (i + 4 > src_len) return NULL;
+                long cp = json_hex4(src + i);
+                if (cp < 0) return NULL;
+                i += 4;
+                // Par de sustitutos UTF-16 para codigos mayores a U+FFFF
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    long low = i + 6 <= src_len && src[i] == '\\' && src[i + 1] == 'u' ? json_hex4(src + i + 2) : -1;
+                    if (low < 0xDC00 || low > 0xDFFF) return NULL;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    i += 6;
+                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                    return NULL;
+                }
+                n = utf8_encode((unsigned long)cp, buf);
+                break;
+            }
+            default:
+                return NULL;
+        }
+        // Solo se copia el caracter completo para no cortar una secuencia UTF-8
+        if (!truncated && out + n <= dst_size - 1) {
+            memcpy(dst + out, buf, n);
+            out += n;
+        } else {
+            truncated = 1;
+        }
+    }
+    // Si se recorto el texto no se deja un caracter a medias
+    if (truncated) out = utf8_complete_prefix(dst, out);
+    dst[out] = '\0';
+    return src + i;
+}
+
+#endif
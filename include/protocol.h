@@ -5,15 +5,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "json_escape.h"
 
 #define MAX_FIELD_LENGTH    256 // Longitud max para campos de texto
 #define MAX_MESSAGE_LENGTH 1024  // Longitud max para mensajes JSON
+#define MAX_JSON_LENGTH    (4 * MAX_MESSAGE_LENGTH) // Longitud max de una trama, deja lugar para los escapes
 
 // definicion de constantes para identificar el tipo de mensaje en el protocolo
 #define MSG_TYPE_REGISTER             "register"
 #define MSG_TYPE_REGISTER_SUCCESS     "register_success"
 #define MSG_TYPE_BROADCAST            "broadcast"
 #define MSG_TYPE_PRIVATE              "private"
+#define MSG_TYPE_PRIVATE_RESPONSE     "private_response"
 #define MSG_TYPE_LIST_USERS           "list_users"
 #define MSG_TYPE_LIST_USERS_RESPONSE  "list_users_response"
 #define MSG_TYPE_USER_INFO            "user_info"
@@ -23,6 +26,17 @@
 #define MSG_TYPE_DISCONNECT           "disconnect"
 #define MSG_TYPE_USER_DISCONNECTED    "user_disconnected"
 #define MSG_TYPE_ERROR                "error"
+#define MSG_TYPE_OFFLINE_MESSAGES     "offline_messages"
+#define MSG_TYPE_SUBSCRIBE_PRESENCE   "subscribe_presence"
+#define MSG_TYPE_UNSUBSCRIBE_PRESENCE "unsubscribe_presence"
+#define MSG_TYPE_SERVER_RESTART       "server_restart"
+#define MSG_TYPE_ACK                  "ack"
+#define MSG_TYPE_SEARCH               "search"
+#define MSG_TYPE_SEARCH_RESPONSE      "search_response"
+// Tipos que solo viajan entre nodos de una federacion
+#define MSG_TYPE_NODE_HELLO           "node_hello"
+#define MSG_TYPE_NODE_USER_ADD        "node_user_add"
+#define MSG_TYPE_NODE_USER_REMOVE     "node_user_remove"
 
 // definicion de constantes para los estados de usuario
 #define STATUS_ACTIVE   "ACTIVO"
@@ -38,15 +52,22 @@
    - timestamp: Fecha y hora en formato
    - userList: Lista de usuarios 
    - hasUserList: Bandera que indica si se incluye userList 1 si si, 0 si no
+   - contentIsJson: 1 si content es un objeto o arreglo JSON que se manda tal cual, 0 si es texto
+   - id: Identificador opcional que asigna el cliente a sus mensajes, 0 si no se usa
+   - ack: Confirmacion acumulativa opcional de los seq recibidos, 0 si no se usa
 */
 typedef struct {
     char type[MAX_FIELD_LENGTH];
     char sender[MAX_FIELD_LENGTH];
-    char target[MAX_FIELD_LENGTH];    // Opcional
+    char target[MAX_FIELD_LENGTH];    // Opcional, un usuario o un arreglo JSON de usuarios
     char content[MAX_MESSAGE_LENGTH]; // Puede ser una cadena arreglo u objeto en formato JSON
     char timestamp[MAX_FIELD_LENGTH];
     char userList[MAX_MESSAGE_LENGTH]; // Opcional se usa por ejemplo en register_success
     int  hasUserList;                  // Bandera 1 si se debe incluir userList 0 en caso contrario
+    int  targetIsList;                 // Bandera 1 si target es un arreglo JSON de usuarios
+    int  contentIsJson;                // Bandera 1 si content es un objeto o arreglo JSON valido
+    unsigned long long id;             // Opcional id del mensaje asignado por el cliente
+    unsigned long long ack;            // Opcional ack acumulativo
 } ProtocolMessage;
 
 // Obtiene la fecha y hora actual en formato buffer
@@ -56,99 +77,266 @@ static inline void get_current_timestamp(char *buffer, size_t bufsize) {
     strftime(buffer, bufsize, "%Y-%m-%dT%H:%M:%S", tm_info);
 }
 
-// Extrae el valor de la clave key de una cadena JSON soportando cadenas, arreglos, objetos y null
-static inline int extract_json_value(const char *json, const char *key, char *value, size_t value_size) {
-    if (!json || !key || !value) return -1; // Verifica que los punteros no sean nulos
+// Retorna un puntero al cierre del arreglo u objeto JSON que empieza en start, o NULL si no cierra
+// Respeta anidamiento y cadenas, asi un ] o } dentro de un texto no corta el valor
+static inline const char *json_skip_composite(const char *start) {
+    int depth = 0;
+    const char *p = start;
+    while (*p) {
+        if (*p == '\"') {
+            // Salta la cadena completa, con sus comillas escapadas
+            p++;
+            while (1) {
+                p += json_scan_quote(p, strlen(p));
+                if (*p == '\0') return NULL;
+                if (*p == '\"') break;
+                if (p[1] == '\0') return NULL;
+                p += 2; // Barra invertida y el caracter escapado
+            }
+        } else if (*p == '[' || *p == '{') {
+            depth++;
+        } else if (*p == ']' || *p == '}') {
+            if (--depth == 0) return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+#define JSON_MAX_DEPTH 32 // Anidamiento maximo que se acepta al validar un valor JSON
+
+// Salta espacios en blanco de JSON
+static inline const char *json_skip_space(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
+}
+
+// Valida el valor JSON que empieza en p y termina antes de end, retorna un puntero despues del valor o NULL si es invalido
+// Las cadenas se recorren con json_scan_escape, asi el texto comun se salta de a bloques
+static inline const char *json_skip_value(const char *p, const char *end, int depth) {
+    p = json_skip_space(p);
+    if (*p == '\"') {
+        p++;
+        while (1) {
+            p += json_scan_escape(p, (size_t)(end - p)); // Se detiene en comilla, barra invertida o control
+            if (p >= end) return NULL;
+            if (*p == '\"') return p + 1;
+            if (*p != '\\') return NULL; // Caracter de control sin escapar
+            char c = p[1];
+            if (c == 'u') {
+                if (json_hex4(p + 2) < 0) return NULL;
+                p += 6;
+            } else if (c != '\0' && strchr("\"\\/bfnrt", c)) {
+                p += 2;
+            } else {
+                return NULL;
+            }
+        }
+    }
+    if (*p == '{' || *p == '[') {
+        if (depth >= JSON_MAX_DEPTH) return NULL;
+        int object = *p == '{';
+        char close = object ? '}' : ']';
+        p = json_skip_space(p + 1);
+        if (*p == close) return p + 1;
+        while (1) {
+            if (object) {
+                // Clave en cadena seguida de dos puntos
+                if (*p != '\"' || !(p = json_skip_value(p, end, depth + 1))) return NULL;
+                p = json_skip_space(p);
+                if (*p != ':') return NULL;
+                p++;
+            }
+            if (!(p = json_skip_value(p, end, depth + 1))) return NULL;
+            p = json_skip_space(p);
+            if (*p == close) return p + 1;
+            if (*p != ',') return NULL;
+            p = json_skip_space(p + 1);
+        }
+    }
+    if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0) return p + 4;
+    if (strncmp(p, "false", 5) == 0) return p + 5;
+    // Numero: -?entero(.fraccion)?(exponente)?
+    const char *q = p;
+    if (*q == '-') q++;
+    if (*q < '0' || *q > '9') return NULL;
+    if (*q == '0') q++;
+    else while (*q >= '0' && *q <= '9') q++;
+    if (*q == '.') {
+        q++;
+        if (*q < '0' || *q > '9') return NULL;
+        while (*q >= '0' && *q <= '9') q++;
+    }
+    if (*q == 'e' || *q == 'E') {
+        q++;
+        if (*q == '+' || *q == '-') q++;
+        if (*q < '0' || *q > '9') return NULL;
+        while (*q >= '0' && *q <= '9') q++;
+    }
+    return q;
+}
+
+// Longitud del objeto o arreglo JSON bien formado que empieza en start, 0 si no empieza uno valido
+static inline size_t json_composite_length(const char *start) {
+    if (!start || (*start != '{' && *start != '[')) return 0;
+    const char *end = json_skip_value(start, start + strlen(start), 0);
+    return end ? (size_t)(end - start) : 0;
+}
+
+// Retorna un puntero al inicio del valor de la clave key en una cadena JSON, o NULL si no esta
+static inline const char *json_value_start(const char *json, const char *key) {
     char pattern[64];
     snprintf(pattern, sizeof(pattern), "\"%s\":", key); // Construye el patrón a buscar para la clave
     
-    // Busca el patrón en el JSON
-    char *start = strstr(json, pattern);
-    if (!start) return -1;
+    // Busca el patrón en el JSON; dentro de una cadena escapada la clave no puede aparecer asi
+    const char *start = strstr(json, pattern);
+    if (!start) return NULL;
     start += strlen(pattern);
     
     // Saltar espacios y tabulaciones
     while (*start == ' ' || *start == '\t') start++; 
+    return start;
+}
+
+// Extrae el valor de la clave key de una cadena JSON soportando cadenas, arreglos, objetos y null
+// Las cadenas se devuelven sin escapes; arreglos y objetos se devuelven como JSON
+static inline int extract_json_value(const char *json, const char *key, char *value, size_t value_size) {
+    if (!json || !key || !value || value_size == 0) return -1; // Verifica que los punteros no sean nulos
+    const char *start = json_value_start(json, key);
+    if (!start) return -1;
     
     if (*start == '\"') {
-        // Valor en cadena
+        // Valor en cadena, se decodifican los escapes
         start++; // Salta la comilla de apertura
-        char *end = strchr(start, '\"');
-        if (!end) return -1;
-        size_t len = end - start;
-        if (len >= value_size) len = value_size - 1;
-        strncpy(value, start, len);
-        value[len] = '\0';
-    } else if (*start == '[') {
-        // Valor es un arreglo JSON
-        char *end = strchr(start, ']');
+        if (!json_unescape(start, strlen(start), value, value_size)) return -1;
+    } else if (*start == '[' || *start == '{') {
+        // Valor es un arreglo u objeto JSON
+        const char *end = json_skip_composite(start);
         if (!end) return -1;
         size_t len = end - start + 1;
         if (len >= value_size) len = value_size - 1;
-        strncpy(value, start, len);
-        value[len] = '\0';
-    } else if (*start == '{') {
-        // Valor es un objeto JSON
-        char *end = strchr(start, '}');
-        if (!end) return -1;
-        size_t len = end - start + 1;
-        if (len >= value_size) len = value_size - 1;
-        strncpy(value, start, len);
+        memcpy(value, start, len);
         value[len] = '\0';
     } else {
-        // Valor literal null
-        char *end = start;
+        // Valor literal null o numero
+        const char *end = start;
         while (*end && *end != ',' && *end != '}') end++;
         size_t len = end - start;
         if (len >= value_size) len = value_size - 1;
-        strncpy(value, start, len);
+        memcpy(value, start, len);
         value[len] = '\0';
     }
     
     return 0;
 }
 
+// Recorre un arreglo JSON de cadenas como ["a","b"], copia la siguiente cadena en out y avanza el cursor
+// Retorna 1 si encontro un elemento o 0 al llegar al final del arreglo
+static inline int json_array_next_string(const char **cursor, char *out, size_t out_size) {
+    const char *p = *cursor;
+    if (!p) return 0;
+    // Avanza hasta la comilla de apertura del siguiente elemento
+    while (*p && *p != '\"' && *p != ']') p++;
+    if (*p != '\"') {
+        *cursor = p;
+        return 0;
+    }
+    p++;
+    const char *end = json_unescape(p, strlen(p), out, out_size);
+    if (!end) {
+        *cursor = p + strlen(p);
+        return 0;
+    }
+    *cursor = end + 1; // Continua despues de la comilla de cierre
+    return 1;
+}
+
+// Agrega texto tal cual al JSON en construccion, retorna -1 si no cabe
+static inline int json_put_raw(char *buf, size_t size, size_t *off, const char *text) {
+    size_t len = strlen(text);
+    if (*off + len >= size) return -1;
+    memcpy(buf + *off, text, len + 1);
+    *off += len;
+    return 0;
+}
+
+// Agrega text como cadena JSON entre comillas y con escapes, retorna -1 si no cabe
+static inline int json_put_string(char *buf, size_t size, size_t *off, const char *text) {
+    if (*off + 2 >= size) return -1;
+    buf[(*off)++] = '\"';
+    int n = json_escape(buf + *off, size - *off - 1, text, strlen(text));
+    if (n < 0) return -1;
+    *off += (size_t)n;
+    buf[(*off)++] = '\"';
+    buf[*off] = '\0';
+    return 0;
+}
+
 // Si el campo target no es vacio se incluye
 // Si la bandera hasUserList esta activa se incluye el campo userList
-// Para content Si comienza con { o [ se asume que ya es JSON de lo contrario se lo envuelve entre comillas
-// Convierte una estructura ProtocolMessage a una cadena JSON y la retorna 
-static inline char *serialize_message(const ProtocolMessage *msg) {
-    if (!msg) return NULL;
+// content se copia tal cual solo si contentIsJson esta activa, de lo contrario se lo envuelve entre comillas
+// Los campos de texto se escapan, asi una comilla en un mensaje no rompe el JSON ni agrega campos
+// Convierte una estructura ProtocolMessage a JSON dentro de json_str sin reservar memoria
+// Retorna la longitud escrita o -1 en error o si no cabe
+static inline int serialize_message_into(const ProtocolMessage *msg, char *json_str, size_t size) {
+    if (!msg || !json_str || size == 0) return -1;
     
-    char content_field[MAX_MESSAGE_LENGTH];
-    if (msg->content[0] == '{' || msg->content[0] == '[') {
-        // Se asume que es objeto o arreglo JSON ya formateado
-        snprintf(content_field, sizeof(content_field), "%s", msg->content);
+    size_t off = 0;
+    if (json_put_raw(json_str, size, &off, "{\"type\": ") < 0 ||
+        json_put_string(json_str, size, &off, msg->type) < 0 ||
+        json_put_raw(json_str, size, &off, ", \"sender\": ") < 0 ||
+        json_put_string(json_str, size, &off, msg->sender) < 0)
+        return -1;
+    if (msg->target[0] != '\0') {
+        // Se incluye target, como arreglo JSON ya formateado si es una lista de usuarios
+        if (json_put_raw(json_str, size, &off, ", \"target\": ") < 0 ||
+            (msg->targetIsList ? json_put_raw(json_str, size, &off, msg->target)
+                               : json_put_string(json_str, size, &off, msg->target)) < 0)
+            return -1;
+    }
+    if (json_put_raw(json_str, size, &off, ", \"content\": ") < 0) return -1;
+    if (msg->contentIsJson) {
+        // Objeto o arreglo JSON ya formateado, validado al recibirlo o armado por el servidor
+        if (json_put_raw(json_str, size, &off, msg->content) < 0) return -1;
     } else {
         // Se lo envuelve en comillas para que sea una cadena JSON
-        snprintf(content_field, sizeof(content_field), "\"%s\"", msg->content);
+        if (json_put_string(json_str, size, &off, msg->content) < 0) return -1;
+    }
+    if (msg->hasUserList) {
+        // Se incluye userList
+        if (json_put_raw(json_str, size, &off, ", \"userList\": ") < 0 ||
+            json_put_raw(json_str, size, &off, msg->userList) < 0)
+            return -1;
     }
+    if (json_put_raw(json_str, size, &off, ", \"timestamp\": ") < 0 ||
+        json_put_string(json_str, size, &off, msg->timestamp) < 0)
+        return -1;
     
-    char *json_str = (char *)malloc(MAX_MESSAGE_LENGTH);
+    // Campos opcionales de entrega confiable
+    char numbers[64];
+    if (msg->id && msg->ack)
+        snprintf(numbers, sizeof(numbers), ", \"id\": %llu, \"ack\": %llu", msg->id, msg->ack);
+    else if (msg->id)
+        snprintf(numbers, sizeof(numbers), ", \"id\": %llu", msg->id);
+    else if (msg->ack)
+        snprintf(numbers, sizeof(numbers), ", \"ack\": %llu", msg->ack);
+    else
+        numbers[0] = '\0';
+    if (json_put_raw(json_str, size, &off, numbers) < 0 ||
+        json_put_raw(json_str, size, &off, "}") < 0)
+        return -1;
+    return (int)off;
+}
+
+// Convierte una estructura ProtocolMessage a una cadena JSON y la retorna 
+static inline char *serialize_message(const ProtocolMessage *msg) {
+    if (!msg) return NULL;
+    char *json_str = (char *)malloc(MAX_JSON_LENGTH);
     if (!json_str) return NULL; // Si falla la asignacion de memoria se retorna null
-    
-    if (strlen(msg->target) > 0 && msg->hasUserList) {
-        // Se incluye target' y userList
-        snprintf(json_str, MAX_MESSAGE_LENGTH,
-                 "{\"type\": \"%s\", \"sender\": \"%s\", \"target\": \"%s\", \"content\": %s, \"userList\": %s, \"timestamp\": \"%s\"}",
-                 msg->type, msg->sender, msg->target, content_field, msg->userList, msg->timestamp);
-    } else if (strlen(msg->target) > 0) {
-        // Se incluye target pero no userList
-        snprintf(json_str, MAX_MESSAGE_LENGTH,
-                 "{\"type\": \"%s\", \"sender\": \"%s\", \"target\": \"%s\", \"content\": %s, \"timestamp\": \"%s\"}",
-                 msg->type, msg->sender, msg->target, content_field, msg->timestamp);
-    } else if (msg->hasUserList) {
-        // Se incluye userList pero no target
-        snprintf(json_str, MAX_MESSAGE_LENGTH,
-                 "{\"type\": \"%s\", \"sender\": \"%s\", \"content\": %s, \"userList\": %s, \"timestamp\": \"%s\"}",
-                 msg->type, msg->sender, content_field, msg->userList, msg->timestamp);
-    } else {
-        // Sin target ni userList
-        snprintf(json_str, MAX_MESSAGE_LENGTH,
-                 "{\"type\": \"%s\", \"sender\": \"%s\", \"content\": %s, \"timestamp\": \"%s\"}",
-                 msg->type, msg->sender, content_field, msg->timestamp);
+    if (serialize_message_into(msg, json_str, MAX_JSON_LENGTH) < 0) {
+        free(json_str);
+        return NULL;
     }
-    
     return json_str;
 }
 
@@ -157,6 +345,8 @@ static inline char *serialize_message(const ProtocolMessage *msg) {
 // Parsea una cadena JSON y rellena ProtocolMessage retorna 0 si es exitoso o -1 en error
 static inline int deserialize_message(const char *json_str, ProtocolMessage *msg) {
     if (!json_str || !msg) return -1; // Verifica que el JSON y el mensaje no sean nulos
+    // Rechaza tramas que no son UTF-8 valido antes de copiar sus campos
+    if (!utf8_validate(json_str, strlen(json_str))) return -1;
     
      // Extrae el campo type si falla retorna error
     if (extract_json_value(json_str, "type", msg->type, MAX_FIELD_LENGTH) < 0)
@@ -167,6 +357,10 @@ static inline int deserialize_message(const char *json_str, ProtocolMessage *msg
     // Extrae el campo content si falla se deja vacio
     if (extract_json_value(json_str, "content", msg->content, MAX_MESSAGE_LENGTH) < 0)
         msg->content[0] = '\0';
+    // Solo un objeto o arreglo valido que entra completo se reenvia como JSON; una cadena que empieza con {
+    // o un JSON cortado se tratan como texto y se escapan al serializar
+    size_t composite = json_composite_length(json_value_start(json_str, "content"));
+    msg->contentIsJson = composite > 0 && composite < MAX_MESSAGE_LENGTH;
     // Extrae el campo timestamp si falla se deja vacio
     if (extract_json_value(json_str, "timestamp", msg->timestamp, MAX_FIELD_LENGTH) < 0)
         msg->timestamp[0] = '\0';
@@ -174,15 +368,28 @@ static inline int deserialize_message(const char *json_str, ProtocolMessage *msg
     // Extrae el campo target opcional si no se encuentra se deja vacio
     if (extract_json_value(json_str, "target", msg->target, MAX_FIELD_LENGTH) < 0)
         msg->target[0] = '\0';
+    // Un target arreglo valido es una lista de usuarios; si no cabe en target se deja vacio y el llamador lo relee
+    const char *target_start = json_value_start(json_str, "target");
+    composite = json_composite_length(target_start);
+    msg->targetIsList = composite > 0 && *target_start == '[';
+    if (msg->targetIsList && composite >= MAX_FIELD_LENGTH) msg->target[0] = '\0';
     
-    // Extrae el campo userList opcional establece la bandera hasUserList segun si se encontro
-    if (extract_json_value(json_str, "userList", msg->userList, MAX_MESSAGE_LENGTH) < 0) {
+    // Extrae el campo userList opcional, la bandera hasUserList solo se activa si es un arreglo valido completo
+    const char *list_start = json_value_start(json_str, "userList");
+    composite = json_composite_length(list_start);
+    if (composite > 0 && *list_start == '[' && composite < MAX_MESSAGE_LENGTH &&
+        extract_json_value(json_str, "userList", msg->userList, MAX_MESSAGE_LENGTH) == 0) {
+        msg->hasUserList = 1;
+    } else {
         msg->userList[0] = '\0';
         msg->hasUserList = 0;
-    } else {
-        msg->hasUserList = 1;
     }
     
+    // Extrae los campos opcionales id y ack, 0 si no vienen
+    char number[32];
+    msg->id = extract_json_value(json_str, "id", number, sizeof(number)) == 0 ? strtoull(number, NULL, 10) : 0;
+    msg->ack = extract_json_value(json_str, "ack", number, sizeof(number)) == 0 ? strtoull(number, NULL, 10) : 0;
+    
     return 0;
 }
 
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <libwebsockets.h>
+#include "protocol.h"
+#include "capture_format.h"
+
+// Reproduce contra un servidor una captura hecha con server_chat -r
+// Abre una conexion por cada conexion capturada, manda cada trama en su momento original (o acelerado)
+// y mide cuanto tarda el servidor en contestar las tramas que tienen respuesta
+// Un hilo marca el ritmo: duerme hasta el momento de cada trama y despierta al hilo de servicio con
+// lws_cancel_service, igual que el servidor cuando otro hilo encola tramas
+
+#define REPLAY_MAX_PENDING  256  // Respuestas esperadas a la vez por conexion
+#define REPLAY_CONNECT_SECS 10   // Espera maxima para que todas las conexiones queden establecidas
+
+// Trama de la captura
+typedef struct {
+    uint64_t t_ns;       // Momento de llegada relativo al inicio de la captura
+    uint32_t conn;       // Indice de la conexion en conns
+    uint32_t len;        // Longitud de la trama, 0 en los cierres
+    int close;           // 1 si el registro es el cierre de la conexion
+    const char *data;    // Trama dentro del archivo cargado
+} ReplayFrame;
+
+// Respuesta que se espera del servidor para una trama enviada
+typedef struct {
+    char type[MAX_FIELD_LENGTH];  // Tipo de la respuesta esperada
+    int own_sender;               // 1 si ademas el sender debe ser el propio usuario (eco de un broadcast)
+    uint64_t sent_ns;             // Momento en que se escribio la trama
+} ReplayPending;
+
+// Conexion de la reproduccion
+typedef struct {
+    uint32_t capture_id;          // Identificador de la conexion en la captura
+    struct lws *wsi;
+    int established;
+    int closed;
+    uint32_t *frames;             // Indices en frames de las tramas de esta conexion, en orden
+    uint32_t frame_count;
+    uint32_t due;                 // Tramas cuyo momento ya llego
+    uint32_t written;             // Tramas ya escritas
+    char username[MAX_FIELD_LENGTH];  // Tomado de la trama de registro, para reconocer el eco de sus broadcasts
+    ReplayPending pending[REPLAY_MAX_PENDING];
+    int pending_head;
+    int pending_count;
+    char rx_type[MAX_FIELD_LENGTH];   // Tipo de la trama que se esta recibiendo por fragmentos
+    char rx_sender[MAX_FIELD_LENGTH];
+} ReplayConn;
+
+static ReplayFrame *frames = NULL;
+static uint32_t frame_count = 0;
+static ReplayConn *conns = NULL;
+static uint32_t conn_count = 0;
+static volatile int force_exit = 0;
+static struct lws_context *context = NULL;
+static double speed = 1.0;          // Factor de velocidad, 0 para mandar sin esperas
+static uint64_t replay_start = 0;   // Momento en que empezo la reproduccion
+static uint32_t released = 0;       // Tramas cuyo momento ya llego, lo avanza el hilo de ritmo
+static uint32_t dispatched = 0;     // Tramas ya repartidas a su conexion por el hilo de servicio
+
+// Contadores de la reproduccion
+static unsigned long frames_sent = 0, frames_received = 0, connect_errors = 0, unmatched = 0;
+static unsigned long long bytes_sent = 0, bytes_received = 0;
+
+// Latencias medidas en nanosegundos
+typedef struct {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+} LatencySeries;
+
+// Las respuestas del servidor y el eco de los broadcasts se miden por separado,
+// asi se ve si una respuesta espera detras del chat cuando los broadcasts saturan la conexion
+static LatencySeries control_latency = { NULL, 0, 0 };
+static LatencySeries chat_latency = { NULL, 0, 0 };
+
+// Reloj monotono en nanosegundos
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sigint_handler(int sig) {
+    force_exit = 1;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Carga la captura completa en memoria y reparte sus tramas por conexion, retorna 0 si es valida
+static int load_capture(const char *path, char **file_data) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = size > 0 ? (char *)malloc((size_t)size) : NULL;
+    if (!data || fread(data, 1, (size_t)size, f) != (size_t)size ||
+        size < CAPTURE_MAGIC_LEN || memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fclose(f);
+        free(data);
+        return -1;
+    }
+    fclose(f);
+    *file_data = data;
+
+    // Primera pasada: contar registros completos; una captura cortada a la mitad se usa hasta donde llega
+    size_t off = CAPTURE_MAGIC_LEN;
+    size_t capacity = 0;
+    uint32_t *ids = NULL;
+    while (off + sizeof(CaptureRecord) <= (size_t)size) {
+        CaptureRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        size_t len = rec.len & CAPTURE_LEN_MASK;
+        if (off + sizeof(rec) + len > (size_t)size) break;
+        if (frame_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            ReplayFrame *grown = (ReplayFrame *)realloc(frames, capacity * sizeof(ReplayFrame));
+            uint32_t *grown_ids = (uint32_t *)realloc(ids, capacity * sizeof(uint32_t));
+            if (grown) frames = grown;
+            if (grown_ids) ids = grown_ids;
+            if (!grown || !grown_ids) {
+                free(ids);
+                return -1;
+            }
+        }
+        ReplayFrame *fr = &frames[frame_count];
+        fr->t_ns = rec.t_ns;
+        fr->conn = rec.conn;
+        fr->len = (uint32_t)len;
+        fr->close = (rec.len & CAPTURE_CLOSE) != 0;
+        fr->data = data + off + sizeof(rec);
+        ids[frame_count++] = rec.conn;
+        off += sizeof(rec) + len;
+    }
+
+    // Identificadores distintos ordenados, cada uno es una conexion de la reproduccion
+    qsort(ids, frame_count, sizeof(uint32_t), compare_u32);
+    uint32_t distinct = 0;
+    for (uint32_t i = 0; i < frame_count; i++)
+        if (i == 0 || ids[i] != ids[i - 1]) ids[distinct++] = ids[i];
+    conns = (ReplayConn *)calloc(distinct ? distinct : 1, sizeof(ReplayConn));
+    if (!conns) {
+        free(ids);
+        return -1;
+    }
+    conn_count = distinct;
+    for (uint32_t i = 0; i < distinct; i++) conns[i].capture_id = ids[i];
+    free(ids);
+
+    // Segunda pasada: cada trama apunta a su conexion y cada conexion lista sus tramas en orden
+    for (uint32_t i = 0; i < frame_count; i++) {
+        uint32_t lo = 0, hi = conn_count;
+        while (hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            if (conns[mid].capture_id <= frames[i].conn) lo = mid; else hi = mid;
+        }
+        frames[i].conn = lo;
+        conns[lo].frame_count++;
+    }
+    for (uint32_t c = 0; c < conn_count; c++) {
+        conns[c].frames = (uint32_t *)malloc(conns[c].frame_count * sizeof(uint32_t));
+        if (!conns[c].frames) return -1;
+        conns[c].frame_count = 0;
+    }
+    for (uint32_t i = 0; i < frame_count; i++) {
+        ReplayConn *c = &conns[frames[i].conn];
+        c->frames[c->frame_count++] = i;
+    }
+    return 0;
+}
+
+// Guarda una latencia medida
+static void record_latency(LatencySeries *series, uint64_t ns) {
+    if (series->count == series->capacity) {
+        size_t capacity = series->capacity ? series->capacity * 2 : 4096;
+        uint64_t *grown = (uint64_t *)realloc(series->ns, capacity * sizeof(uint64_t));
+        if (!grown) return;
+        series->ns = grown;
+        series->capacity = capacity;
+    }
+    series->ns[series->count++] = ns;
+}
+
+// Anota la respuesta que el servidor deberia mandar a una trama recien escrita
+static void expect_response(ReplayConn *c, const ReplayFrame *fr, uint64_t sent) {
+    char json[MAX_JSON_LENGTH + 1];
+    char type[MAX_FIELD_LENGTH];
+    size_t len = fr->len < MAX_JSON_LENGTH ? fr->len : MAX_JSON_LENGTH;
+    memcpy(json, fr->data, len);
+    json[len] = '\0';
+    if (extract_json_value(json, "type", type, sizeof(type)) != 0) return;
+
+    const char *expected = NULL;
+    int own_sender = 0;
+    if (strcmp(type, MSG_TYPE_REGISTER) == 0) {
+        extract_json_value(json, "sender", c->username, sizeof(c->username));
+        expected = MSG_TYPE_REGISTER_SUCCESS;
+    } else if (strcmp(type, MSG_TYPE_BROADCAST) == 0) {
+        expected = MSG_TYPE_BROADCAST; // El servidor tambien entrega el broadcast a quien lo manda
+        own_sender = 1;
+    } else if (strcmp(type, MSG_TYPE_LIST_USERS) == 0) {
+        expected = MSG_TYPE_LIST_USERS_RESPONSE;
+    } else if (strcmp(type, MSG_TYPE_USER_INFO) == 0) {
+        expected = MSG_TYPE_USER_INFO_RESPONSE;
+    } else if (strcmp(type, MSG_TYPE_SEARCH) == 0) {
+        expected = MSG_TYPE_SEARCH_RESPONSE;
+    }
+    // Los privados y cambios de estado no tienen respuesta para quien los manda
+    if (!expected || c->pending_count == REPLAY_MAX_PENDING) return;
+
+    ReplayPending *p = &c->pending[(c->pending_head + c->pending_count) % REPLAY_MAX_PENDING];
+    strncpy(p->type, expected, MAX_FIELD_LENGTH - 1);
+    p->type[MAX_FIELD_LENGTH - 1] = '\0';
+    p->own_sender = own_sender;
+    p->sent_ns = sent;
+    c->pending_count++;
+}
+
+// Busca la respuesta esperada mas antigua que coincide con la trama recibida y mide su latencia
+// Un error del servidor contesta a la trama pendiente mas antigua
+static void match_response(ReplayConn *c, uint64_t received) {
+    int is_error = strcmp(c->rx_type, MSG_TYPE_ERROR) == 0;
+    for (int i = 0; i < c->pending_count; i++) {
+        ReplayPending *p = &c->pending[(c->pending_head + i) % REPLAY_MAX_PENDING];
+        if (!is_error && (strcmp(p->type, c->rx_type) != 0 ||
+                          (p->own_sender && strcmp(c->rx_sender, c->username) != 0)))
+            continue;
+        record_latency(p->own_sender ? &chat_latency : &control_latency, received - p->sent_ns);
+        // Se quita de la cola corriendo las anteriores un lugar
+        for (int j = i; j > 0; j--)
+            c->pending[(c->pending_head + j) % REPLAY_MAX_PENDING] =
+                c->pending[(c->pending_head + j - 1) % REPLAY_MAX_PENDING];
+        c->pending_head = (c->pending_head + 1) % REPLAY_MAX_PENDING;
+        c->pending_count--;
+        return;
+    }
+    if (is_error) unmatched++;
+}
+
+// Hilo de ritmo: libera cada trama en su momento original dividido por el factor de velocidad
+static void *pacer_thread(void *arg) {
+    for (uint32_t i = 0; i < frame_count && !force_exit; ) {
+        if (speed > 0) {
+            uint64_t due = replay_start + (uint64_t)((double)frames[i].t_ns / speed);
+            struct timespec ts = { (time_t)(due / 1000000000ull), (long)(due % 1000000000ull) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        // Se liberan juntas todas las tramas que ya vencieron
+        uint64_t elapsed = now_ns() - replay_start;
+        do {
+            i++;
+        } while (i < frame_count && (speed == 0 || (double)frames[i].t_ns / speed <= (double)elapsed));
+        __atomic_store_n(&released, i, __ATOMIC_RELEASE);
+        lws_cancel_service(context);
+    }
+    return NULL;
+}
+
+// Reparte a sus conexiones las tramas liberadas por el hilo de ritmo, desde el hilo de servicio
+static void dispatch_released(void) {
+    uint32_t limit = __atomic_load_n(&released, __ATOMIC_ACQUIRE);
+    for (; dispatched < limit; dispatched++) {
+        ReplayConn *c = &conns[frames[dispatched].conn];
+        c->due++;
+        if (c->wsi && c->established) lws_callback_on_writable(c->wsi);
+    }
+}
+
+// Funcion callback de las conexiones de la reproduccion
+static int callback_replay(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+    ReplayConn *c = (ReplayConn *)user;
+    if (reason == LWS_CALLBACK_EVENT_WAIT_CANCELLED) {
+        // El hilo de ritmo libero tramas nuevas
+        dispatch_released();
+        return 0;
+    }
+    if (!c) return 0;
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            c->established = 1;
+            if (c->written < c->due) lws_callback_on_writable(wsi);
+            break;
+
+        case LWS_CALLBACK_CLIENT_WRITEABLE:
+            {
+                // Una trama por evento, se pide otro si quedan tramas cuyo momento ya llego
+                if (c->written >= c->due) break;
+                const ReplayFrame *fr = &frames[c->frames[c->written++]];
+                if (fr->close) {
+                    lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+                    return -1;
+                }
+                unsigned char buffer[LWS_PRE + MAX_JSON_LENGTH];
+                size_t n = fr->len < MAX_JSON_LENGTH ? fr->len : MAX_JSON_LENGTH;
+                memcpy(&buffer[LWS_PRE], fr->data, n);
+                uint64_t sent = now_ns();
+                if (lws_write(wsi, &buffer[LWS_PRE], n, LWS_WRITE_TEXT) < (int)n) return -1;
+                frames_sent++;
+                bytes_sent += n;
+                expect_response(c, fr, sent);
+                if (c->written < c->due) lws_callback_on_writable(wsi);
+            }
+            break;
+
+        case LWS_CALLBACK_CLIENT_RECEIVE:
+            {
+                uint64_t received = now_ns();
+                bytes_received += len;
+                // El tipo y el sender vienen al principio, se toman del primer fragmento
+                if (lws_is_first_fragment(wsi)) {
+                    char json[MAX_JSON_LENGTH + 1];
+                    size_t n = len < MAX_JSON_LENGTH ? len : MAX_JSON_LENGTH;
+                    memcpy(json, in, n);
+                    json[n] = '\0';
+                    c->rx_type[0] = c->rx_sender[0] = '\0';
+                    extract_json_value(json, "type", c->rx_type, sizeof(c->rx_type));
+                    extract_json_value(json, "sender", c->rx_sender, sizeof(c->rx_sender));
+                }
+                if (lws_is_final_fragment(wsi)) {
+                    frames_received++;
+                    match_response(c, received);
+                }
+            }
+            break;
+
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            connect_errors++;
+            c->closed = 1;
+            c->wsi = NULL;
+            break;
+
+        case LWS_CALLBACK_CLIENT_CLOSED:
+            c->closed = 1;
+            c->wsi = NULL;
+            break;
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+// Definicion del protocolo de las conexiones de la reproduccion, el mismo que usa el cliente
+static struct lws_protocols protocols[] = {
+    {
+        "chat-protocol",
+        callback_replay,
+        0,
+        MAX_JSON_LENGTH,
+    },
+    { NULL, NULL, 0, 0 }
+};
+
+// Percentil p de las latencias ordenadas, en milisegundos
+static double latency_percentile(const LatencySeries *series, double p) {
+    if (series->count == 0) return 0.0;
+    size_t idx = (size_t)(p * (double)(series->count - 1) + 0.5);
+    return (double)series->ns[idx] / 1e6;
+}
+
+// Ordena una serie y muestra sus percentiles
+static void print_latency(const char *label, LatencySeries *series) {
+    if (series->count == 0) return;
+    qsort(series->ns, series->count, sizeof(uint64_t), compare_u64);
+    printf("  %-10s %zu: p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms\n", label, series->count,
+           latency_percentile(series, 0.50), latency_percentile(series, 0.90), latency_percentile(series, 0.99),
+           (double)series->ns[series->count - 1] / 1e6);
+}
+
+int main(int argc, char **argv) {
+    // -x factor de velocidad (2 = el doble de rapido, 0 = sin esperas), -w segundos de espera al final
+    // -t TLS verificando el certificado, -C autoridad certificante propia, -k sin verificar (solo pruebas)
+    int wait_seconds = 2;
+    int use_tls = 0, insecure = 0;
+    const char *ca_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:w:tkC:")) != -1) {
+        switch (opt) {
+            case 'x': speed = atof(optarg); break;
+            case 'w': wait_seconds = atoi(optarg); break;
+            case 't': use_tls = 1; break;
+            case 'k': use_tls = insecure = 1; break;
+            case 'C': use_tls = 1; ca_file = optarg; break;
+            default:
+                fprintf(stderr, "Uso: %s [-x factor] [-w segundos] [-t] [-C ca.pem] [-k] <captura> <IPdelservidor> <puertodelservidor>\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 3 || speed < 0 || wait_seconds < 0) {
+        fprintf(stderr, "Uso: %s [-x factor] [-w segundos] [-t] [-C ca.pem] [-k] <captura> <IPdelservidor> <puertodelservidor>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *capture = argv[optind];
+    const char *server_address = argv[optind + 1];
+    int port = atoi(argv[optind + 2]);
+    if (port <= 0) {
+        fprintf(stderr, "Puerto inválido.\n");
+        return EXIT_FAILURE;
+    }
+
+    char *file_data = NULL;
+    if (load_capture(capture, &file_data) != 0) {
+        fprintf(stderr, "No se pudo leer la captura %s.\n", capture);
+        return EXIT_FAILURE;
+    }
+    printf("Captura: %u tramas en %u conexiones, %.3f s.\n", frame_count, conn_count,
+           frame_count ? (double)frames[frame_count - 1].t_ns / 1e9 : 0.0);
+
+    signal(SIGINT, sigint_handler);
+    lws_set_log_level(LLL_ERR, NULL);
+
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.options = use_tls ? LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT : 0;
+    info.client_ssl_ca_filepath = ca_file; // NULL usa las autoridades del sistema
+    info.fd_limit_per_thread = conn_count + 16; // Una conexion por cada conexion capturada
+    context = lws_create_context(&info);
+    if (context == NULL) {
+        fprintf(stderr, "Error al crear el contexto de libwebsockets.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Todas las conexiones se abren antes de empezar, asi el handshake no se mide como latencia
+    for (uint32_t i = 0; i < conn_count; i++) {
+        struct lws_client_connect_info ci;
+        memset(&ci, 0, sizeof(ci));
+        ci.context = context;
+        ci.address = server_address;
+        ci.port = port;
+        ci.path = "/chat";
+        ci.host = server_address;
+        ci.origin = "origin";
+        ci.protocol = protocols[0].name;
+        ci.userdata = &conns[i]; // Cada conexion recibe su ReplayConn como datos de sesion
+        ci.pwsi = &conns[i].wsi;
+        ci.ssl_connection = use_tls ? LCCSCF_USE_SSL : 0;
+        if (insecure)
+            ci.ssl_connection |= LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK |
+                                 LCCSCF_ALLOW_EXPIRED | LCCSCF_ALLOW_INSECURE;
+        if (!lws_client_connect_via_info(&ci)) {
+            connect_errors++;
+            conns[i].closed = 1;
+        }
+    }
+    uint64_t deadline = now_ns() + (uint64_t)REPLAY_CONNECT_SECS * 1000000000ull;
+    while (!force_exit && now_ns() < deadline) {
+        uint32_t ready = 0;
+        for (uint32_t i = 0; i < conn_count; i++)
+            if (conns[i].established || conns[i].closed) ready++;
+        if (ready == conn_count) break;
+        lws_service(context, 10);
+    }
+
+    // Reproduccion: el hilo de ritmo libera las tramas y cada conexion las escribe al quedar escribible
+    replay_start = now_ns();
+    pthread_t pacer_tid;
+    if (pthread_create(&pacer_tid, NULL, pacer_thread, NULL) != 0) {
+        fprintf(stderr, "Error al crear el hilo de ritmo.\n");
+        lws_context_destroy(context);
+        return EXIT_FAILURE;
+    }
+    while (!force_exit) {
+        lws_service(context, 50);
+        // Termina cuando todas las tramas se liberaron y las conexiones vivas terminaron de escribirlas
+        if (dispatched < frame_count) continue;
+        int pending = 0;
+        for (uint32_t i = 0; i < conn_count && !pending; i++)
+            if (conns[i].wsi && conns[i].established && conns[i].written < conns[i].due) pending = 1;
+        if (!pending) break;
+    }
+    pthread_join(pacer_tid, NULL);
+    uint64_t replay_end = now_ns();
+
+    // Se espera a las respuestas que faltan
+    deadline = replay_end + (uint64_t)wait_seconds * 1000000000ull;
+    while (!force_exit && now_ns() < deadline) {
+        int waiting = 0;
+        for (uint32_t i = 0; i < conn_count; i++)
+            if (conns[i].wsi && conns[i].pending_count) waiting = 1;
+        if (!waiting) break;
+        lws_service(context, 10);
+    }
+    unsigned long lost = 0;
+    for (uint32_t i = 0; i < conn_count; i++) lost += (unsigned long)conns[i].pending_count;
+    lws_context_destroy(context);
+
+    // Informe
+    double seconds = (double)(replay_end - replay_start) / 1e9;
+    if (seconds <= 0) seconds = 1e-9;
+    printf("Conexiones: %u (%lu con error)\n", conn_count, connect_errors);
+    printf("Enviadas:   %lu tramas, %llu bytes en %.3f s (%.0f tramas/s, %.2f MB/s)\n",
+           frames_sent, bytes_sent, seconds, frames_sent / seconds, bytes_sent / seconds / 1e6);
+    printf("Recibidas:  %lu tramas, %llu bytes\n", frames_received, bytes_received);
+    printf("Latencia:   %zu respuestas, %lu sin respuesta, %lu errores sin trama pendiente\n",
+           control_latency.count + chat_latency.count, lost, unmatched);
+    print_latency("respuestas", &control_latency);
+    print_latency("broadcast", &chat_latency);
+
+    for (uint32_t i = 0; i < conn_count; i++) free(conns[i].frames);
+    free(conns);
+    free(frames);
+    free(control_latency.ns);
+    free(chat_latency.ns);
+    free(file_data);
+    return EXIT_SUCCESS;
+}
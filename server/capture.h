@@ -0,0 +1,141 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <libwebsockets.h>
+#include "capture_format.h"
+
+// Captura de las tramas entrantes para reproducirlas con chat_replay
+// El hilo de servicio solo copia cada trama a un buffer circular en memoria; un hilo aparte lo vuelca
+// al archivo. Si el disco no da abasto las tramas que no caben se descartan y se cuentan, nunca se espera
+
+#ifndef CAPTURE_BUFFER_BYTES
+#define CAPTURE_BUFFER_BYTES (8 * 1024 * 1024) // Buffer entre el hilo de servicio y el de escritura
+#endif
+
+static const char *capture_path = NULL;      // Archivo de captura, NULL si no se captura
+static FILE *capture_file = NULL;
+static char *capture_ring = NULL;             // Buffer circular de registros pendientes de escribir
+static size_t capture_head = 0;               // Primer byte pendiente
+static size_t capture_used = 0;               // Bytes pendientes
+static unsigned long capture_dropped = 0;     // Tramas descartadas por buffer lleno
+static int capture_running = 0;
+static int capture_stop = 0;
+static struct timespec capture_origin;        // Inicio de la captura
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t capture_tid;
+static uint32_t capture_next_conn = 0;        // Ultimo identificador de conexion asignado
+
+// Asigna un identificador nuevo a una conexion
+static inline uint32_t capture_conn_id(void) {
+    return __atomic_add_fetch(&capture_next_conn, 1, __ATOMIC_RELAXED);
+}
+
+// Copia bytes al buffer circular, se llama con capture_mutex tomado y espacio suficiente
+static inline void capture_put_locked(const void *data, size_t len) {
+    size_t tail = (capture_head + capture_used) % CAPTURE_BUFFER_BYTES;
+    size_t first = CAPTURE_BUFFER_BYTES - tail;
+    if (first > len) first = len;
+    memcpy(capture_ring + tail, data, first);
+    memcpy(capture_ring, (const char *)data + first, len - first);
+    capture_used += len;
+}
+
+// Registra una trama o un cierre de conexion con la hora monotonica actual
+static inline void capture_record(uint32_t conn, const void *data, size_t len, uint32_t flags) {
+    if (!capture_running) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CaptureRecord rec;
+    rec.t_ns = (uint64_t)(now.tv_sec - capture_origin.tv_sec) * 1000000000ull +
+               (uint64_t)(now.tv_nsec - capture_origin.tv_nsec);
+    rec.conn = conn;
+    rec.len = (uint32_t)len | flags;
+    pthread_mutex_lock(&capture_mutex);
+    if (!capture_running) {
+        // La captura termino mientras se preparaba el registro
+    } else if (capture_used + sizeof(rec) + len > CAPTURE_BUFFER_BYTES) {
+        capture_dropped++;
+    } else {
+        capture_put_locked(&rec, sizeof(rec));
+        if (len) capture_put_locked(data, len);
+        pthread_cond_signal(&capture_cond);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+// Registra una trama recibida por la conexion conn
+static inline void capture_frame(uint32_t conn, const void *data, size_t len) {
+    if (len > CAPTURE_LEN_MASK) return;
+    capture_record(conn, data, len, 0);
+}
+
+// Registra el cierre de la conexion conn
+static inline void capture_close(uint32_t conn) {
+    capture_record(conn, NULL, 0, CAPTURE_CLOSE);
+}
+
+// Hilo de escritura: vuelca al archivo los tramos contiguos del buffer circular
+static void *capture_writer(void *arg) {
+    pthread_mutex_lock(&capture_mutex);
+    while (1) {
+        while (capture_used == 0 && !capture_stop)
+            pthread_cond_wait(&capture_cond, &capture_mutex);
+        if (capture_used == 0 && capture_stop) break;
+        size_t n = CAPTURE_BUFFER_BYTES - capture_head;
+        if (n > capture_used) n = capture_used;
+        const char *chunk = capture_ring + capture_head;
+        pthread_mutex_unlock(&capture_mutex);
+        // El tramo sigue reservado hasta avanzar capture_head, el hilo de servicio no lo pisa
+        fwrite(chunk, 1, n, capture_file);
+        pthread_mutex_lock(&capture_mutex);
+        capture_head = (capture_head + n) % CAPTURE_BUFFER_BYTES;
+        capture_used -= n;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    fflush(capture_file);
+    return NULL;
+}
+
+// Abre el archivo de captura y lanza el hilo de escritura, retorna 0 si se inicio
+static inline int capture_start(const char *path) {
+    capture_file = fopen(path, "wb");
+    if (!capture_file) return -1;
+    capture_ring = (char *)malloc(CAPTURE_BUFFER_BYTES);
+    if (!capture_ring || fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture_file) != CAPTURE_MAGIC_LEN) {
+        fclose(capture_file);
+        free(capture_ring);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &capture_origin);
+    if (pthread_create(&capture_tid, NULL, capture_writer, NULL) != 0) {
+        fclose(capture_file);
+        free(capture_ring);
+        return -1;
+    }
+    capture_running = 1;
+    return 0;
+}
+
+// Termina de escribir lo pendiente y cierra el archivo de captura
+static inline void capture_shutdown(void) {
+    if (!capture_running) return;
+    pthread_mutex_lock(&capture_mutex);
+    capture_running = 0;
+    capture_stop = 1;
+    pthread_cond_signal(&capture_cond);
+    pthread_mutex_unlock(&capture_mutex);
+    pthread_join(capture_tid, NULL);
+    fclose(capture_file);
+    free(capture_ring);
+    if (capture_dropped)
+        lwsl_user("Captura: %lu tramas descartadas por buffer lleno.\n", capture_dropped);
+}
+
+#endif
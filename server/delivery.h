@@ -0,0 +1,70 @@
+#ifndef DELIVERY_H
+#define DELIVERY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Entrega confiable opcional por conexion
+// El cliente numera sus mensajes con un "id" desde 1; el servidor descarta repetidos dentro de una ventana
+// deslizante y confirma con un "ack" acumulativo que viaja dentro de las tramas que ya se iban a mandar.
+// Ademas cada trama saliente lleva un "seq" por conexion para que el cliente detecte huecos
+
+#define DEDUP_WINDOW_BITS 256 // Ids que pueden estar pendientes a la vez por conexion
+#define DEDUP_WINDOW_WORDS (DEDUP_WINDOW_BITS / 64)
+#define DELIVERY_TRAILER_ROOM 80 // Espacio reservado al final de cada trama para seq y ack
+#ifndef ACK_DELAY_SECONDS
+#define ACK_DELAY_SECONDS 1   // Tiempo maximo que un ack espera una trama donde viajar antes de mandarse solo
+#endif
+
+// Ventana deslizante de ids recibidos: 40 bytes contiguos por conexion
+// base es el menor id aun no recibido, el bit (id % DEDUP_WINDOW_BITS) marca los ids recibidos por encima de base
+typedef struct {
+    uint64_t base;                     // 0 mientras el cliente no haya mandado ningun id, despues desde 1
+    uint64_t bits[DEDUP_WINDOW_WORDS]; // Mapa de bits circular de la ventana
+} DedupWindow;
+
+// Resultado de registrar un id en la ventana
+typedef enum {
+    DEDUP_NEW = 0,     // Id nuevo, el mensaje se procesa
+    DEDUP_DUPLICATE,   // Id ya recibido, el mensaje se descarta pero se vuelve a confirmar
+    DEDUP_OUT_OF_WINDOW // Id demasiado adelantado, se descarta sin confirmar para que el cliente lo reenvie
+} DedupResult;
+
+// Registra id en la ventana y avanza base sobre los ids contiguos ya recibidos
+static inline DedupResult dedup_accept(DedupWindow *w, uint64_t id) {
+    // La ventana empieza en 1 y no en el primer id recibido, asi un id menor que llega despues no se toma por repetido
+    if (w->base == 0) w->base = 1;
+    if (id < w->base) return DEDUP_DUPLICATE;
+    if (id - w->base >= DEDUP_WINDOW_BITS) return DEDUP_OUT_OF_WINDOW;
+    uint64_t bit = id % DEDUP_WINDOW_BITS;
+    uint64_t mask = 1ULL << (bit & 63);
+    if (w->bits[bit >> 6] & mask) return DEDUP_DUPLICATE;
+    w->bits[bit >> 6] |= mask;
+    // Desliza la ventana mientras el id base ya este recibido
+    while (1) {
+        uint64_t b = w->base % DEDUP_WINDOW_BITS;
+        uint64_t m = 1ULL << (b & 63);
+        if (!(w->bits[b >> 6] & m)) break;
+        w->bits[b >> 6] &= ~m;
+        w->base++;
+    }
+    return DEDUP_NEW;
+}
+
+// Ack acumulativo: todos los ids hasta este valor ya se procesaron
+static inline uint64_t dedup_cumulative_ack(const DedupWindow *w) {
+    return w->base ? w->base - 1 : 0;
+}
+
+// Agrega seq y ack al final de un JSON que termina en llave de cierre
+// json debe tener DELIVERY_TRAILER_ROOM bytes libres despues de len; retorna la nueva longitud
+static inline size_t append_delivery_trailer(char *json, size_t len, uint64_t seq, uint64_t ack) {
+    if (len == 0 || json[len - 1] != '}') return len; // Trama truncada, se manda sin cambios
+    int n = snprintf(json + len - 1, DELIVERY_TRAILER_ROOM + 1, ", \"seq\": %llu, \"ack\": %llu}",
+                     (unsigned long long)seq, (unsigned long long)ack);
+    if (n < 0 || n > DELIVERY_TRAILER_ROOM) return len;
+    return len - 1 + (size_t)n;
+}
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <libwebsockets.h>
+#include "protocol.h"
+#include "pool.h"
+
+// Directorio de usuarios de la federacion
+// Cada nodo conoce a los demas por nombre y guarda en que nodo esta conectado cada usuario remoto.
+// Los usuarios locales siguen en la lista de clientes; aqui solo estan los de otros nodos
+
+#define FED_MAX_NODES     16    // Nodos vecinos que se pueden configurar
+#define FED_NAME_LENGTH   64    // Longitud maxima del nombre de un nodo
+#define DIRECTORY_BUCKETS 4096  // Cubetas de la tabla de usuarios remotos
+
+// Nodo vecino de la federacion
+// Cada par de nodos usa dos enlaces: cada uno manda por su enlace saliente y recibe por el entrante
+typedef struct {
+    char name[FED_NAME_LENGTH];   // Nombre del nodo, debe coincidir con el que usa en -n
+    char host[MAX_FIELD_LENGTH];  // Direccion donde escucha el nodo
+    int port;                     // Puerto donde escucha el nodo
+    struct lws *connecting;       // Enlace saliente que todavia no termino el handshake
+    struct lws *out_wsi;          // Enlace saliente establecido, NULL si esta caido
+    struct lws *in_wsi;           // Enlace entrante, NULL hasta recibir el saludo del nodo
+    unsigned long long hello_seq; // Seq del ultimo saludo aceptado del nodo, uno repetido se rechaza
+    time_t retry_at;              // Proximo intento de conexion del enlace saliente
+} FedNode;
+
+// Usuario conectado en otro nodo
+typedef struct DirEntry {
+    struct DirEntry *next;          // Siguiente entrada de la cubeta
+    int node;                       // Indice del nodo dueño en fed_nodes
+    char username[MAX_FIELD_LENGTH];
+} DirEntry;
+
+static char node_name[FED_NAME_LENGTH] = ""; // Nombre de este nodo, vacio si el servidor no esta federado
+static FedNode fed_nodes[FED_MAX_NODES];     // Nodos vecinos configurados con -P
+static int fed_node_count = 0;
+static DirEntry *directory[DIRECTORY_BUCKETS]; // Usuarios remotos por nombre
+// Protege el directorio y los enlaces de fed_nodes; se toma despues de client_list_mutex si se usan ambos
+static pthread_mutex_t directory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Retorna 1 si el servidor forma parte de una federacion
+static inline int federation_enabled(void) {
+    return node_name[0] != '\0';
+}
+
+// Agrega un nodo vecino descrito como nombre@host:puerto, retorna 0 si es valido
+static inline int fed_add_node(const char *spec) {
+    if (fed_node_count >= FED_MAX_NODES) return -1;
+    const char *at = strchr(spec, '@');
+    const char *colon = strrchr(spec, ':');
+    if (!at || !colon || colon < at || at == spec || (size_t)(at - spec) >= FED_NAME_LENGTH ||
+        (size_t)(colon - at - 1) >= MAX_FIELD_LENGTH || colon == at + 1)
+        return -1;
+    FedNode *n = &fed_nodes[fed_node_count];
+    memset(n, 0, sizeof(*n));
+    memcpy(n->name, spec, at - spec);
+    memcpy(n->host, at + 1, colon - at - 1);
+    n->port = atoi(colon + 1);
+    if (n->port <= 0) return -1;
+    fed_node_count++;
+    return 0;
+}
+
+// Indice del nodo con ese nombre, -1 si no esta configurado
+static inline int fed_node_by_name(const char *name) {
+    for (int i = 0; i < fed_node_count; i++)
+        if (strcmp(fed_nodes[i].name, name) == 0) return i;
+    return -1;
+}
+
+// Hash FNV-1a de un nombre de usuario
+static inline unsigned int directory_hash(const char *username) {
+    unsigned int h = 2166136261u;
+    while (*username) {
+        h ^= (unsigned char)*username++;
+        h *= 16777619u;
+    }
+    return h & (DIRECTORY_BUCKETS - 1);
+}
+
+// Retorna el nodo dueño de username, o -1 si no esta conectado en otro nodo
+static inline int directory_owner(const char *username) {
+    int node = -1;
+    pthread_mutex_lock(&directory_mutex);
+    for (DirEntry *e = directory[directory_hash(username)]; e != NULL; e = e->next) {
+        if (strcmp(e->username, username) == 0) {
+            node = e->node;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    return node;
+}
+
+// Registra que username esta conectado en node
+// Si dos nodos reclaman el mismo nombre gana el de nombre menor, asi todos los nodos llegan al mismo dueño
+// Retorna el nodo que queda como dueño, o -1 si no hay memoria
+static inline int directory_claim(const char *username, int node) {
+    pthread_mutex_lock(&directory_mutex);
+    DirEntry **bucket = &directory[directory_hash(username)];
+    DirEntry *e = *bucket;
+    while (e != NULL && strcmp(e->username, username) != 0) e = e->next;
+    if (e == NULL) {
+        e = (DirEntry *)heap_malloc(sizeof(DirEntry));
+        if (e) {
+            strncpy(e->username, username, MAX_FIELD_LENGTH - 1);
+            e->username[MAX_FIELD_LENGTH - 1] = '\0';
+            e->node = node;
+            e->next = *bucket;
+            *bucket = e;
+        }
+    } else if (strcmp(fed_nodes[node].name, fed_nodes[e->node].name) < 0) {
+        e->node = node;
+    }
+    int owner = e ? e->node : -1;
+    pthread_mutex_unlock(&directory_mutex);
+    return owner;
+}
+
+// Quita a username del directorio si su dueño es node, retorna 1 si lo quito
+// Se ignora si otro nodo gano el nombre, asi la salida del perdedor no borra al ganador
+static inline int directory_release(const char *username, int node) {
+    int removed = 0;
+    pthread_mutex_lock(&directory_mutex);
+    DirEntry **pp = &directory[directory_hash(username)];
+    while (*pp != NULL) {
+        DirEntry *e = *pp;
+        if (strcmp(e->username, username) == 0) {
+            if (e->node == node) {
+                *pp = e->next;
+                free(e);
+                removed = 1;
+            }
+            break;
+        }
+        pp = &e->next;
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    return removed;
+}
+
+// Quita todos los usuarios de node, por ejemplo cuando su enlace se cae
+// Las entradas se devuelven enlazadas para que el llamador avise sin tener tomado directory_mutex y las libere
+static inline DirEntry *directory_drop_node(int node) {
+    DirEntry *dropped = NULL;
+    pthread_mutex_lock(&directory_mutex);
+    for (int b = 0; b < DIRECTORY_BUCKETS; b++) {
+        DirEntry **pp = &directory[b];
+        while (*pp != NULL) {
+            DirEntry *e = *pp;
+            if (e->node == node) {
+                *pp = e->next;
+                e->next = dropped;
+                dropped = e;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    return dropped;
+}
+
+#endif
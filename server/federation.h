@@ -0,0 +1,303 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libwebsockets.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "server.h"
+
+// Enlaces entre nodos de una federacion
+// Cada nodo abre un enlace WebSocket saliente (protocolo chat-federation) hacia cada vecino configurado
+// y manda por el sus cambios de directorio, broadcasts, privados y presencias. Lo que llega por los
+// enlaces entrantes se entrega solo a los clientes locales y nunca se reenvia, la malla es completa
+// El subprotocolo escucha en el mismo puerto que los clientes, asi que el saludo se autentica con un
+// secreto compartido (-S): lleva un seq creciente y un HMAC-SHA256 del remitente, el destinatario y el seq.
+// Un saludo de otro nodo, para otro nodo, repetido o con el reloj corrido mas de FED_HELLO_SKEW_MS se rechaza
+
+#define FED_PROTOCOL       "chat-federation" // Subprotocolo de los enlaces entre nodos
+#define FED_RETRY_SECONDS  2                 // Espera entre intentos de conexion de un enlace caido
+#define FED_SECRET_MIN     16                // Bytes minimos del secreto compartido
+#define FED_SECRET_MAX     256               // Bytes maximos que se leen del archivo del secreto
+#define FED_HELLO_SKEW_MS  60000             // Diferencia maxima entre el seq de un saludo y el reloj local
+
+static struct lws_context *fed_context = NULL; // Contexto y vhost desde donde se abren los enlaces salientes
+static struct lws_vhost *fed_vhost = NULL;
+static int fed_use_tls = 0;             // 1 si los nodos atienden con TLS (-c), los enlaces salientes tambien lo usan
+static const char *fed_ca_path = NULL;  // Autoridades para los certificados de los vecinos, NULL usa las del sistema
+static unsigned char fed_secret[FED_SECRET_MAX]; // Secreto compartido por todos los nodos
+static size_t fed_secret_len = 0;
+
+// Lee el secreto compartido de path, sin el salto de linea final; retorna 0 si tiene al menos FED_SECRET_MIN bytes
+static inline int federation_load_secret(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    size_t n = fread(fed_secret, 1, sizeof(fed_secret), f);
+    fclose(f);
+    while (n > 0 && (fed_secret[n - 1] == '\n' || fed_secret[n - 1] == '\r')) n--;
+    fed_secret_len = n;
+    return n >= FED_SECRET_MIN ? 0 : -1;
+}
+
+// Escribe en hex el HMAC-SHA256 del saludo de from para to con ese seq; out debe tener 65 bytes
+static inline int federation_hello_mac(const char *from, const char *to, unsigned long long seq, char *out) {
+    char data[2 * FED_NAME_LENGTH + 64];
+    int n = snprintf(data, sizeof(data), MSG_TYPE_NODE_HELLO "\n%s\n%s\n%llu", from, to, seq);
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len = 0;
+    if (n < 0 || (size_t)n >= sizeof(data) ||
+        !HMAC(EVP_sha256(), fed_secret, (int)fed_secret_len, (const unsigned char *)data, (size_t)n, mac, &mac_len))
+        return -1;
+    for (unsigned int i = 0; i < mac_len && i < 32; i++) snprintf(out + 2 * i, 3, "%02x", mac[i]);
+    out[64] = '\0';
+    return 0;
+}
+
+// Milisegundos del reloj de pared, el seq de los saludos
+static inline unsigned long long federation_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ull + (unsigned long long)ts.tv_nsec / 1000000ull;
+}
+
+// Verifica el saludo msg del nodo node; retorna 0 si es autentico y no repetido, se llama con directory_mutex tomado
+static inline int federation_check_hello(int node, const ProtocolMessage *msg) {
+    char seq_text[32], mac[72], expect[65];
+    if (!msg->contentIsJson || strcmp(msg->target, node_name) != 0 ||
+        extract_json_value(msg->content, "seq", seq_text, sizeof(seq_text)) != 0 ||
+        extract_json_value(msg->content, "mac", mac, sizeof(mac)) != 0)
+        return -1;
+    char *end;
+    unsigned long long seq = strtoull(seq_text, &end, 10);
+    unsigned long long now = federation_now_ms();
+    if (end == seq_text || *end != '\0' || seq <= fed_nodes[node].hello_seq ||
+        seq + FED_HELLO_SKEW_MS < now || seq > now + FED_HELLO_SKEW_MS)
+        return -1;
+    if (strlen(mac) != 64 || federation_hello_mac(fed_nodes[node].name, node_name, seq, expect) != 0 ||
+        CRYPTO_memcmp(mac, expect, 64) != 0)
+        return -1;
+    fed_nodes[node].hello_seq = seq;
+    return 0;
+}
+
+// Abre los enlaces salientes que esten caidos, solo desde el hilo de servicio
+static inline void federation_connect_peers(void) {
+    if (!federation_enabled() || !fed_context) return;
+    time_t now = time(NULL);
+    for (int i = 0; i < fed_node_count; i++) {
+        FedNode *n = &fed_nodes[i];
+        if (n->out_wsi || n->connecting || now < n->retry_at) continue;
+        n->retry_at = now + FED_RETRY_SECONDS;
+        struct lws_client_connect_info ci;
+        memset(&ci, 0, sizeof(ci));
+        ci.context = fed_context;
+        ci.vhost = fed_vhost;
+        ci.address = n->host;
+        ci.port = n->port;
+        ci.path = "/";
+        ci.host = n->host;
+        ci.origin = n->host;
+        ci.protocol = FED_PROTOCOL;
+        ci.local_protocol_name = FED_PROTOCOL;
+        // El vecino escucha en el mismo puerto que sus clientes: con TLS el enlace tambien negocia TLS
+        // y el certificado del vecino se verifica contra las autoridades de -A o las del sistema
+        ci.ssl_connection = fed_use_tls ? LCCSCF_USE_SSL : 0;
+        ci.pwsi = &n->connecting; // libwebsockets lo pone en NULL si la conexion falla
+        lws_client_connect_via_info(&ci);
+    }
+}
+
+// Indice del nodo cuyo enlace saliente o entrante es wsi, -1 si no es un enlace conocido
+static inline int federation_node_of(struct lws *wsi, int outbound) {
+    int node = -1;
+    pthread_mutex_lock(&directory_mutex);
+    for (int i = 0; i < fed_node_count && node < 0; i++) {
+        if (outbound ? (fed_nodes[i].out_wsi == wsi || fed_nodes[i].connecting == wsi)
+                     : fed_nodes[i].in_wsi == wsi)
+            node = i;
+    }
+    pthread_mutex_unlock(&directory_mutex);
+    return node;
+}
+
+// El enlace saliente hacia un nodo quedo establecido: se saluda y se manda el directorio local completo
+static inline void federation_link_up(struct lws *wsi) {
+    int node = federation_node_of(wsi, 1);
+    if (node < 0) return;
+    pthread_mutex_lock(&directory_mutex);
+    fed_nodes[node].connecting = NULL;
+    fed_nodes[node].out_wsi = wsi;
+    pthread_mutex_unlock(&directory_mutex);
+    lwsl_user("Enlace con el nodo %s establecido.\n", fed_nodes[node].name);
+
+    // Saludo autenticado; el seq crece aunque el reloj no avance entre dos reconexiones
+    static unsigned long long last_seq = 0;
+    unsigned long long seq = federation_now_ms();
+    if (seq <= last_seq) seq = last_seq + 1;
+    last_seq = seq;
+    char mac[65];
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.type, MSG_TYPE_NODE_HELLO, MAX_FIELD_LENGTH);
+    strncpy(msg.sender, node_name, MAX_FIELD_LENGTH);
+    strncpy(msg.target, fed_nodes[node].name, MAX_FIELD_LENGTH - 1);
+    if (federation_hello_mac(node_name, fed_nodes[node].name, seq, mac) != 0) return;
+    snprintf(msg.content, MAX_MESSAGE_LENGTH, "{\"seq\": %llu, \"mac\": \"%s\"}", seq, mac);
+    msg.contentIsJson = 1;
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(&msg, json, sizeof(json));
+    if (n >= 0) enqueue_frame(wsi, json, (size_t)n, OUT_CONTROL);
+
+    // Usuarios locales, para que el vecino reconstruya su directorio tras un corte
+    strncpy(msg.type, MSG_TYPE_NODE_USER_ADD, MAX_FIELD_LENGTH);
+    pthread_mutex_lock(&client_list_mutex);
+    for (size_t i = 0; i < client_count; i++) {
+        strncpy(msg.target, client_hot[i].client->username, MAX_FIELD_LENGTH - 1);
+        n = serialize_message_into(&msg, json, sizeof(json));
+        if (n >= 0) enqueue_frame(wsi, json, (size_t)n, OUT_CONTROL);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+// El enlace saliente se cerro o no se pudo abrir: se reintenta en FED_RETRY_SECONDS
+static inline void federation_link_down(struct lws *wsi) {
+    pthread_mutex_lock(&directory_mutex);
+    for (int i = 0; i < fed_node_count; i++) {
+        if (fed_nodes[i].out_wsi == wsi || fed_nodes[i].connecting == wsi) {
+            if (fed_nodes[i].out_wsi == wsi)
+                lwsl_user("Enlace con el nodo %s caido.\n", fed_nodes[i].name);
+            fed_nodes[i].out_wsi = NULL;
+            fed_nodes[i].connecting = NULL;
+        }
+    }
+    pthread_mutex_unlock(&directory_mutex);
+}
+
+// Avisa a los clientes locales que un usuario remoto se desconecto
+static inline void federation_publish_gone(const char *username) {
+    ProtocolMessage disc_msg;
+    memset(&disc_msg, 0, sizeof(disc_msg));
+    strncpy(disc_msg.type, MSG_TYPE_USER_DISCONNECTED, MAX_FIELD_LENGTH);
+    strncpy(disc_msg.sender, "server", MAX_FIELD_LENGTH);
+    snprintf(disc_msg.content, MAX_MESSAGE_LENGTH, "%s ha salido", username);
+    get_current_timestamp(disc_msg.timestamp, MAX_FIELD_LENGTH);
+    publish_presence(username, &disc_msg);
+}
+
+// Se cerro el enlace entrante de un nodo: sus usuarios se dan por desconectados hasta que vuelva
+static inline void federation_inbound_closed(struct lws *wsi) {
+    int node = federation_node_of(wsi, 0);
+    if (node < 0) return;
+    pthread_mutex_lock(&directory_mutex);
+    fed_nodes[node].in_wsi = NULL;
+    pthread_mutex_unlock(&directory_mutex);
+    DirEntry *e = directory_drop_node(node);
+    while (e != NULL) {
+        DirEntry *next = e->next;
+        federation_publish_gone(e->username);
+        free(e);
+        e = next;
+    }
+}
+
+// Otro nodo gano el nombre de un usuario local: se cierra la conexion local con un error
+static inline void federation_evict_local(const char *username) {
+    struct lws *wsi = NULL;
+    pthread_mutex_lock(&client_list_mutex);
+    Client *client = (Client *)roster_find(username);
+    if (client) wsi = client_wsi(client);
+    if (wsi) {
+        ProtocolMessage error_msg;
+        memset(&error_msg, 0, sizeof(error_msg));
+        strncpy(error_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+        strncpy(error_msg.sender, "server", MAX_FIELD_LENGTH);
+        strncpy(error_msg.content, "Nombre de usuario ya conectado en otro nodo.", MAX_MESSAGE_LENGTH);
+        get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
+        send_message(wsi, &error_msg);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    if (!wsi) return;
+    remove_client(username);
+    lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION,
+                     (unsigned char *)"Nombre de usuario duplicado", strlen("Nombre de usuario duplicado"));
+    lws_set_timeout(wsi, PENDING_TIMEOUT_CLOSE_SEND, 1);
+}
+
+// Procesa una trama recibida por un enlace entrante, retorna -1 si el enlace debe cerrarse
+static inline int federation_receive(struct lws *wsi, const char *json_str) {
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    if (deserialize_message(json_str, &msg) != 0) return 0; // Trama invalida, se descarta
+
+    if (strcmp(msg.type, MSG_TYPE_NODE_HELLO) == 0) {
+        // El nodo se identifica; solo se aceptan nodos configurados con -P que conocen el secreto
+        int node = fed_node_by_name(msg.sender);
+        if (node < 0 || fed_secret_len == 0) {
+            lwsl_err("Enlace de un nodo desconocido (%s) rechazado.\n", msg.sender);
+            return -1;
+        }
+        pthread_mutex_lock(&directory_mutex);
+        int ok = federation_check_hello(node, &msg) == 0;
+        if (ok) fed_nodes[node].in_wsi = wsi;
+        pthread_mutex_unlock(&directory_mutex);
+        if (!ok) {
+            lwsl_err("Saludo del nodo %s rechazado: autenticacion invalida o repetida.\n", msg.sender);
+            return -1;
+        }
+        return 0;
+    }
+    int node = federation_node_of(wsi, 0);
+    if (node < 0) return -1; // Nada se acepta antes del saludo
+
+    if (strcmp(msg.type, MSG_TYPE_NODE_USER_ADD) == 0) {
+        if (find_client(msg.target)) {
+            // El mismo nombre se registro a la vez aqui y en el otro nodo: gana el nodo de nombre menor
+            if (strcmp(fed_nodes[node].name, node_name) > 0) return 0;
+            federation_evict_local(msg.target);
+        }
+        directory_claim(msg.target, node);
+    } else if (strcmp(msg.type, MSG_TYPE_NODE_USER_REMOVE) == 0) {
+        if (directory_release(msg.target, node))
+            federation_publish_gone(msg.target);
+    } else if (strcmp(msg.type, MSG_TYPE_BROADCAST) == 0) {
+        // Se difunde solo a los clientes locales
+        broadcast_message(&msg);
+        search_submit(0, msg.sender, msg.content, msg.timestamp, NULL, 0);
+    } else if (strcmp(msg.type, MSG_TYPE_PRIVATE) == 0 && msg.targetIsList) {
+        // Lista de destinatarios de este nodo, se entrega sin volver a reenviar
+        send_private_multicast(&msg, msg.target, 0, NULL, 0);
+    } else if (strcmp(msg.type, MSG_TYPE_PRIVATE) == 0) {
+        deliver_local_private(&msg, msg.target);
+    } else if (strcmp(msg.type, MSG_TYPE_STATUS_UPDATE) == 0) {
+        char username[MAX_FIELD_LENGTH];
+        strncpy(username, msg.target, MAX_FIELD_LENGTH);
+        msg.target[0] = '\0';
+        publish_presence(username, &msg);
+    }
+    return 0;
+}
+
+// Revisa las colas de los enlaces tras un lws_cancel_service, desde el hilo de servicio
+static inline void federation_service_pending(void) {
+    pthread_mutex_lock(&directory_mutex);
+    for (int i = 0; i < fed_node_count; i++) {
+        struct lws *wsi = fed_nodes[i].out_wsi;
+        if (!wsi) continue;
+        SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+        pthread_mutex_lock(&pss->lock);
+        int evict = pss->evict;
+        int pending = outbound_pending_locked(pss);
+        pthread_mutex_unlock(&pss->lock);
+        if (evict)
+            arm_eviction(wsi, pss);
+        else if (pending)
+            lws_callback_on_writable(wsi);
+    }
+    pthread_mutex_unlock(&directory_mutex);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "pool.h"
+
+// Nombres de usuario internados: cada nombre se guarda una sola vez con un contador de referencias
+// El registro Client guarda solo un puntero, y el nombre ocupa lo que mide y no MAX_FIELD_LENGTH bytes
+
+#define INTERN_BUCKETS 4096 // Cubetas de la tabla de nombres
+
+// Nombre internado, el texto va a continuacion del encabezado
+typedef struct InternedName {
+    struct InternedName *next;  // Siguiente nombre de la cubeta
+    unsigned int refs;          // Registros que usan este nombre
+    unsigned int hash;
+    char name[];
+} InternedName;
+
+static InternedName *intern_table[INTERN_BUCKETS];
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Hash FNV-1a de un nombre
+static inline unsigned int intern_hash(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Retorna la copia internada de name y suma una referencia, o NULL si no hay memoria
+static inline const char *intern_acquire(const char *name) {
+    unsigned int h = intern_hash(name);
+    InternedName **bucket = &intern_table[h % INTERN_BUCKETS];
+    pthread_mutex_lock(&intern_mutex);
+    InternedName *e = *bucket;
+    while (e != NULL && (e->hash != h || strcmp(e->name, name) != 0)) e = e->next;
+    if (e == NULL) {
+        size_t len = strlen(name);
+        e = (InternedName *)heap_malloc(sizeof(InternedName) + len + 1);
+        if (e) {
+            e->refs = 0;
+            e->hash = h;
+            memcpy(e->name, name, len + 1);
+            e->next = *bucket;
+            *bucket = e;
+        }
+    }
+    if (e) e->refs++;
+    pthread_mutex_unlock(&intern_mutex);
+    return e ? e->name : NULL;
+}
+
+// Resta una referencia a un nombre devuelto por intern_acquire y lo libera con la ultima
+static inline void intern_release(const char *name) {
+    if (!name) return;
+    InternedName *target = (InternedName *)(name - offsetof(InternedName, name));
+    pthread_mutex_lock(&intern_mutex);
+    if (--target->refs == 0) {
+        InternedName **pp = &intern_table[target->hash % INTERN_BUCKETS];
+        while (*pp != target) pp = &(*pp)->next;
+        *pp = target->next;
+        free(target);
+    }
+    pthread_mutex_unlock(&intern_mutex);
+}
+
+#endif
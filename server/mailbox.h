@@ -0,0 +1,536 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "pool.h"
+#include <libwebsockets.h>
+
+// Buzones de mensajes privados para usuarios desconectados
+// Cada buzon guarda en memoria los mensajes mas recientes y vuelca el resto a un archivo compacto
+// Cuando el usuario se registra el buzon se entrega en tramas offline_messages de a MAILBOX_CHUNK_BYTES
+// El archivo se nombra con un hash de 64 bits del usuario y empieza con una cabecera que tiene el nombre
+// completo; dos nombres con el mismo hash usan sufijos distintos, asi nadie recibe el buzon de otro
+// Los volcados y lecturas de disco se hacen en el hilo que guarda o entrega, que suele ser el de servicio:
+// son acotados (MAILBOX_MAX_BYTES por buzon) pero un disco lento demora a todas las conexiones mientras tanto
+
+#ifndef MAILBOX_MAX_MESSAGES
+#define MAILBOX_MAX_MESSAGES  1024        // Maximo de mensajes por buzon
+#endif
+#ifndef MAILBOX_MAX_BYTES
+#define MAILBOX_MAX_BYTES     (96 * 1024) // Maximo de bytes de contenido por buzon
+#endif
+#ifndef MAILBOX_MEMORY_MESSAGES
+#define MAILBOX_MEMORY_MESSAGES 16        // Mensajes que se guardan en memoria antes de volcar a disco
+#endif
+#ifndef MAILBOX_MAX_USERS
+#define MAILBOX_MAX_USERS     4096        // Maximo de buzones abiertos a la vez
+#endif
+#define MAILBOX_BUCKETS       1024        // Cubetas de la tabla hash de buzones
+#define MAILBOX_PROBES        8           // Sufijos que se prueban para un mismo hash antes de rendirse
+#define MAILBOX_PATH_MAX      4096        // Longitud maxima de la ruta de un archivo de buzon
+#define MAILBOX_CHUNK_BYTES   (16 * 1024) // Tamano buscado de cada trama offline_messages
+#define MAILBOX_MAGIC         "MBX1"      // Comienzo de la cabecera de los archivos de buzon
+// Peor caso de un mensaje dentro de una trama, con cada byte escapado como \u00XX
+#define MAILBOX_RECORD_MAX_JSON (64 + 6 * (2 * MAX_FIELD_LENGTH + MAX_MESSAGE_LENGTH))
+
+// Configuracion de los buzones, se puede cambiar desde las opciones del servidor
+static const char *mailbox_dir = "buzones";     // Directorio donde se vuelcan los buzones
+static long mailbox_ttl = 7 * 24 * 3600;        // Segundos que se conserva un mensaje
+
+// Cabecera de cada registro tanto en memoria como en disco, seguida de sender, timestamp y content
+typedef struct {
+    int64_t  stored_at;   // Momento en que se guardo el mensaje
+    uint16_t sender_len;  // Longitud del remitente
+    uint16_t ts_len;      // Longitud del timestamp original
+    uint32_t content_len; // Longitud del contenido
+} MailboxRecord;
+
+// Cabecera de un archivo de buzon, seguida del nombre del usuario sin terminador
+typedef struct {
+    char magic[4];        // MAILBOX_MAGIC
+    uint16_t name_len;    // Longitud del nombre
+} MailboxFileHeader;
+
+// Mensaje guardado en memoria
+typedef struct MailboxEntry {
+    struct MailboxEntry *next; // Siguiente mensaje del buzon
+    MailboxRecord rec;         // Cabecera del registro
+    char data[];               // sender, timestamp y content sin terminadores
+} MailboxEntry;
+
+// Buzon de un usuario desconectado
+typedef struct Mailbox {
+    struct Mailbox *next;             // Siguiente buzon de la cubeta
+    char username[MAX_FIELD_LENGTH];  // Destinatario
+    MailboxEntry *head;               // Mensajes en memoria mas antiguos primero
+    MailboxEntry *tail;               // Ultimo mensaje en memoria
+    size_t mem_count;                 // Mensajes en memoria
+    size_t total_count;               // Mensajes en memoria y en disco
+    size_t total_bytes;               // Bytes de contenido en memoria y en disco
+    int spilled;                      // 1 si existe un archivo en disco
+    time_t disk_newest;               // Momento del mensaje mas reciente en disco
+    int probe;                        // Sufijo del archivo en disco, -1 si no hay uno libre
+} Mailbox;
+
+static Mailbox *mailbox_table[MAILBOX_BUCKETS];
+static size_t mailbox_count = 0;
+static pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Funcion hash djb2 para los nombres de usuario
+static inline unsigned long mailbox_hash(const char *s) {
+    unsigned long h = 5381;
+    while (*s) h = ((h << 5) + h) + (unsigned char)*s++;
+    return h;
+}
+
+// Hash FNV-1a de 64 bits del nombre, da el nombre del archivo del buzon
+static inline uint64_t mailbox_file_hash(const char *s) {
+    uint64_t h = 14695981039346656037ull;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Escribe la ruta del archivo del buzon con el sufijo probe; retorna 0 o -1 si no cabe en size
+static inline int mailbox_probe_path(const char *username, int probe, char *path, size_t size) {
+    int n = snprintf(path, size, "%s/%016llx-%d.mbx", mailbox_dir,
+                     (unsigned long long)mailbox_file_hash(username), probe);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+// Lee la cabecera de un archivo de buzon; retorna 1 si es de username, 0 si es de otro usuario o -1 si es invalida
+static inline int mailbox_file_owner(FILE *f, const char *username) {
+    MailboxFileHeader h;
+    char name[MAX_FIELD_LENGTH];
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, MAILBOX_MAGIC, 4) != 0 || h.name_len >= sizeof(name) ||
+        fread(name, 1, h.name_len, f) != h.name_len)
+        return -1;
+    name[h.name_len] = '\0';
+    return strcmp(name, username) == 0;
+}
+
+// Busca el archivo del buzon de username: el sufijo de su archivo si existe o el primer sufijo libre, con la ruta en path
+// Retorna el sufijo, o -1 si todos los sufijos de ese hash son de otros usuarios o la ruta no cabe
+static inline int mailbox_find_file(const char *username, char *path, size_t size) {
+    int free_probe = -1;
+    for (int probe = 0; probe < MAILBOX_PROBES; probe++) {
+        if (mailbox_probe_path(username, probe, path, size) != 0) return -1;
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+            if (free_probe < 0) free_probe = probe;
+            continue;
+        }
+        int owner = mailbox_file_owner(f, username);
+        fclose(f);
+        if (owner == 1) return probe;
+    }
+    if (free_probe >= 0) mailbox_probe_path(username, free_probe, path, size);
+    return free_probe;
+}
+
+// Ruta que usaban las versiones anteriores: el nombre en hexadecimal; -1 si el nombre no entra completo
+static inline int mailbox_legacy_path(const char *username, char *path, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    int n = snprintf(path, size, "%s/", mailbox_dir);
+    if (n < 0 || (size_t)n >= size) return -1;
+    size_t pos = (size_t)n;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        if (pos + 2 + sizeof(".mbx") > size) return -1;
+        path[pos++] = hex[*p >> 4];
+        path[pos++] = hex[*p & 0x0f];
+    }
+    memcpy(path + pos, ".mbx", sizeof(".mbx"));
+    return 0;
+}
+
+// Recorre las cabeceras de los registros de un archivo de buzon abierto despues de su cabecera, sin leer los datos
+// Suma a mb los mensajes y los bytes de contenido con las mismas unidades que la cuenta en memoria
+static inline void mailbox_scan_file(FILE *f, Mailbox *mb) {
+    MailboxRecord rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        long data_len = (long)rec.sender_len + rec.ts_len + rec.content_len;
+        if (fseek(f, data_len, SEEK_CUR) != 0) break;
+        mb->total_count++;
+        mb->total_bytes += rec.content_len;
+        if ((time_t)rec.stored_at > mb->disk_newest) mb->disk_newest = (time_t)rec.stored_at;
+    }
+}
+
+// Busca el buzon de un usuario, si create es 1 lo crea cuando no existe; se llama con mailbox_mutex tomado
+static inline Mailbox *mailbox_lookup(const char *username, int create) {
+    unsigned long b = mailbox_hash(username) % MAILBOX_BUCKETS;
+    Mailbox *mb = mailbox_table[b];
+    while (mb != NULL) {
+        if (strcmp(mb->username, username) == 0) return mb;
+        mb = mb->next;
+    }
+    if (!create || mailbox_count >= MAILBOX_MAX_USERS) return NULL;
+    mb = (Mailbox *)heap_calloc(1, sizeof(Mailbox));
+    if (!mb) return NULL;
+    strncpy(mb->username, username, MAX_FIELD_LENGTH - 1);
+    // Si quedo un archivo de una ejecucion anterior se toma en cuenta para la cuota
+    char path[MAILBOX_PATH_MAX];
+    FILE *f;
+    mb->probe = mailbox_find_file(username, path, sizeof(path));
+    if (mb->probe >= 0 && (f = fopen(path, "rb")) != NULL) {
+        if (mailbox_file_owner(f, username) == 1) {
+            mb->spilled = 1;
+            mailbox_scan_file(f, mb);
+        }
+        fclose(f);
+    }
+    mb->next = mailbox_table[b];
+    mailbox_table[b] = mb;
+    mailbox_count++;
+    return mb;
+}
+
+// Quita un buzon de la tabla y libera sus mensajes en memoria; se llama con mailbox_mutex tomado
+static inline void mailbox_unlink(Mailbox *target) {
+    unsigned long b = mailbox_hash(target->username) % MAILBOX_BUCKETS;
+    Mailbox **pp = &mailbox_table[b];
+    while (*pp != NULL) {
+        if (*pp == target) {
+            *pp = target->next;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    MailboxEntry *e = target->head;
+    while (e != NULL) {
+        MailboxEntry *next = e->next;
+        free(e);
+        e = next;
+    }
+    free(target);
+    mailbox_count--;
+}
+
+// Vuelca los mensajes en memoria al archivo del buzon; retorna 0 si se escribio todo
+static inline int mailbox_spill(Mailbox *mb) {
+    char path[MAILBOX_PATH_MAX];
+    mkdir(mailbox_dir, 0700); // Puede existir ya
+    if (mb->probe < 0) mb->probe = mailbox_find_file(mb->username, path, sizeof(path));
+    if (mb->probe < 0 || mailbox_probe_path(mb->username, mb->probe, path, sizeof(path)) != 0) {
+        errno = ENAMETOOLONG; // Sin archivo libre para este nombre, los mensajes siguen en memoria
+        return -1;
+    }
+    FILE *f = fopen(path, "ab");
+    if (!f) return -1;
+    // Un archivo nuevo empieza con la cabecera que dice de quien es
+    if (fseek(f, 0, SEEK_END) != 0 || ftell(f) == 0) {
+        MailboxFileHeader h;
+        size_t name_len = strlen(mb->username);
+        memcpy(h.magic, MAILBOX_MAGIC, 4);
+        h.name_len = (uint16_t)name_len;
+        if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(mb->username, 1, name_len, f) != name_len) {
+            fclose(f);
+            return -1;
+        }
+    }
+    MailboxEntry *e = mb->head;
+    while (e != NULL) {
+        size_t data_len = e->rec.sender_len + e->rec.ts_len + e->rec.content_len;
+        if (fwrite(&e->rec, sizeof(MailboxRecord), 1, f) != 1 ||
+            fwrite(e->data, 1, data_len, f) != data_len) {
+            fclose(f);
+            return -1;
+        }
+        if (e->rec.stored_at > mb->disk_newest) mb->disk_newest = (time_t)e->rec.stored_at;
+        MailboxEntry *next = e->next;
+        free(e);
+        e = next;
+        mb->head = e;
+        mb->mem_count--;
+    }
+    mb->tail = NULL;
+    mb->spilled = 1;
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Vuelca a disco la parte en memoria de todos los buzones, antes de entregar el puerto a otro proceso o de terminar
+// Retorna la cantidad de buzones que no se pudieron volcar
+static inline int mailbox_flush_all(void) {
+    int failed = 0, flushed = 0;
+    pthread_mutex_lock(&mailbox_mutex);
+    for (int b = 0; b < MAILBOX_BUCKETS; b++) {
+        for (Mailbox *mb = mailbox_table[b]; mb != NULL; mb = mb->next) {
+            if (mb->mem_count == 0) continue;
+            if (mailbox_spill(mb) != 0) {
+                lwsl_err("No se pudo volcar el buzon de %s: %s\n", mb->username, strerror(errno));
+                failed++;
+            } else {
+                flushed++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    if (flushed) lwsl_user("Buzones volcados a disco: %d.\n", flushed);
+    return failed;
+}
+
+// Agrega al final del buzon un mensaje en memoria con la cabecera rec y copia data si no es NULL
+// Retorna la entrada o NULL si no hay memoria; se llama con mailbox_mutex tomado
+static inline MailboxEntry *mailbox_append_record(Mailbox *mb, const MailboxRecord *rec, const char *data) {
+    size_t data_len = rec->sender_len + rec->ts_len + rec->content_len;
+    MailboxEntry *e = (MailboxEntry *)heap_malloc(sizeof(MailboxEntry) + data_len);
+    if (!e) return NULL;
+    e->next = NULL;
+    e->rec = *rec;
+    if (data) memcpy(e->data, data, data_len);
+    if (mb->tail) mb->tail->next = e;
+    else mb->head = e;
+    mb->tail = e;
+    mb->mem_count++;
+    mb->total_count++;
+    mb->total_bytes += rec->content_len;
+    return e;
+}
+
+// Guarda un mensaje privado para un usuario desconectado; retorna 0 si se guardo o -1 si el buzon esta lleno
+static inline int mailbox_store(const char *dest, const char *sender, const char *timestamp, const char *content) {
+    size_t sender_len = strnlen(sender, MAX_FIELD_LENGTH);
+    size_t ts_len = strnlen(timestamp, MAX_FIELD_LENGTH);
+    size_t content_len = strnlen(content, MAX_MESSAGE_LENGTH);
+    time_t now = time(NULL);
+    int ret = -1;
+
+    pthread_mutex_lock(&mailbox_mutex);
+    Mailbox *mb = mailbox_lookup(dest, 1);
+    if (mb) {
+        // Si todo lo volcado a disco ya expiro se descarta el archivo completo
+        if (mb->spilled && difftime(now, mb->disk_newest) > mailbox_ttl) {
+            char path[MAILBOX_PATH_MAX];
+            if (mb->probe >= 0 && mailbox_probe_path(dest, mb->probe, path, sizeof(path)) == 0)
+                unlink(path);
+            mb->spilled = 0;
+            mb->total_count = mb->mem_count;
+            mb->total_bytes = 0;
+            for (MailboxEntry *e = mb->head; e != NULL; e = e->next)
+                mb->total_bytes += e->rec.content_len;
+        }
+        // Los mensajes en memoria expirados se descartan desde el mas antiguo
+        while (mb->head && difftime(now, (time_t)mb->head->rec.stored_at) > mailbox_ttl) {
+            MailboxEntry *old = mb->head;
+            mb->head = old->next;
+            if (!mb->head) mb->tail = NULL;
+            mb->mem_count--;
+            mb->total_count--;
+            mb->total_bytes -= old->rec.content_len;
+            free(old);
+        }
+
+        if (mb->total_count < MAILBOX_MAX_MESSAGES &&
+            mb->total_bytes + content_len <= MAILBOX_MAX_BYTES) {
+            MailboxRecord rec;
+            rec.stored_at = (int64_t)now;
+            rec.sender_len = (uint16_t)sender_len;
+            rec.ts_len = (uint16_t)ts_len;
+            rec.content_len = (uint32_t)content_len;
+            MailboxEntry *e = mailbox_append_record(mb, &rec, NULL);
+            if (e) {
+                memcpy(e->data, sender, sender_len);
+                memcpy(e->data + sender_len, timestamp, ts_len);
+                memcpy(e->data + sender_len + ts_len, content, content_len);
+                ret = 0;
+                // Al llenarse la parte en memoria se vuelca a disco
+                if (mb->mem_count >= MAILBOX_MEMORY_MESSAGES && mailbox_spill(mb) != 0)
+                    lwsl_err("No se pudo volcar el buzon de %s: %s\n", dest, strerror(errno));
+            }
+        }
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    return ret;
+}
+
+// Copia bytes al buffer de salida avanzando el offset
+static inline void mailbox_append(char *out, size_t *off, const char *src, size_t len) {
+    memcpy(out + *off, src, len);
+    *off += len;
+}
+
+// Copia texto escapado como cadena JSON, el buffer se dimensiona para el peor caso
+static inline void mailbox_append_escaped(char *out, size_t *off, size_t cap, const char *src, size_t len) {
+    int n = json_escape(out + *off, cap - *off, src, len);
+    if (n > 0) *off += (size_t)n;
+}
+
+// Agrega un registro como objeto JSON al arreglo de salida, omite los expirados
+static inline void mailbox_emit(char *out, size_t *off, size_t cap, const MailboxRecord *rec, const char *data, time_t now, int *first) {
+    if (difftime(now, (time_t)rec->stored_at) > mailbox_ttl) return;
+    if (!*first) mailbox_append(out, off, ",", 1);
+    *first = 0;
+    mailbox_append(out, off, "{\"sender\": \"", 12);
+    mailbox_append_escaped(out, off, cap, data, rec->sender_len);
+    mailbox_append(out, off, "\", \"content\": \"", 15);
+    mailbox_append_escaped(out, off, cap, data + rec->sender_len + rec->ts_len, rec->content_len);
+    mailbox_append(out, off, "\", \"timestamp\": \"", 17);
+    mailbox_append_escaped(out, off, cap, data + rec->sender_len, rec->ts_len);
+    mailbox_append(out, off, "\"}", 2);
+}
+
+// Lee el archivo path completo en memoria dinamica y lo borra; si header es 1 verifica y salta la cabecera de username
+// Retorna los registros o NULL si no existe, esta vacio o es de otro usuario
+static inline char *mailbox_read_file(const char *path, const char *username, int header, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    char *data = NULL;
+    *len = 0;
+    struct stat st;
+    long skip = 0;
+    if (header) {
+        if (mailbox_file_owner(f, username) != 1) {
+            fclose(f);
+            return NULL;
+        }
+        skip = ftell(f);
+    }
+    if (fstat(fileno(f), &st) == 0 && st.st_size > skip) {
+        data = (char *)heap_malloc((size_t)(st.st_size - skip));
+        if (data) *len = fread(data, 1, (size_t)(st.st_size - skip), f);
+    }
+    fclose(f);
+    unlink(path);
+    return data;
+}
+
+// Copia a out los registros vigentes y completos de src; retorna los bytes copiados
+static inline size_t mailbox_copy_live(char *out, const char *src, size_t len, time_t now) {
+    size_t pos = 0, off = 0;
+    while (pos + sizeof(MailboxRecord) <= len) {
+        MailboxRecord rec;
+        memcpy(&rec, src + pos, sizeof(rec));
+        size_t size = sizeof(rec) + rec.sender_len + rec.ts_len + rec.content_len;
+        if (pos + size > len) break; // Registro truncado
+        if (difftime(now, (time_t)rec.stored_at) <= mailbox_ttl) {
+            memcpy(out + off, src + pos, size);
+            off += size;
+        }
+        pos += size;
+    }
+    return off;
+}
+
+// Saca todo el buzon de username, con mailbox_mutex tomado: los archivos del formato anterior, el archivo y la memoria,
+// de mas antiguo a mas nuevo. Retorna los registros vigentes en el formato del archivo sin cabecera, o NULL si no habia
+static inline char *mailbox_take_locked(const char *username, size_t *out_len) {
+    char path[MAILBOX_PATH_MAX];
+    size_t legacy_len = 0, disk_len = 0;
+    char *legacy = mailbox_legacy_path(username, path, sizeof(path)) == 0
+                   ? mailbox_read_file(path, username, 0, &legacy_len) : NULL;
+    Mailbox *mb = mailbox_lookup(username, 0);
+    int probe = mb && mb->probe >= 0 ? mb->probe : mailbox_find_file(username, path, sizeof(path));
+    char *disk = probe >= 0 && mailbox_probe_path(username, probe, path, sizeof(path)) == 0
+                 ? mailbox_read_file(path, username, 1, &disk_len) : NULL;
+
+    size_t cap = legacy_len + disk_len;
+    for (MailboxEntry *e = mb ? mb->head : NULL; e != NULL; e = e->next)
+        cap += sizeof(MailboxRecord) + e->rec.sender_len + e->rec.ts_len + e->rec.content_len;
+    char *out = cap > 0 ? (char *)heap_malloc(cap) : NULL;
+    size_t off = 0;
+    time_t now = time(NULL);
+    if (out) {
+        off += mailbox_copy_live(out + off, legacy, legacy_len, now);
+        off += mailbox_copy_live(out + off, disk, disk_len, now);
+        for (MailboxEntry *e = mb ? mb->head : NULL; e != NULL; e = e->next) {
+            size_t data_len = e->rec.sender_len + e->rec.ts_len + e->rec.content_len;
+            if (difftime(now, (time_t)e->rec.stored_at) > mailbox_ttl) continue;
+            memcpy(out + off, &e->rec, sizeof(MailboxRecord));
+            memcpy(out + off + sizeof(MailboxRecord), e->data, data_len);
+            off += sizeof(MailboxRecord) + data_len;
+        }
+    } else if (cap > 0) {
+        lwsl_err("Sin memoria para entregar el buzon de %s.\n", username);
+    }
+    if (mb) mailbox_unlink(mb);
+    free(legacy);
+    free(disk);
+    if (off == 0) {
+        free(out);
+        return NULL;
+    }
+    *out_len = off;
+    return out;
+}
+
+// Saca todo el buzon de username para entregarlo; ver mailbox_take_locked
+static inline char *mailbox_take(const char *username, size_t *out_len) {
+    pthread_mutex_lock(&mailbox_mutex);
+    char *out = mailbox_take_locked(username, out_len);
+    pthread_mutex_unlock(&mailbox_mutex);
+    return out;
+}
+
+// Devuelve al buzon de username los registros sacados con mailbox_take que no se pudieron entregar
+// Quedan delante de los que hayan llegado mientras tanto, sin aplicar la cuota porque ya estaban guardados
+// Retorna 0, o -1 si no se pudo crear el buzon y los registros se perdieron
+static inline int mailbox_put_back(const char *username, const char *records, size_t len) {
+    pthread_mutex_lock(&mailbox_mutex);
+    size_t newer_len = 0;
+    char *newer = mailbox_take_locked(username, &newer_len);
+    Mailbox *mb = mailbox_lookup(username, 1);
+    for (int part = 0; mb && part < 2; part++) {
+        const char *src = part == 0 ? records : newer;
+        size_t src_len = part == 0 ? len : newer_len;
+        size_t pos = 0;
+        while (pos + sizeof(MailboxRecord) <= src_len) {
+            MailboxRecord rec;
+            memcpy(&rec, src + pos, sizeof(rec));
+            size_t size = sizeof(rec) + rec.sender_len + rec.ts_len + rec.content_len;
+            if (pos + size > src_len) break;
+            if (!mailbox_append_record(mb, &rec, src + pos + sizeof(rec))) {
+                mb = NULL;
+                break;
+            }
+            pos += size;
+        }
+    }
+    if (mb && mb->mem_count >= MAILBOX_MEMORY_MESSAGES && mailbox_spill(mb) != 0)
+        lwsl_err("No se pudo volcar el buzon de %s: %s\n", username, strerror(errno));
+    pthread_mutex_unlock(&mailbox_mutex);
+    free(newer);
+    return mb ? 0 : -1;
+}
+
+// Arma en out una trama offline_messages con los registros de records a partir de *pos
+// Agrega mensajes mientras la trama no pase de limit bytes, salvo el primero que va siempre; out debe tener
+// lugar para limit + MAILBOX_RECORD_MAX_JSON + MAX_FIELD_LENGTH bytes. Avanza *pos y retorna la longitud de la trama
+static inline size_t mailbox_format_chunk(const char *records, size_t len, size_t *pos, char *out, size_t limit) {
+    static const char fmt_head[] = "{\"type\": \"" MSG_TYPE_OFFLINE_MESSAGES "\", \"sender\": \"server\", \"content\": [";
+    size_t cap = limit + MAILBOX_RECORD_MAX_JSON + MAX_FIELD_LENGTH;
+    size_t tail_room = 64; // Cierre del arreglo y timestamp
+    size_t off = 0;
+    int first = 1;
+    mailbox_append(out, &off, fmt_head, sizeof(fmt_head) - 1);
+    while (*pos + sizeof(MailboxRecord) <= len) {
+        MailboxRecord rec;
+        memcpy(&rec, records + *pos, sizeof(rec));
+        size_t data_len = rec.sender_len + rec.ts_len + rec.content_len;
+        if (*pos + sizeof(rec) + data_len > len) {
+            *pos = len; // Registro truncado, no se puede recuperar
+            break;
+        }
+        if (!first && off + 64 + 6 * data_len + tail_room > limit) break;
+        // Los registros ya se filtraron por vencimiento al sacarlos del buzon
+        mailbox_emit(out, &off, cap, &rec, records + *pos + sizeof(rec), (time_t)rec.stored_at, &first);
+        *pos += sizeof(rec) + data_len;
+    }
+    if (first) return 0;
+    char ts[MAX_FIELD_LENGTH];
+    get_current_timestamp(ts, sizeof(ts));
+    off += snprintf(out + off, cap - off, "], \"timestamp\": \"%s\"}", ts);
+    return off;
+}
+
+#endif
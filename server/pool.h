@@ -0,0 +1,145 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Pools de memoria para el camino de los mensajes
+// Los objetos liberados vuelven a una lista libre y se reutilizan, asi en regimen estable
+// los registros Client y las tramas encoladas no llaman a malloc ni a free
+// Las demas reservas del servidor pasan por heap_malloc y se cuentan aparte en heap_allocs
+
+// Contador de veces que un pool tuvo que pedir memoria al heap, deja de crecer en regimen estable
+static unsigned long pool_heap_allocs = 0;
+
+// Contador de reservas del heap fuera de los pools: nombres internados, suscripciones de presencia, buzones,
+// crecimiento de client_hot y del indice de usuarios, la revision de inactividad, palabras nuevas del indice de
+// busqueda y usuarios de otros nodos. Crece con usuarios, suscripciones, mensajes guardados y palabras nuevas
+static unsigned long heap_allocs = 0;
+
+// malloc, calloc y realloc que suman a heap_allocs; se liberan con free
+static inline void *heap_malloc(size_t size) {
+    void *p = malloc(size);
+    if (p) __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static inline void *heap_calloc(size_t count, size_t size) {
+    void *p = calloc(count, size);
+    if (p) __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static inline void *heap_realloc(void *old, size_t size) {
+    void *p = realloc(old, size);
+    if (p) __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+// Nodo de la lista libre, ocupa el espacio del objeto mientras esta libre
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+// Pool de objetos de tamano fijo que crece de a un bloque (slab) de per_slab objetos
+typedef struct {
+    pthread_mutex_t lock;   // Se usa desde el hilo de servicio y el de inactividad
+    size_t obj_size;        // Tamano de cada objeto
+    size_t per_slab;        // Objetos que se reservan cada vez que el pool crece
+    PoolBlock *free_list;   // Objetos libres
+    size_t in_use;          // Objetos entregados
+    size_t capacity;        // Objetos reservados en total
+} ObjectPool;
+
+#define OBJECT_POOL_INIT(size, per_slab) { PTHREAD_MUTEX_INITIALIZER, (size), (per_slab), NULL, 0, 0 }
+
+// Reserva un slab nuevo y lo agrega a la lista libre, se llama con p->lock tomado
+static inline int pool_grow(ObjectPool *p) {
+    size_t size = p->obj_size < sizeof(PoolBlock) ? sizeof(PoolBlock) : p->obj_size;
+    char *slab = (char *)malloc(size * p->per_slab);
+    if (!slab) return -1;
+    __atomic_fetch_add(&pool_heap_allocs, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < p->per_slab; i++) {
+        PoolBlock *b = (PoolBlock *)(slab + i * size);
+        b->next = p->free_list;
+        p->free_list = b;
+    }
+    p->capacity += p->per_slab;
+    return 0;
+}
+
+// Entrega un objeto del pool, retorna NULL si no hay memoria
+static inline void *pool_alloc(ObjectPool *p) {
+    pthread_mutex_lock(&p->lock);
+    if (!p->free_list && pool_grow(p) != 0) {
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+    PoolBlock *b = p->free_list;
+    p->free_list = b->next;
+    p->in_use++;
+    pthread_mutex_unlock(&p->lock);
+    return b;
+}
+
+// Devuelve un objeto al pool
+static inline void pool_free(ObjectPool *p, void *obj) {
+    if (!obj) return;
+    PoolBlock *b = (PoolBlock *)obj;
+    pthread_mutex_lock(&p->lock);
+    b->next = p->free_list;
+    p->free_list = b;
+    p->in_use--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Pools por clase de tamano para los buffers de tramas: 256, 512, ... 64 KiB
+#define BUFFER_CLASSES   9
+#define BUFFER_MIN_SHIFT 8
+#define BUFFER_SLAB_BYTES (64 * 1024)
+
+static ObjectPool buffer_pools[BUFFER_CLASSES] = {
+    OBJECT_POOL_INIT(1 << 8,  BUFFER_SLAB_BYTES >> 8),
+    OBJECT_POOL_INIT(1 << 9,  BUFFER_SLAB_BYTES >> 9),
+    OBJECT_POOL_INIT(1 << 10, BUFFER_SLAB_BYTES >> 10),
+    OBJECT_POOL_INIT(1 << 11, BUFFER_SLAB_BYTES >> 11),
+    OBJECT_POOL_INIT(1 << 12, BUFFER_SLAB_BYTES >> 12),
+    OBJECT_POOL_INIT(1 << 13, BUFFER_SLAB_BYTES >> 13),
+    OBJECT_POOL_INIT(1 << 14, BUFFER_SLAB_BYTES >> 14),
+    OBJECT_POOL_INIT(1 << 15, BUFFER_SLAB_BYTES >> 15),
+    OBJECT_POOL_INIT(1 << 16, 1),
+};
+
+// Reserva un buffer de al menos size bytes; en *cls queda la clase usada o -1 si vino del heap
+static inline void *buffer_alloc(size_t size, int *cls) {
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        if (size <= buffer_pools[i].obj_size) {
+            *cls = i;
+            return pool_alloc(&buffer_pools[i]);
+        }
+    }
+    // Mas grande que la mayor clase: se pide al heap y se cuenta
+    *cls = -1;
+    __atomic_fetch_add(&pool_heap_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+// Libera un buffer obtenido con buffer_alloc
+static inline void buffer_free(void *buf, int cls) {
+    if (cls < 0) free(buf);
+    else pool_free(&buffer_pools[cls], buf);
+}
+
+// Total de buffers entregados por los pools, para las estadisticas del servidor
+static inline size_t buffer_pools_in_use(void) {
+    size_t total = 0;
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        pthread_mutex_lock(&buffer_pools[i].lock);
+        total += buffer_pools[i].in_use;
+        pthread_mutex_unlock(&buffer_pools[i].lock);
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "pool.h"
+
+// Indice inverso de suscripciones de presencia: para cada usuario observado guarda quienes lo observan
+// Asi un cambio de estado solo se manda a sus observadores y no a todos los clientes
+// Todas las funciones se llaman con client_list_mutex tomado
+
+#define PRESENCE_BUCKETS           4096 // Cubetas de la tabla de usuarios observados
+#define PRESENCE_MAX_SUBSCRIPTIONS 1024 // Maximo de usuarios que puede observar un cliente
+
+// Modo de presencia de cada cliente
+typedef enum {
+    PRESENCE_ALL = 0, // Recibe la presencia de todos los usuarios, comportamiento original
+    PRESENCE_LIST,    // Solo recibe la presencia de los usuarios a los que se suscribio
+    PRESENCE_NONE     // No recibe actualizaciones de presencia
+} PresenceMode;
+
+struct Client;
+struct PresenceWatch;
+
+// Una suscripcion enlaza a un observador con un usuario observado
+// Pertenece a dos listas: los observadores del usuario y las suscripciones del cliente
+typedef struct PresenceSub {
+    struct PresenceSub *next_watcher;   // Siguiente observador del mismo usuario
+    struct PresenceSub **prev_watcher;  // Enlace que apunta a esta suscripcion en la lista de observadores
+    struct PresenceSub *next_of_client; // Siguiente suscripcion del mismo cliente
+    struct PresenceWatch *watch;        // Usuario observado
+    struct Client *watcher;             // Cliente que observa
+} PresenceSub;
+
+// Usuario observado por al menos un cliente
+typedef struct PresenceWatch {
+    struct PresenceWatch *next;       // Siguiente usuario de la cubeta
+    PresenceSub *watchers;            // Lista de observadores
+    char username[MAX_FIELD_LENGTH];  // Usuario observado
+} PresenceWatch;
+
+static PresenceWatch *presence_table[PRESENCE_BUCKETS];
+
+// Funcion hash djb2 para los nombres de usuario
+static inline unsigned long presence_hash(const char *s) {
+    unsigned long h = 5381;
+    while (*s) h = ((h << 5) + h) + (unsigned char)*s++;
+    return h;
+}
+
+// Busca un usuario observado, si create es 1 lo crea cuando no existe
+static inline PresenceWatch *presence_lookup(const char *username, int create) {
+    unsigned long b = presence_hash(username) % PRESENCE_BUCKETS;
+    PresenceWatch *w = presence_table[b];
+    while (w != NULL) {
+        if (strcmp(w->username, username) == 0) return w;
+        w = w->next;
+    }
+    if (!create) return NULL;
+    w = (PresenceWatch *)heap_calloc(1, sizeof(PresenceWatch));
+    if (!w) return NULL;
+    strncpy(w->username, username, MAX_FIELD_LENGTH - 1);
+    w->next = presence_table[b];
+    presence_table[b] = w;
+    return w;
+}
+
+// Libera un usuario observado que se quedo sin observadores
+static inline void presence_release(PresenceWatch *target) {
+    if (target->watchers != NULL) return;
+    unsigned long b = presence_hash(target->username) % PRESENCE_BUCKETS;
+    PresenceWatch **pp = &presence_table[b];
+    while (*pp != NULL) {
+        if (*pp == target) {
+            *pp = target->next;
+            free(target);
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+// Quita una suscripcion de la lista de observadores y la libera
+static inline void presence_unlink(PresenceSub *sub) {
+    *sub->prev_watcher = sub->next_watcher;
+    if (sub->next_watcher) sub->next_watcher->prev_watcher = sub->prev_watcher;
+    PresenceWatch *w = sub->watch;
+    free(sub);
+    presence_release(w);
+}
+
+// Suscribe a watcher a la presencia de username; retorna 0 si quedo suscrito o -1 si se alcanzo el limite
+static inline int presence_subscribe(struct Client *watcher, PresenceSub **client_subs, const char *username) {
+    int count = 0;
+    for (PresenceSub *s = *client_subs; s != NULL; s = s->next_of_client) {
+        if (strcmp(s->watch->username, username) == 0) return 0; // Ya estaba suscrito
+        count++;
+    }
+    if (count >= PRESENCE_MAX_SUBSCRIPTIONS) return -1;
+    PresenceWatch *w = presence_lookup(username, 1);
+    if (!w) return -1;
+    PresenceSub *sub = (PresenceSub *)heap_malloc(sizeof(PresenceSub));
+    if (!sub) {
+        presence_release(w);
+        return -1;
+    }
+    sub->watch = w;
+    sub->watcher = watcher;
+    // Inserta al inicio de la lista de observadores del usuario
+    sub->next_watcher = w->watchers;
+    sub->prev_watcher = &w->watchers;
+    if (w->watchers) w->watchers->prev_watcher = &sub->next_watcher;
+    w->watchers = sub;
+    // Inserta al inicio de las suscripciones del cliente
+    sub->next_of_client = *client_subs;
+    *client_subs = sub;
+    return 0;
+}
+
+// Cancela la suscripcion de un cliente a la presencia de username
+static inline void presence_unsubscribe(PresenceSub **client_subs, const char *username) {
+    PresenceSub **pp = client_subs;
+    while (*pp != NULL) {
+        PresenceSub *s = *pp;
+        if (strcmp(s->watch->username, username) == 0) {
+            *pp = s->next_of_client;
+            presence_unlink(s);
+            return;
+        }
+        pp = &s->next_of_client;
+    }
+}
+
+// Cancela todas las suscripciones de un cliente, se usa al desconectarse
+static inline void presence_clear(PresenceSub **client_subs) {
+    PresenceSub *s = *client_subs;
+    while (s != NULL) {
+        PresenceSub *next = s->next_of_client;
+        presence_unlink(s);
+        s = next;
+    }
+    *client_subs = NULL;
+}
+
+// Retorna la lista de observadores de un usuario o NULL si nadie lo observa
+static inline PresenceSub *presence_watchers(const char *username) {
+    PresenceWatch *w = presence_lookup(username, 0);
+    return w ? w->watchers : NULL;
+}
+
+#endif
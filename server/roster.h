@@ -0,0 +1,114 @@
+#ifndef ROSTER_H
+#define ROSTER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "pool.h"
+
+// Indice ordenado de los usuarios conectados para list_users y user_info
+// Un arreglo con todos los usuarios ordenados por nombre y uno por cada estado, asi un filtro de
+// prefijo es una busqueda binaria y un filtro de estado no recorre a los usuarios de otros estados
+// add_client, remove_client y update_client_status lo mantienen al dia
+// Todas las funciones se llaman con client_list_mutex tomado
+
+struct Client;
+
+// Entrada del indice, name es el nombre internado del propio Client
+typedef struct {
+    const char *name;
+    struct Client *client;
+} RosterEntry;
+
+// Arreglo de entradas ordenado por nombre
+typedef struct {
+    RosterEntry *items;
+    size_t count;
+    size_t capacity;
+} RosterIndex;
+
+// Indices disponibles: todos los usuarios y uno por estado, en el orden de ClientStatus
+enum { ROSTER_ALL = 0, ROSTER_ACTIVE, ROSTER_BUSY, ROSTER_INACTIVE, ROSTER_INDEXES };
+
+static RosterIndex roster[ROSTER_INDEXES];
+
+// Indice de un estado de cliente, status es un ClientStatus de server.h en el mismo orden que los indices
+static inline int roster_status_index(int status) {
+    return ROSTER_ACTIVE + status;
+}
+
+// Posicion de la primera entrada cuyo nombre es mayor o igual que key
+static inline size_t roster_lower_bound(const RosterIndex *ix, const char *key) {
+    size_t lo = 0, hi = ix->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(ix->items[mid].name, key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Asegura lugar para n usuarios en todos los indices, asi insertar despues nunca falla
+// Retorna 0 si hay lugar o -1 si no hay memoria
+static inline int roster_reserve(size_t n) {
+    for (int i = 0; i < ROSTER_INDEXES; i++) {
+        RosterIndex *ix = &roster[i];
+        if (n <= ix->capacity) continue;
+        size_t capacity = ix->capacity ? ix->capacity : 64;
+        while (capacity < n) capacity *= 2;
+        RosterEntry *grown = (RosterEntry *)heap_realloc(ix->items, capacity * sizeof(RosterEntry));
+        if (!grown) return -1;
+        ix->items = grown;
+        ix->capacity = capacity;
+    }
+    return 0;
+}
+
+// Inserta una entrada en su lugar, requiere roster_reserve previo
+static inline void roster_index_insert(RosterIndex *ix, const char *name, struct Client *client) {
+    size_t pos = roster_lower_bound(ix, name);
+    memmove(&ix->items[pos + 1], &ix->items[pos], (ix->count - pos) * sizeof(RosterEntry));
+    ix->items[pos].name = name;
+    ix->items[pos].client = client;
+    ix->count++;
+}
+
+// Quita la entrada de name si esta en el indice
+static inline void roster_index_remove(RosterIndex *ix, const char *name) {
+    size_t pos = roster_lower_bound(ix, name);
+    if (pos == ix->count || strcmp(ix->items[pos].name, name) != 0) return;
+    memmove(&ix->items[pos], &ix->items[pos + 1], (ix->count - pos - 1) * sizeof(RosterEntry));
+    ix->count--;
+}
+
+// Agrega un usuario con su estado, name debe seguir valido mientras el usuario este en el indice
+// Retorna 0 si se agrego o -1 si no hay memoria
+static inline int roster_insert(const char *name, struct Client *client, int status) {
+    if (roster_reserve(roster[ROSTER_ALL].count + 1) != 0) return -1;
+    roster_index_insert(&roster[ROSTER_ALL], name, client);
+    roster_index_insert(&roster[roster_status_index(status)], name, client);
+    return 0;
+}
+
+// Quita a un usuario de todos los indices
+static inline void roster_remove(const char *name, int status) {
+    roster_index_remove(&roster[ROSTER_ALL], name);
+    roster_index_remove(&roster[roster_status_index(status)], name);
+}
+
+// Mueve a un usuario del indice de su estado anterior al del nuevo
+static inline void roster_set_status(const char *name, struct Client *client, int old_status, int new_status) {
+    if (old_status == new_status) return;
+    roster_index_remove(&roster[roster_status_index(old_status)], name);
+    roster_index_insert(&roster[roster_status_index(new_status)], name, client);
+}
+
+// Retorna el cliente con ese nombre, o NULL si no esta conectado
+static inline struct Client *roster_find(const char *name) {
+    const RosterIndex *ix = &roster[ROSTER_ALL];
+    size_t pos = roster_lower_bound(ix, name);
+    if (pos == ix->count || strcmp(ix->items[pos].name, name) != 0) return NULL;
+    return ix->items[pos].client;
+}
+
+#endif
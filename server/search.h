@@ -0,0 +1,396 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <libwebsockets.h>
+#include "protocol.h"
+#include "pool.h"
+
+// Busqueda en los mensajes broadcast recientes
+// Los mensajes se guardan en un anillo de tamano fijo indexado por un indice invertido de palabras.
+// Al sobrescribir una posicion del anillo se quitan sus palabras del indice, asi la memoria no crece.
+// Un hilo en segundo plano es dueño del indice: indexa y responde consultas en el orden en que llegan
+// por una cola, sin bloquear el bucle de servicio
+
+#ifndef SEARCH_RING_SIZE
+#define SEARCH_RING_SIZE    131072 // Mensajes recientes que se pueden buscar
+#endif
+#ifndef SEARCH_QUEUE_SIZE
+#define SEARCH_QUEUE_SIZE   1024   // Mensajes y consultas esperando al hilo de busqueda
+#endif
+#define SEARCH_MAX_TOKENS   12     // Palabras indexadas por mensaje, incluida la del remitente
+#define SEARCH_TOKEN_LEN    24     // Longitud maxima de una palabra indexada
+#define SEARCH_CONTENT_LEN  128    // Bytes del contenido que se guardan para mostrar en los resultados
+#define SEARCH_SENDER_LEN   32     // Bytes del remitente que se guardan
+#define SEARCH_TS_LEN       20     // Timestamp AAAA-MM-DDThh:mm:ss
+#define SEARCH_MAX_RESULTS  20     // Resultados por consulta, los mas recientes primero
+#define SEARCH_QUERY_TERMS  8      // Palabras maximas por consulta
+#define SEARCH_BUCKETS      (1 << 18) // Cubetas de la tabla de palabras
+#define SEARCH_RESPONSE_MAX 8192   // Tamano maximo de la trama de respuesta
+#define SEARCH_NONE         UINT32_MAX
+
+struct SearchTerm;
+
+// Aparicion de una palabra en un mensaje, enlazada con las demas apariciones de la misma palabra
+// Su identificador es posicion_en_anillo * SEARCH_MAX_TOKENS + indice
+typedef struct {
+    uint32_t next;             // Aparicion mas antigua de la misma palabra
+    uint32_t prev;             // Aparicion mas reciente, SEARCH_NONE si es la cabeza
+    struct SearchTerm *term;   // Palabra, NULL si la aparicion no se usa
+} SearchPosting;
+
+// Palabra del indice con su lista de apariciones, de la mas reciente a la mas antigua
+typedef struct SearchTerm {
+    struct SearchTerm *next;        // Siguiente palabra de la cubeta
+    uint32_t head;                  // Aparicion mas reciente
+    uint32_t count;                 // Apariciones vivas en el anillo
+    uint32_t hash;                  // Hash de la palabra
+    char text[SEARCH_TOKEN_LEN];    // Palabra en minusculas, o @remitente
+} SearchTerm;
+
+// Mensaje guardado en el anillo
+typedef struct {
+    time_t at;                               // Momento en que se indexo, 0 si la posicion esta vacia
+    char sender[SEARCH_SENDER_LEN];          // Remitente
+    char timestamp[SEARCH_TS_LEN];           // Timestamp original del mensaje
+    char content[SEARCH_CONTENT_LEN];        // Inicio del contenido
+    SearchPosting postings[SEARCH_MAX_TOKENS]; // Palabras del mensaje
+} SearchSlot;
+
+// Trabajo para el hilo de busqueda
+typedef struct {
+    int is_query;                       // 0 indexar un broadcast, 1 responder una consulta
+    char user[MAX_FIELD_LENGTH];        // Remitente del broadcast o usuario que consulta
+    char text[MAX_MESSAGE_LENGTH];      // Contenido del broadcast o texto de la consulta
+    char timestamp[SEARCH_TS_LEN];      // Timestamp del broadcast
+    void *reply_to;                     // Conexion que hizo la consulta
+    uint32_t reply_id;                  // Identificador de esa conexion, por si se cerro y otra reuso la direccion
+} SearchJob;
+
+// Funcion con la que el hilo de busqueda entrega una respuesta a la conexion que consulto
+// username es el usuario registrado en esa conexion al hacer la consulta
+typedef void (*SearchDeliverFn)(const char *username, void *reply_to, uint32_t reply_id, const char *json, size_t len);
+
+static SearchSlot *search_ring = NULL;       // Anillo de mensajes
+static uint32_t search_ring_next = 0;         // Proxima posicion a escribir
+static SearchTerm **search_buckets = NULL;    // Tabla hash de palabras
+static SearchJob *search_queue = NULL;        // Cola circular de trabajos
+static size_t search_queue_head = 0, search_queue_len = 0;
+static unsigned long search_dropped = 0;      // Broadcasts que no se indexaron porque la cola estaba llena
+static int search_stop = 0;
+static pthread_mutex_t search_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t search_tid;
+static int search_running = 0;
+static SearchDeliverFn search_deliver = NULL;
+
+// Hash FNV-1a de una palabra
+static inline uint32_t search_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Busca una palabra en la tabla, si create es 1 la crea cuando no existe
+static inline SearchTerm *search_term_lookup(const char *text, int create) {
+    uint32_t h = search_hash(text);
+    SearchTerm **bucket = &search_buckets[h & (SEARCH_BUCKETS - 1)];
+    for (SearchTerm *t = *bucket; t != NULL; t = t->next) {
+        if (t->hash == h && strcmp(t->text, text) == 0) return t;
+    }
+    if (!create) return NULL;
+    SearchTerm *t = (SearchTerm *)heap_calloc(1, sizeof(SearchTerm));
+    if (!t) return NULL;
+    t->hash = h;
+    t->head = SEARCH_NONE;
+    strncpy(t->text, text, SEARCH_TOKEN_LEN - 1);
+    t->next = *bucket;
+    *bucket = t;
+    return t;
+}
+
+// Libera una palabra que ya no aparece en ningun mensaje del anillo
+static inline void search_term_release(SearchTerm *term) {
+    SearchTerm **pp = &search_buckets[term->hash & (SEARCH_BUCKETS - 1)];
+    while (*pp != NULL) {
+        if (*pp == term) {
+            *pp = term->next;
+            free(term);
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+// Retorna la aparicion con identificador id
+static inline SearchPosting *search_posting(uint32_t id) {
+    return &search_ring[id / SEARCH_MAX_TOKENS].postings[id % SEARCH_MAX_TOKENS];
+}
+
+// Quita del indice las palabras del mensaje guardado en slot, antes de sobrescribirlo
+static inline void search_evict(uint32_t slot) {
+    SearchSlot *s = &search_ring[slot];
+    for (int k = 0; k < SEARCH_MAX_TOKENS; k++) {
+        SearchPosting *p = &s->postings[k];
+        SearchTerm *term = p->term;
+        if (!term) continue;
+        if (p->prev != SEARCH_NONE) search_posting(p->prev)->next = p->next;
+        else term->head = p->next;
+        if (p->next != SEARCH_NONE) search_posting(p->next)->prev = p->prev;
+        p->term = NULL;
+        if (--term->count == 0) search_term_release(term);
+    }
+    s->at = 0;
+}
+
+// Separa texto en palabras en minusculas; los bytes no ASCII se toman como parte de la palabra
+// Guarda en out las palabras distintas de al menos 2 caracteres, hasta max, y retorna cuantas guardo
+static inline int search_tokenize(const char *text, char out[][SEARCH_TOKEN_LEN], int max) {
+    int count = 0;
+    const unsigned char *p = (const unsigned char *)text;
+    while (*p && count < max) {
+        while (*p && !(isalnum(*p) || *p >= 0x80)) p++;
+        size_t len = 0;
+        char token[SEARCH_TOKEN_LEN];
+        while (*p && (isalnum(*p) || *p >= 0x80)) {
+            if (len < SEARCH_TOKEN_LEN - 1) token[len++] = (char)tolower(*p);
+            p++;
+        }
+        if (len < 2) continue;
+        token[len] = '\0';
+        // Las palabras repetidas en el mismo texto se indexan una sola vez
+        int dup = 0;
+        for (int i = 0; i < count && !dup; i++) dup = strcmp(out[i], token) == 0;
+        if (!dup) memcpy(out[count++], token, len + 1);
+    }
+    return count;
+}
+
+// Palabra con la que se indexa un remitente: @ seguido del nombre, recortado a SEARCH_TOKEN_LEN
+static inline void search_sender_token(char *out, const char *sender) {
+    size_t len = strnlen(sender, SEARCH_TOKEN_LEN - 2);
+    out[0] = '@';
+    memcpy(out + 1, sender, len);
+    out[len + 1] = '\0';
+}
+
+// Agrega un broadcast al anillo y a su indice, reemplazando al mensaje mas antiguo
+static inline void search_index(const SearchJob *job) {
+    uint32_t slot = search_ring_next;
+    search_ring_next = (search_ring_next + 1) % SEARCH_RING_SIZE;
+    SearchSlot *s = &search_ring[slot];
+    if (s->at) search_evict(slot);
+
+    s->at = time(NULL);
+    strncpy(s->sender, job->user, SEARCH_SENDER_LEN - 1);
+    s->sender[SEARCH_SENDER_LEN - 1] = '\0';
+    strncpy(s->timestamp, job->timestamp, SEARCH_TS_LEN - 1);
+    s->timestamp[SEARCH_TS_LEN - 1] = '\0';
+    // Se recorta sin dejar un caracter UTF-8 a medias
+    size_t content_len = utf8_complete_prefix(job->text, strnlen(job->text, SEARCH_CONTENT_LEN - 1));
+    memcpy(s->content, job->text, content_len);
+    s->content[content_len] = '\0';
+
+    // La primera palabra es el remitente con prefijo @ para filtrar por remitente con el mismo indice
+    char tokens[SEARCH_MAX_TOKENS][SEARCH_TOKEN_LEN];
+    search_sender_token(tokens[0], job->user);
+    int n = 1 + search_tokenize(job->text, tokens + 1, SEARCH_MAX_TOKENS - 1);
+    for (int k = 0; k < n; k++) {
+        SearchTerm *term = search_term_lookup(tokens[k], 1);
+        if (!term) continue;
+        uint32_t id = slot * SEARCH_MAX_TOKENS + (uint32_t)k;
+        SearchPosting *p = &s->postings[k];
+        // Se inserta al inicio: la lista queda de la aparicion mas reciente a la mas antigua
+        p->term = term;
+        p->prev = SEARCH_NONE;
+        p->next = term->head;
+        if (term->head != SEARCH_NONE) search_posting(term->head)->prev = id;
+        term->head = id;
+        term->count++;
+    }
+}
+
+// Convierte un timestamp AAAA-MM-DDThh:mm:ss en hora local a time_t, -1 si no es valido
+static inline time_t search_parse_time(const char *text) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 3)
+        return (time_t)-1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Copia texto al buffer de respuesta sin pasarse del tamano
+static inline void search_append(char *out, size_t *off, const char *text) {
+    size_t len = strlen(text);
+    if (*off + len >= SEARCH_RESPONSE_MAX) len = SEARCH_RESPONSE_MAX - *off - 1;
+    memcpy(out + *off, text, len);
+    *off += len;
+    out[*off] = '\0';
+}
+
+// Copia texto escapado como cadena JSON; el llamador ya verifico que cabe
+static inline void search_append_escaped(char *out, size_t *off, const char *text) {
+    int n = json_escape(out + *off, SEARCH_RESPONSE_MAX - *off, text, strlen(text));
+    if (n > 0) *off += (size_t)n;
+}
+
+// Responde una consulta: palabras que deben aparecer todas, from:<usuario>, since: y until: con AAAA-MM-DDThh:mm:ss
+static inline void search_query(const SearchJob *job) {
+    char terms_text[SEARCH_QUERY_TERMS + 1][SEARCH_TOKEN_LEN];
+    int nterms = 0;
+    time_t since = 0, until = 0;
+
+    // Separa los filtros de las palabras de la consulta
+    char query[MAX_MESSAGE_LENGTH];
+    strncpy(query, job->text, sizeof(query) - 1);
+    query[sizeof(query) - 1] = '\0';
+    char *save = NULL;
+    for (char *word = strtok_r(query, " ", &save); word != NULL; word = strtok_r(NULL, " ", &save)) {
+        if (strncmp(word, "from:", 5) == 0 && word[5]) {
+            search_sender_token(terms_text[nterms++], word + 5);
+        } else if (strncmp(word, "since:", 6) == 0) {
+            since = search_parse_time(word + 6);
+        } else if (strncmp(word, "until:", 6) == 0) {
+            until = search_parse_time(word + 6);
+        } else {
+            nterms += search_tokenize(word, terms_text + nterms, SEARCH_QUERY_TERMS - nterms);
+        }
+        if (nterms >= SEARCH_QUERY_TERMS) break;
+    }
+
+    char out[SEARCH_RESPONSE_MAX];
+    size_t off = 0;
+    char ts[MAX_FIELD_LENGTH];
+    get_current_timestamp(ts, sizeof(ts));
+    search_append(out, &off, "{\"type\": \"" MSG_TYPE_SEARCH_RESPONSE "\", \"sender\": \"server\", \"content\": [");
+
+    // Todas las palabras deben existir; se recorre la lista mas corta y se verifican las demas
+    SearchTerm *terms[SEARCH_QUERY_TERMS + 1];
+    SearchTerm *shortest = NULL;
+    int missing = nterms == 0;
+    for (int i = 0; i < nterms && !missing; i++) {
+        terms[i] = search_term_lookup(terms_text[i], 0);
+        if (!terms[i]) missing = 1;
+        else if (!shortest || terms[i]->count < shortest->count) shortest = terms[i];
+    }
+
+    int results = 0;
+    for (uint32_t id = missing ? SEARCH_NONE : shortest->head;
+         id != SEARCH_NONE && results < SEARCH_MAX_RESULTS;
+         id = search_posting(id)->next) {
+        SearchSlot *s = &search_ring[id / SEARCH_MAX_TOKENS];
+        // Las apariciones van de la mas reciente a la mas antigua, se puede cortar al pasar since
+        if (since > 0 && s->at < since) break;
+        if (until > 0 && s->at > until) continue;
+        int match = 1;
+        for (int i = 0; i < nterms && match; i++) {
+            if (terms[i] == shortest) continue;
+            match = 0;
+            for (int k = 0; k < SEARCH_MAX_TOKENS && !match; k++)
+                match = s->postings[k].term == terms[i];
+        }
+        if (!match) continue;
+        // Se corta antes de que la respuesta deje de caber, reservando lugar para el cierre
+        size_t need = 6 * (strlen(s->sender) + strlen(s->content) + strlen(s->timestamp)) + 64;
+        if (off + need + 64 >= SEARCH_RESPONSE_MAX) break;
+        if (results++ > 0) search_append(out, &off, ",");
+        search_append(out, &off, "{\"sender\": \"");
+        search_append_escaped(out, &off, s->sender);
+        search_append(out, &off, "\", \"content\": \"");
+        search_append_escaped(out, &off, s->content);
+        search_append(out, &off, "\", \"timestamp\": \"");
+        search_append_escaped(out, &off, s->timestamp);
+        search_append(out, &off, "\"}");
+    }
+    search_append(out, &off, "], \"timestamp\": \"");
+    search_append(out, &off, ts);
+    search_append(out, &off, "\"}");
+    if (search_deliver) search_deliver(job->user, job->reply_to, job->reply_id, out, off);
+}
+
+// Hilo de busqueda: toma trabajos de la cola y los atiende en orden
+static void *search_worker(void *arg) {
+    SearchJob job;
+    pthread_mutex_lock(&search_mutex);
+    while (1) {
+        while (search_queue_len == 0 && !search_stop)
+            pthread_cond_wait(&search_cond, &search_mutex);
+        if (search_stop) break;
+        job = search_queue[search_queue_head];
+        search_queue_head = (search_queue_head + 1) % SEARCH_QUEUE_SIZE;
+        search_queue_len--;
+        pthread_mutex_unlock(&search_mutex);
+        if (job.is_query) search_query(&job);
+        else search_index(&job);
+        pthread_mutex_lock(&search_mutex);
+    }
+    pthread_mutex_unlock(&search_mutex);
+    return NULL;
+}
+
+// Encola un trabajo para el hilo de busqueda; retorna -1 si la cola esta llena
+// Una consulta lleva la conexion reply_to y su identificador reply_id, que se pasan tal cual a la entrega
+static inline int search_submit(int is_query, const char *user, const char *text, const char *timestamp,
+                                void *reply_to, uint32_t reply_id) {
+    int ret = -1;
+    pthread_mutex_lock(&search_mutex);
+    if (search_running && search_queue_len < SEARCH_QUEUE_SIZE) {
+        SearchJob *job = &search_queue[(search_queue_head + search_queue_len) % SEARCH_QUEUE_SIZE];
+        job->is_query = is_query;
+        strncpy(job->user, user, MAX_FIELD_LENGTH - 1);
+        job->user[MAX_FIELD_LENGTH - 1] = '\0';
+        strncpy(job->text, text, MAX_MESSAGE_LENGTH - 1);
+        job->text[MAX_MESSAGE_LENGTH - 1] = '\0';
+        strncpy(job->timestamp, timestamp ? timestamp : "", SEARCH_TS_LEN - 1);
+        job->timestamp[SEARCH_TS_LEN - 1] = '\0';
+        job->reply_to = reply_to;
+        job->reply_id = reply_id;
+        search_queue_len++;
+        ret = 0;
+        pthread_cond_signal(&search_cond);
+    } else if (!is_query) {
+        search_dropped++;
+    }
+    pthread_mutex_unlock(&search_mutex);
+    return ret;
+}
+
+// Reserva el anillo y la cola y lanza el hilo de busqueda; retorna 0 si se inicio
+static inline int search_start(SearchDeliverFn deliver) {
+    search_ring = (SearchSlot *)calloc(SEARCH_RING_SIZE, sizeof(SearchSlot));
+    search_buckets = (SearchTerm **)calloc(SEARCH_BUCKETS, sizeof(SearchTerm *));
+    search_queue = (SearchJob *)calloc(SEARCH_QUEUE_SIZE, sizeof(SearchJob));
+    if (!search_ring || !search_buckets || !search_queue) return -1;
+    search_deliver = deliver;
+    if (pthread_create(&search_tid, NULL, search_worker, NULL) != 0) return -1;
+    search_running = 1;
+    return 0;
+}
+
+// Detiene el hilo de busqueda
+static inline void search_shutdown(void) {
+    if (!search_running) return;
+    pthread_mutex_lock(&search_mutex);
+    search_stop = 1;
+    search_running = 0;
+    pthread_cond_signal(&search_cond);
+    pthread_mutex_unlock(&search_mutex);
+    pthread_join(search_tid, NULL);
+    if (search_dropped)
+        lwsl_user("Busqueda: %lu broadcasts sin indexar por cola llena.\n", search_dropped);
+}
+
+#endif
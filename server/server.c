@@ -1,66 +1,109 @@
+#define _GNU_SOURCE // accept4 y SOCK_NONBLOCK para el socket de escucha propio
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <libwebsockets.h>
 #include "server.h"
+#include "upgrade.h"
+#include "tls.h"
+#include "federation.h"
+#include "capture.h"
+
+// Bucle de eventos externo opcional: make EVENT_LIB=uv o make EVENT_LIB=ev
+#if defined(CHAT_EVENT_LIBUV)
+#include <uv.h>
+#define CHAT_EVENT_LOOP 1
+#elif defined(CHAT_EVENT_LIBEV)
+#include <ev.h>
+#define CHAT_EVENT_LOOP 1
+#endif
 #include <unistd.h> 
 #include <time.h>
 
 // Bandera para terminar el bucle principal de forma controlada
 static volatile int force_exit = 0;
 
-// Manejador de señal para finalizar el servidor Ctrl+C
-static void sighandler(int sig) {
-    force_exit = 1;
-}
+// Bandera para vaciar el servidor antes de terminar, se activa con SIGTERM
+static volatile sig_atomic_t drain_requested = 0;
 
+// Bandera para mostrar las estadisticas de memoria y TLS, se activa con SIGUSR1
+static volatile sig_atomic_t stats_requested = 0;
+
+// Muestra cuantas veces los pools tuvieron que pedir memoria al heap, en regimen estable no cambia,
+// y las reservas del heap fuera de los pools
+static void log_pool_stats(void) {
+    pthread_mutex_lock(&client_pool.lock);
+    size_t clients = client_pool.in_use;
+    size_t client_capacity = client_pool.capacity;
+    pthread_mutex_unlock(&client_pool.lock);
+    lwsl_user("Pools: %lu reservas del heap, %zu/%zu clientes, %zu buffers de tramas en uso.\n",
+              __atomic_load_n(&pool_heap_allocs, __ATOMIC_RELAXED), clients, client_capacity,
+              buffer_pools_in_use());
+    lwsl_user("Fuera de los pools: %lu reservas del heap (nombres, presencia, buzones, indices, busqueda).\n",
+              __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED));
+}
 
- 
 // Funcion callback para manejar los eventos de WebSocket procesa el establecimiento de conexion, recepcion de mensajes y cierre de la conexion
 static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
     switch(reason) {
         case LWS_CALLBACK_ESTABLISHED:
             // Conexion establecida
             lwsl_user("Conexión establecida con un cliente.\n");
+            // Inicializa la cola de salida de la sesion
+            pthread_mutex_init(&((SessionData *)user)->lock, NULL);
+            ((SessionData *)user)->conn_id = capture_conn_id();
+            break;
+
+#ifdef CHAT_WITH_OPENSSL
+        case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS:
+            // libwebsockets creo el SSL_CTX del vhost: activar reanudacion de sesiones y kTLS
+            tls_configure_server_ctx((SSL_CTX *)user);
+            break;
+#endif
+
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            // El socket acepta datos: escribir las tramas pendientes de la cola
+            return flush_outbound(wsi, (SessionData *)user);
+
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            // Otro hilo encolo tramas o marco un desalojo, se atienden desde el hilo de servicio
+            service_pending_outbound();
+            federation_service_pending();
             break;
             
         case LWS_CALLBACK_RECEIVE:
             {
-                // Se recibe un mensaje: asignar memoria, procesarlo y liberar
-                char *received = (char *)malloc(len + 1);
-                if (received) {
-                    memcpy(received, in, len);
-                    received[len] = '\0';
-                    lwsl_user("Mensaje recibido: %s\n", received);
-                    // Procesa el mensaje recibido
-                    handle_incoming_message(wsi, received);
-                    free(received);
-                }
+                // Se guarda la trama tal como llego si se esta capturando el trafico
+                capture_frame(((SessionData *)user)->conn_id, in, len);
+                // Se recibe un mensaje: se copia en la pila para terminarlo en nulo, sin usar el heap
+                char received[MAX_JSON_LENGTH + 1];
+                if (len > MAX_JSON_LENGTH) len = MAX_JSON_LENGTH; // rx_buffer_size limita cada trama
+                memcpy(received, in, len);
+                received[len] = '\0';
+                lwsl_user("Mensaje recibido: %s\n", received);
+                // Procesa el mensaje recibido
+                handle_incoming_message(wsi, received);
 
                 // Actualizar la última actividad del cliente y, si estaba inactivo, cambiar a ACTIVO.
                 int should_activate = 0;
                 char uname[MAX_FIELD_LENGTH] = "";
 
                 pthread_mutex_lock(&client_list_mutex);
-                Client *cli = client_list;
-                while (cli != NULL) {
-                    if (cli->wsi == wsi) {
-                        // Actualiza la marca de tiempo con la hora actual
-                        cli->last_activity = time(NULL);
-                        // Si el cliente estaba marcado como INACTIVO, marcar para activarlo
-                        if (strcmp(cli->status, STATUS_INACTIVE) == 0) {
-                            strncpy(uname, cli->username, MAX_FIELD_LENGTH);
-                            should_activate = 1;
-                        }
-                        break;
+                ClientHot *hot = client_hot_by_wsi(wsi); // La sesion guarda la posicion del cliente
+                if (hot != NULL) {
+                    // Actualiza la marca de tiempo con la hora actual
+                    hot->last_activity = time(NULL);
+                    // Si el cliente estaba marcado como INACTIVO, marcar para activarlo
+                    if (hot->status == CLIENT_INACTIVE) {
+                        strncpy(uname, hot->client->username, MAX_FIELD_LENGTH - 1);
+                        should_activate = 1;
                     }
-                    cli = cli->next;
                 }
                 pthread_mutex_unlock(&client_list_mutex);
 
                 if (should_activate) {
-                    update_client_status(uname, STATUS_ACTIVE);
+                    update_client_status(uname, CLIENT_ACTIVE);
                 }
             }
             break;
@@ -72,15 +115,10 @@ static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason, void
         lwsl_user("Conexión cerrada con un cliente.\n");
         // Eliminar al cliente de la lista si aun esta presente
         pthread_mutex_lock(&client_list_mutex);
-        Client *curr = client_list;
+        ClientHot *closed_hot = client_hot_by_wsi(wsi);
         char username_to_remove[MAX_FIELD_LENGTH] = "";
-        while (curr != NULL) {
-            if (curr->wsi == wsi) {
-                strncpy(username_to_remove, curr->username, MAX_FIELD_LENGTH); // Guarda el nombre del usuario
-                break;
-            }
-            curr = curr->next;
-        }
+        if (closed_hot != NULL) // Guarda el nombre del usuario
+            strncpy(username_to_remove, closed_hot->client->username, MAX_FIELD_LENGTH - 1);
         pthread_mutex_unlock(&client_list_mutex);
         if (username_to_remove[0] != '\0') {
             // Se elimina el cliente de la lista y se difunde la notificacion de desconexion
@@ -91,7 +129,17 @@ static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason, void
             strncpy(disc_msg.sender, "server", MAX_FIELD_LENGTH);
             snprintf(disc_msg.content, MAX_MESSAGE_LENGTH, "%s ha salido", username_to_remove);
             get_current_timestamp(disc_msg.timestamp, MAX_FIELD_LENGTH);
-            broadcast_message(&disc_msg);
+            publish_presence(username_to_remove, &disc_msg);
+        }
+        // Libera las tramas que quedaron pendientes y bloquea nuevos encolados
+        {
+            SessionData *pss = (SessionData *)user;
+            capture_close(pss->conn_id);
+            pthread_mutex_lock(&pss->lock);
+            pss->closed = 1;
+            drop_outbound_locked(pss);
+            pthread_mutex_unlock(&pss->lock);
+            pthread_mutex_destroy(&pss->lock);
         }
         break;
 
@@ -101,68 +149,461 @@ static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason, void
     }
     return 0;
 }
+// Callback de los enlaces entre nodos de la federacion, entrantes y salientes
+static int callback_federation(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+    switch (reason) {
+        case LWS_CALLBACK_ESTABLISHED:
+            // Enlace entrante: el nodo se identifica en su primera trama
+            pthread_mutex_init(&((SessionData *)user)->lock, NULL);
+            ((SessionData *)user)->link = 1;
+            break;
+
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            // Enlace saliente: se saluda y se manda el directorio local
+            pthread_mutex_init(&((SessionData *)user)->lock, NULL);
+            ((SessionData *)user)->link = 1;
+            federation_link_up(wsi);
+            break;
+
+        case LWS_CALLBACK_RECEIVE: {
+            char received[MAX_JSON_LENGTH + 1];
+            if (len > MAX_JSON_LENGTH) len = MAX_JSON_LENGTH;
+            memcpy(received, in, len);
+            received[len] = '\0';
+            return federation_receive(wsi, received);
+        }
+
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+        case LWS_CALLBACK_CLIENT_WRITEABLE:
+            return flush_outbound(wsi, (SessionData *)user);
+
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            // El handshake no termino, la sesion no llego a inicializarse
+            lwsl_err("No se pudo conectar con un nodo: %s\n", in ? (const char *)in : "");
+            federation_link_down(wsi);
+            break;
+
+        case LWS_CALLBACK_CLOSED:
+        case LWS_CALLBACK_CLIENT_CLOSED: {
+            if (reason == LWS_CALLBACK_CLOSED)
+                federation_inbound_closed(wsi);
+            else
+                federation_link_down(wsi);
+            SessionData *pss = (SessionData *)user;
+            pthread_mutex_lock(&pss->lock);
+            pss->closed = 1;
+            drop_outbound_locked(pss);
+            pthread_mutex_unlock(&pss->lock);
+            pthread_mutex_destroy(&pss->lock);
+            break;
+        }
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+// Revisa los clientes y marca como INACTIVO a los que llevan 15 s sin mandar mensajes
+// Tambien manda los acks de entrega confiable que llevan demasiado tiempo esperando
+static void check_inactive_clients(void) {
+    time_t now = time(NULL);
+    // Una sola pasada por client_hot cambia los estados; los nombres se copian para publicar sin el mutex
+    // El arreglo se conserva entre revisiones y solo crece, asi en regimen estable no se pide memoria al heap
+    static char (*names)[MAX_FIELD_LENGTH] = NULL;
+    static size_t capacity = 0;
+    size_t count = 0;
+    pthread_mutex_lock(&client_list_mutex);
+    for (size_t i = 0; i < client_count; i++) {
+        ClientHot *hot = &client_hot[i];
+        if (hot->status == CLIENT_INACTIVE || difftime(now, hot->last_activity) < 15) continue;
+        if (count == capacity) {
+            size_t grown_capacity = capacity ? capacity * 2 : 16;
+            char (*grown)[MAX_FIELD_LENGTH] = heap_realloc(names, grown_capacity * sizeof(*names));
+            if (!grown) break; // Los que faltan se marcan en la proxima revision
+            names = grown;
+            capacity = grown_capacity;
+        }
+        client_set_status(hot, CLIENT_INACTIVE);
+        strncpy(names[count], hot->client->username, MAX_FIELD_LENGTH - 1);
+        names[count][MAX_FIELD_LENGTH - 1] = '\0';
+        count++;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    for (size_t i = 0; i < count; i++)
+        publish_status(names[i], CLIENT_INACTIVE);
+    // Los acks que no pudieron viajar en otra trama se mandan solos
+    send_pending_acks(now);
+}
+
+#ifndef CHAT_EVENT_LOOP
 // Hilo de inactividad del servidor: revisa clientes cada 1 s y actualiza estado
 static void* inactivity_monitor(void *arg) {
     while (!force_exit) {
         sleep(1);
-        time_t now = time(NULL);
-        pthread_mutex_lock(&client_list_mutex);
-        Client *curr = client_list;
-        while (curr != NULL) {
-            if (difftime(now, curr->last_activity) >= 15 && 
-                strcmp(curr->status, STATUS_INACTIVE) != 0) {
-                char uname[MAX_FIELD_LENGTH];
-                strncpy(uname, curr->username, MAX_FIELD_LENGTH);
-                pthread_mutex_unlock(&client_list_mutex);
-                update_client_status(uname, STATUS_INACTIVE);
-                pthread_mutex_lock(&client_list_mutex);
-                // Reinicia el recorrido para evitar inconsistencias.
-                curr = client_list;
-                continue;
-            }
-            curr = curr->next;
-        }
-        pthread_mutex_unlock(&client_list_mutex);
+        check_inactive_clients();
     }
     return NULL;
 }
+#endif
+
+
+// Tareas del hilo de servicio tras atender eventos: estadisticas y vaciado ordenado
+// Retorna 1 cuando el servidor debe terminar
+static int service_housekeeping(void) {
+    if (stats_requested) {
+        stats_requested = 0;
+        log_pool_stats();
+        tls_log_stats();
+    }
+    // Reabre los enlaces con los nodos vecinos que esten caidos
+    federation_connect_peers();
+    // SIGTERM pide terminar de forma ordenada sin entregar el socket
+    if (drain_requested && !draining)
+        begin_drain();
+    // Durante el vaciado se sale cuando no quedan tramas pendientes o se agota el tiempo
+    if (draining && (drain_finished() || time(NULL) >= drain_deadline))
+        return 1;
+    return force_exit;
+}
+
+#ifdef CHAT_EVENT_LOOP
+// Atiende una señal recibida por el bucle de eventos, retorna 1 si el servidor debe terminar
+static int handle_loop_signal(int signum) {
+    if (signum == SIGINT) force_exit = 1;
+    else if (signum == SIGTERM) drain_requested = 1;
+    else if (signum == SIGUSR1) stats_requested = 1;
+    return service_housekeeping();
+}
+
+static const int loop_signals[] = { SIGINT, SIGTERM, SIGUSR1 }; // Señales atendidas por el bucle
+#define LOOP_SIGNALS (int)(sizeof(loop_signals) / sizeof(loop_signals[0]))
+#endif
+
+#if defined(CHAT_EVENT_LIBUV)
+static uv_loop_t event_loop;                    // Bucle libuv compartido con libwebsockets
+static uv_timer_t idle_timer;                   // Revisa la inactividad cada segundo
+static uv_signal_t signal_watchers[LOOP_SIGNALS]; // Señales nativas del bucle
+
+// Temporizador de inactividad y tareas periodicas, reemplaza al hilo de inactividad
+static void on_idle_timer(uv_timer_t *timer) {
+    check_inactive_clients();
+    if (service_housekeeping()) uv_stop(&event_loop);
+}
+
+// Señal recibida dentro del bucle, sin manejadores asincronos
+static void on_loop_signal(uv_signal_t *watcher, int signum) {
+    if (handle_loop_signal(signum)) uv_stop(&event_loop);
+}
+
+// Prepara el bucle libuv y se lo pasa a libwebsockets
+static void event_loop_init(struct lws_context_creation_info *info, void **foreign_loops) {
+    uv_loop_init(&event_loop);
+    foreign_loops[0] = &event_loop;
+    info->foreign_loops = foreign_loops;
+    info->options |= LWS_SERVER_OPTION_LIBUV;
+}
+
+// Ejecuta el bucle hasta que se pida terminar
+static void event_loop_run(void) {
+    uv_timer_init(&event_loop, &idle_timer);
+    uv_timer_start(&idle_timer, on_idle_timer, 1000, 1000);
+    for (int i = 0; i < LOOP_SIGNALS; i++) {
+        uv_signal_init(&event_loop, &signal_watchers[i]);
+        uv_signal_start(&signal_watchers[i], on_loop_signal, loop_signals[i]);
+    }
+    uv_run(&event_loop, UV_RUN_DEFAULT);
+    uv_close((uv_handle_t *)&idle_timer, NULL);
+    for (int i = 0; i < LOOP_SIGNALS; i++)
+        uv_close((uv_handle_t *)&signal_watchers[i], NULL);
+}
+
+// Destruye el contexto y deja que libuv cierre todos los handles antes de cerrar el bucle
+static void event_loop_destroy(struct lws_context *context) {
+    lws_context_destroy(context);
+    while (uv_loop_close(&event_loop) == UV_EBUSY)
+        uv_run(&event_loop, UV_RUN_ONCE);
+}
+#elif defined(CHAT_EVENT_LIBEV)
+static struct ev_loop *event_loop;               // Bucle libev compartido con libwebsockets
+static ev_timer idle_timer;                      // Revisa la inactividad cada segundo
+static ev_signal signal_watchers[LOOP_SIGNALS];  // Señales nativas del bucle
+
+// Temporizador de inactividad y tareas periodicas, reemplaza al hilo de inactividad
+static void on_idle_timer(struct ev_loop *loop, ev_timer *timer, int revents) {
+    check_inactive_clients();
+    if (service_housekeeping()) ev_break(loop, EVBREAK_ALL);
+}
+
+// Señal recibida dentro del bucle, sin manejadores asincronos
+static void on_loop_signal(struct ev_loop *loop, ev_signal *watcher, int revents) {
+    if (handle_loop_signal(watcher->signum)) ev_break(loop, EVBREAK_ALL);
+}
+
+// Prepara el bucle libev y se lo pasa a libwebsockets
+static void event_loop_init(struct lws_context_creation_info *info, void **foreign_loops) {
+    event_loop = ev_default_loop(EVFLAG_AUTO); // libev atiende señales en el bucle por defecto
+    foreign_loops[0] = event_loop;
+    info->foreign_loops = foreign_loops;
+    info->options |= LWS_SERVER_OPTION_LIBEV;
+}
+
+// Ejecuta el bucle hasta que se pida terminar
+static void event_loop_run(void) {
+    ev_timer_init(&idle_timer, on_idle_timer, 1.0, 1.0);
+    ev_timer_start(event_loop, &idle_timer);
+    for (int i = 0; i < LOOP_SIGNALS; i++) {
+        ev_signal_init(&signal_watchers[i], on_loop_signal, loop_signals[i]);
+        ev_signal_start(event_loop, &signal_watchers[i]);
+    }
+    ev_run(event_loop, 0);
+    ev_timer_stop(event_loop, &idle_timer);
+    for (int i = 0; i < LOOP_SIGNALS; i++)
+        ev_signal_stop(event_loop, &signal_watchers[i]);
+}
+
+// Destruye el contexto y luego el bucle
+static void event_loop_destroy(struct lws_context *context) {
+    lws_context_destroy(context);
+    ev_loop_destroy(event_loop);
+}
+#endif
+
+#ifndef CHAT_EVENT_LOOP
+// Manejador de señal para finalizar el servidor Ctrl+C
+static void sighandler(int sig) {
+    force_exit = 1;
+}
 
+// Manejador de SIGTERM: deja de aceptar conexiones, avisa a los clientes y termina al vaciar las colas
+static void drain_sighandler(int sig) {
+    drain_requested = 1;
+}
+
+// Manejador de SIGUSR1: pide mostrar las estadisticas de los pools
+static void stats_sighandler(int sig) {
+    stats_requested = 1;
+}
+#endif
+
+// Callback de los descriptores propios adoptados en libwebsockets: el socket de escucha y el de control
+static int callback_sockets(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+    switch (reason) {
+        case LWS_CALLBACK_RAW_RX_FILE: {
+            int fd = lws_get_socket_fd(wsi);
+            if (fd == listen_fd) {
+                // Durante el vaciado no se aceptan conexiones, las atiende el proceso nuevo
+                if (draining) return -1;
+                accept_pending_connections(wsi);
+            } else if (fd == control_fd) {
+                // Un binario nuevo pide el socket de escucha
+                handle_upgrade_request();
+            }
+            break;
+        }
+        case LWS_CALLBACK_RAW_CLOSE_FILE:
+            if (wsi == listen_wsi) listen_wsi = NULL;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
 
 // Definicion de los protocolos que usara libwebsockets
 static struct lws_protocols protocols[] = {
     {
         "chat-protocol", // Nombre del protocolo
         callback_chat, // Función callback que gestiona los eventos del WebSocket
-        0,               // Tamaño de datos por sesion
-        MAX_MESSAGE_LENGTH, // Tamaño máximo del buffer de recepción
+        sizeof(SessionData), // Tamaño de datos por sesion, guarda la cola de salida
+        MAX_JSON_LENGTH, // Tamaño máximo del buffer de recepción
+    },
+    {
+        FED_PROTOCOL,    // Enlaces entre nodos de la federacion
+        callback_federation,
+        sizeof(SessionData), // Los enlaces usan la misma cola de salida que los clientes
+        MAX_JSON_LENGTH,
+    },
+    {
+        "raw-sockets",   // Descriptores propios: escucha TCP y control de actualizacion
+        callback_sockets,
+        0,
+        0,
     },
     { NULL, NULL, 0, 0 } // Elemento terminador
 };
 
+// Muestra el uso del servidor y sus opciones
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [opciones] <puertodelservidor>\n", prog);
+    fprintf(stderr, "  -w <bytes>  Maximo de bytes pendientes por cliente antes de desconectarlo (por defecto %zu)\n",
+            slow_policy.high_water);
+    fprintf(stderr, "  -p <pct>    Porcentaje del maximo desde el que se descartan presencias (por defecto %d)\n",
+            slow_policy.presence_pct);
+    fprintf(stderr, "  -b <pct>    Porcentaje del maximo desde el que se descartan broadcasts (por defecto %d)\n",
+            slow_policy.broadcast_pct);
+    fprintf(stderr, "  -m <dir>    Directorio de los buzones de usuarios desconectados (por defecto %s)\n",
+            mailbox_dir);
+    fprintf(stderr, "  -t <seg>    Segundos que se conservan los mensajes en los buzones (por defecto %ld)\n",
+            mailbox_ttl);
+    fprintf(stderr, "  -u <ruta>   Socket Unix de control para actualizar el servidor sin cortes\n");
+    fprintf(stderr, "  -U          Tomar el socket de escucha del servidor que atiende en -u en lugar de abrir el puerto\n");
+    fprintf(stderr, "  -s <ms>     Ventana en la que se reparten las reconexiones al actualizar (por defecto %d)\n",
+            upgrade_spread_ms);
+    fprintf(stderr, "  -c <pem>    Certificado para aceptar conexiones TLS (wss)\n");
+    fprintf(stderr, "  -k <pem>    Clave privada del certificado\n");
+    fprintf(stderr, "  -K <arch>   Archivo de %d bytes con las claves de tickets TLS compartidas entre procesos\n",
+            TLS_TICKET_KEYS_LENGTH);
+    fprintf(stderr, "  -r <arch>   Capturar las tramas entrantes en arch para reproducirlas con chat_replay\n");
+    fprintf(stderr, "  -I          Permitir varios usuarios desde la misma IP\n");
+    fprintf(stderr, "  -n <nombre> Nombre de este nodo en una federacion de servidores\n");
+    fprintf(stderr, "  -P <nombre@host:puerto> Nodo vecino de la federacion, se repite por cada nodo (maximo %d)\n",
+            FED_MAX_NODES);
+    fprintf(stderr, "  -S <arch>   Archivo con el secreto compartido por los nodos (al menos %d bytes), requerido con -P\n",
+            FED_SECRET_MIN);
+    fprintf(stderr, "  -A <pem>    Autoridades para verificar los certificados de los nodos vecinos con TLS (por defecto las del sistema)\n");
+    fprintf(stderr, "  -L <bytes>  Maximo de bytes pendientes en un enlace entre nodos (por defecto %zu)\n",
+            link_high_water);
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Uso: %s <puertodelservidor>\n", argv[0]); // Informa el uso correcto si no se pasa el puerto
+    // Leer las opciones de la politica de clientes lentos
+    int opt;
+    int takeover = 0;
+    while ((opt = getopt(argc, argv, "w:p:b:m:t:u:Us:c:k:K:n:P:S:A:L:r:I")) != -1) {
+        switch (opt) {
+            case 'w': slow_policy.high_water = (size_t)strtoul(optarg, NULL, 10); break;
+            case 'p': slow_policy.presence_pct = atoi(optarg); break;
+            case 'b': slow_policy.broadcast_pct = atoi(optarg); break;
+            case 'm': mailbox_dir = optarg; break;
+            case 't': mailbox_ttl = strtol(optarg, NULL, 10); break;
+            case 'u': control_path = optarg; break;
+            case 'U': takeover = 1; break;
+            case 's': upgrade_spread_ms = atoi(optarg); break;
+            case 'c': tls_cert_path = optarg; break;
+            case 'k': tls_key_path = optarg; break;
+            case 'K': tls_ticket_keys_path = optarg; break;
+            case 'r': capture_path = optarg; break;
+            case 'I': allow_shared_ip = 1; break;
+            case 'n': strncpy(node_name, optarg, FED_NAME_LENGTH - 1); break;
+            case 'P':
+                if (fed_add_node(optarg) != 0) {
+                    fprintf(stderr, "Nodo vecino inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'S':
+                if (federation_load_secret(optarg) != 0) {
+                    fprintf(stderr, "No se pudo leer el secreto de %s o tiene menos de %d bytes.\n", optarg, FED_SECRET_MIN);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'A': fed_ca_path = optarg; break;
+            case 'L': link_high_water = (size_t)strtoul(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ((tls_cert_path == NULL) != (tls_key_path == NULL)) {
+        fprintf(stderr, "Para usar TLS se requieren -c y -k.\n");
+        return EXIT_FAILURE;
+    }
+    if (fed_ca_path && !tls_cert_path) {
+        fprintf(stderr, "La opcion -A solo se usa con TLS (-c y -k).\n");
+        return EXIT_FAILURE;
+    }
+    if (fed_node_count > 0 && !federation_enabled()) {
+        fprintf(stderr, "Para enlazar nodos con -P se requiere el nombre del nodo con -n.\n");
+        return EXIT_FAILURE;
+    }
+    if (fed_node_count > 0 && fed_secret_len == 0) {
+        fprintf(stderr, "Para enlazar nodos con -P se requiere el secreto compartido con -S.\n");
+        return EXIT_FAILURE;
+    }
+    if (link_high_water < MAX_JSON_LENGTH) {
+        fprintf(stderr, "Maximo de bytes de los enlaces inválido.\n");
+        return EXIT_FAILURE;
+    }
+    if (takeover && !control_path) {
+        fprintf(stderr, "La opcion -U requiere -u <ruta>.\n");
+        return EXIT_FAILURE;
+    }
+    if (optind >= argc && !takeover) {
+        usage(argv[0]); // Informa el uso correcto si no se pasa el puerto
         return EXIT_FAILURE;  // Termina el programa con error
     }
-    
-    int port = atoi(argv[1]);  // Convierte el argumento del puerto a entero
-    if (port <= 0) {
-        fprintf(stderr, "Puerto inválido.\n"); // Notifica si el puerto es invalido
+    if (slow_policy.high_water < MAX_JSON_LENGTH ||
+        slow_policy.presence_pct <= 0 || slow_policy.presence_pct > slow_policy.broadcast_pct ||
+        slow_policy.broadcast_pct > 100) {
+        fprintf(stderr, "Politica de clientes lentos inválida.\n");
         return EXIT_FAILURE;
     }
     
+    int port = 0;
+    if (takeover) {
+        // Toma el socket de escucha del proceso en ejecucion, las conexiones en cola no se pierden
+        listen_fd = takeover_listen_socket(control_path);
+        if (listen_fd < 0) {
+            fprintf(stderr, "No se pudo tomar el socket de escucha de %s.\n", control_path);
+            return EXIT_FAILURE;
+        }
+    } else {
+        port = atoi(argv[optind]);  // Convierte el argumento del puerto a entero
+        if (port <= 0) {
+            fprintf(stderr, "Puerto inválido.\n"); // Notifica si el puerto es invalido
+            return EXIT_FAILURE;
+        }
+        listen_fd = create_listen_socket(port);
+        if (listen_fd < 0) {
+            fprintf(stderr, "No se pudo escuchar en el puerto %d.\n", port);
+            return EXIT_FAILURE;
+        }
+    }
+    // El socket de control permite que la siguiente version tome el socket de escucha
+    if (control_path) {
+        control_fd = create_control_socket(control_path);
+        if (control_fd < 0) {
+            fprintf(stderr, "No se pudo crear el socket de control %s.\n", control_path);
+            return EXIT_FAILURE;
+        }
+    }
+    
+#ifndef CHAT_EVENT_LOOP
     // Configurar el manejador de señal para finalizar el servidor con Ctrl+C
     signal(SIGINT, sighandler);
+    // SIGTERM termina de forma ordenada vaciando las colas
+    signal(SIGTERM, drain_sighandler);
+    // SIGUSR1 muestra las estadisticas de memoria
+    signal(SIGUSR1, stats_sighandler);
+#endif
     
+    // Las escrituras al socket solo ocurren en el hilo que ejecuta lws_service
+    service_thread = pthread_self();
+
     // Configuración del contexto de libwebsockets.
     struct lws_context_creation_info info; 
     memset(&info, 0, sizeof(info));  // Inicializa la estructura a cero
-    info.port = port;  // Establece el protocolo definido
+    info.port = CONTEXT_PORT_NO_LISTEN_SERVER;  // El socket de escucha es propio y se adopta despues
     info.protocols = protocols;  // Establece el protocolo definido
     info.gid = -1;
     info.uid = -1;
     info.options = 0; // Opciones adicionales según se requiera
+    if (tls_cert_path) {
+        // TLS nativo: las conexiones adoptadas del socket de escucha negocian TLS en el vhost
+        info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+        info.ssl_cert_filepath = tls_cert_path;
+        info.ssl_private_key_filepath = tls_key_path;
+        info.client_ssl_ca_filepath = fed_ca_path; // Para los enlaces salientes hacia los nodos vecinos
+        fed_use_tls = 1;
+    }
     
+#ifdef CHAT_EVENT_LOOP
+    // El servidor corre sobre un bucle libuv o libev; temporizadores y señales son nativos del bucle
+    void *foreign_loops[1];
+    event_loop_init(&info, foreign_loops);
+#endif
+
     // Crear el contexto de libwebsockets
     struct lws_context *context = lws_create_context(&info);
     if (context == NULL) {
@@ -170,7 +611,59 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
     
-    lwsl_user("Servidor iniciado en el puerto %d.\n", port);
+    // Adopta el socket de escucha y el de control para que lws_service los vigile
+    struct lws_vhost *vhost = lws_get_vhost_by_name(context, "default");
+    lws_sock_file_fd_type sfd;
+    sfd.filefd = listen_fd;
+    listen_wsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, sfd, "raw-sockets", NULL);
+    if (listen_wsi == NULL) {
+        fprintf(stderr, "Error al adoptar el socket de escucha.\n");
+        lws_context_destroy(context);
+        return EXIT_FAILURE;
+    }
+    if (control_fd >= 0) {
+        sfd.filefd = control_fd;
+        if (!lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, sfd, "raw-sockets", NULL)) {
+            fprintf(stderr, "Error al adoptar el socket de control.\n");
+            lws_context_destroy(context);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Los enlaces hacia los nodos vecinos se abren desde este vhost
+    fed_context = context;
+    fed_vhost = vhost;
+    federation_connect_peers();
+
+    // Captura de trafico, la escritura al disco ocurre en su propio hilo
+    if (capture_path && capture_start(capture_path) != 0) {
+        fprintf(stderr, "No se pudo abrir el archivo de captura %s.\n", capture_path);
+        lws_context_destroy(context);
+        return EXIT_FAILURE;
+    }
+
+    // Hilo que indexa los broadcasts recientes y responde las busquedas
+    if (search_start(deliver_search_results) != 0) {
+        fprintf(stderr, "Error al iniciar la busqueda de mensajes.\n");
+        lws_context_destroy(context);
+        return EXIT_FAILURE;
+    }
+
+    if (takeover)
+        lwsl_user("Servidor iniciado con el socket de escucha de %s.\n", control_path);
+    else
+        lwsl_user("Servidor iniciado en el puerto %d.\n", port);
+#ifdef CHAT_EVENT_LOOP
+    // El bucle de eventos atiende libwebsockets, la inactividad y las señales sin hilos extra
+    event_loop_run();
+    force_exit = 1;
+    search_shutdown();
+    capture_shutdown();
+    // Si el socket de control no se entrego a otro proceso se elimina
+    if (control_path && !handed_off)
+        unlink(control_path);
+    event_loop_destroy(context);
+#else
     // Lanzar el hilo de monitoreo de inactividad del servidor
     pthread_t inactivity_tid;
     if (pthread_create(&inactivity_tid, NULL, inactivity_monitor, NULL) != 0) {
@@ -182,11 +675,24 @@ int main(int argc, char **argv) {
     // Bucle principal del servidor
     while (!force_exit) {
         lws_service(context, 50);
+        if (service_housekeeping())
+            break;
     }
+    force_exit = 1; // Detiene el hilo de inactividad
     
     pthread_join(inactivity_tid, NULL);
+    search_shutdown();
+    capture_shutdown();
+    // Si el socket de control no se entrego a otro proceso se elimina
+    if (control_path && !handed_off)
+        unlink(control_path);
     // Limpieza y finalizacion
     lws_context_destroy(context);
+#endif
+    // Los mensajes que siguen en memoria se conservan para la proxima ejecucion
+    mailbox_flush_all();
+    log_pool_stats();
+    tls_log_stats();
     lwsl_user("Servidor finalizado.\n");
     
     return EXIT_SUCCESS;
@@ -5,138 +5,909 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <arpa/inet.h>
 #include "protocol.h"
 #include <libwebsockets.h>
+#include "mailbox.h"
+#include "presence.h"
+#include "pool.h"
+#include "delivery.h"
+#include "search.h"
+#include "directory.h"
+#include "roster.h"
+#include "intern.h"
 
-// Estructura que representa un cliente conectado incluyendo su nombre, IP, estado, conexion WebSocket
-typedef struct Client {
-    char username[MAX_FIELD_LENGTH]; // Nombre del usuario
-    char ip[MAX_FIELD_LENGTH]; // Dirección IP del cliente
-    char status[MAX_FIELD_LENGTH]; // Por ejemplo ACTIVO OCUPADO INACTIVO
-    struct lws *wsi;             // Puntero a la conexión WebSocket 
-    struct Client *next;  // Puntero al siguiente cliente en la lista
-    time_t last_activity; // ultima vez que el cliente mando un mensaje
+// Estado de un cliente, se guarda como numero y solo se convierte a texto al mandarlo
+typedef enum {
+    CLIENT_ACTIVE = 0,   // ACTIVO
+    CLIENT_BUSY,         // OCUPADO
+    CLIENT_INACTIVE,     // INACTIVO
+    CLIENT_STATUSES
+} ClientStatus;
+
+// Texto de cada estado en el protocolo
+static const char *const client_status_names[CLIENT_STATUSES] = { STATUS_ACTIVE, STATUS_BUSY, STATUS_INACTIVE };
+
+// Convierte el texto de un estado a ClientStatus, retorna -1 si no es un estado conocido
+static inline int client_status_parse(const char *text) {
+    for (int i = 0; i < CLIENT_STATUSES; i++)
+        if (strcmp(text, client_status_names[i]) == 0) return i;
+    return -1;
+}
+
+// Direccion IP en binario, family es AF_INET o AF_INET6, o 0 si no se pudo leer la direccion
+typedef struct {
+    uint8_t family;
+    uint8_t bytes[16];
+} ClientAddr;
+
+// Lee la IP en texto que entrega lws_get_peer_simple
+static inline void client_addr_parse(ClientAddr *addr, const char *text) {
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, text, addr->bytes) == 1) addr->family = AF_INET;
+    else if (inet_pton(AF_INET6, text, addr->bytes) == 1) addr->family = AF_INET6;
+}
+
+// Escribe la IP en texto en out, vacio si no se conoce
+static inline void client_addr_format(const ClientAddr *addr, char *out, size_t size) {
+    if (!addr->family || !inet_ntop(addr->family, addr->bytes, out, (socklen_t)size)) out[0] = '\0';
+}
+
+// 1 si las dos direcciones son la misma IP, dos direcciones desconocidas no se consideran iguales
+static inline int client_addr_equal(const ClientAddr *a, const ClientAddr *b) {
+    if (!a->family || a->family != b->family) return 0;
+    return memcmp(a->bytes, b->bytes, a->family == AF_INET ? 4 : 16) == 0;
+}
 
+// Registro de un cliente conectado con los campos que se usan poco: nombre, IP y presencia
+// Los campos que se leen en cada mensaje recibido van aparte en client_hot
+typedef struct Client {
+    const char *username;       // Nombre del usuario, internado y compartido con el indice de list_users
+    uint32_t slot;              // Posicion del cliente en client_hot
+    ClientAddr ip;              // Dirección IP del cliente
+    PresenceMode presence_mode; // Que actualizaciones de presencia recibe el cliente
+    PresenceSub *subscriptions; // Usuarios cuya presencia observa en modo PRESENCE_LIST
 } Client;
 
-// Lista global de clientes y mutex para sincronización.
-static Client *client_list = NULL; // Lista enlazada de clientes conectados
-static pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex para proteger la lista de clientes
+// Campos de un cliente que se leen en cada mensaje recibido y en el recorrido de inactivos
+// Van en un arreglo denso, asi recorrer a todos los clientes no salta entre registros dispersos
+typedef struct {
+    struct lws *wsi;            // Puntero a la conexión WebSocket
+    Client *client;             // Registro con el resto de los campos
+    time_t last_activity;       // ultima vez que el cliente mando un mensaje
+    uint8_t status;             // ClientStatus actual
+} ClientHot;
+
+// Clientes conectados y mutex para sincronización.
+static ClientHot *client_hot = NULL;  // Un elemento por cliente conectado, sin huecos
+static size_t client_count = 0;       // Clientes conectados
+static size_t client_hot_capacity = 0; // Elementos reservados en client_hot
+static pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex para proteger los clientes
+static ObjectPool client_pool = OBJECT_POOL_INIT(sizeof(Client), 64); // Pool de registros Client
+static int presence_all_count = 0; // Clientes en modo PRESENCE_ALL, si es 0 no se recorren los clientes al publicar presencia
+
+// Conexion de un cliente, se llama con client_list_mutex tomado
+static inline struct lws *client_wsi(const Client *client) {
+    return client_hot[client->slot].wsi;
+}
+
+#define MULTICAST_MAX_TARGETS 256 // Destinatarios maximos de un privado con lista de usuarios
+#define ROSTER_DEFAULT_LIMIT  100 // Usuarios por pagina de list_users si no se pide limit
+#define ROSTER_MAX_LIMIT      500 // Maximo de usuarios por pagina de list_users
+
+// Hilo que ejecuta lws_service, solo desde el se puede llamar a lws_callback_on_writable
+static pthread_t service_thread;
+
+// Clase de cada trama saliente, define que se descarta primero cuando un cliente no consume
+typedef enum {
+    OUT_CONTROL = 0,   // Respuestas y errores del servidor, nunca se descartan
+    OUT_PRIVATE,       // Mensajes privados, nunca se descartan
+    OUT_BROADCAST,     // Mensajes de chat general
+    OUT_PRESENCE       // status_update y user_disconnected
+} OutboundClass;
+
+// Carril de la cola de salida, cada conexion tiene una cola por carril
+// Las respuestas del servidor no esperan detras del chat y las presencias van aparte para poder reemplazarlas
+typedef enum {
+    LANE_CONTROL = 0,  // OUT_CONTROL
+    LANE_CHAT,         // OUT_PRIVATE y OUT_BROADCAST, en el mismo carril para no reordenarlos entre si
+    LANE_PRESENCE,     // OUT_PRESENCE
+    OUT_LANES
+} OutboundLane;
+
+// Tramas seguidas que escribe cada carril antes de ceder el turno al siguiente
+// Con el chat saturado una respuesta espera a lo sumo 4 tramas de chat y 1 de presencia
+static const int outbound_lane_weight[OUT_LANES] = { 8, 4, 1 };
+
+// Trama pendiente de envio, los datos se guardan con el espacio LWS_PRE que requiere lws_write
+typedef struct OutboundFrame {
+    struct OutboundFrame *next; // Siguiente trama en la cola
+    size_t len;                 // Longitud del JSON sin contar LWS_PRE
+    OutboundClass cls;          // Clase de la trama
+    int pool_class;             // Clase de tamano del pool de donde salio, -1 si vino del heap
+    const char *key;            // Usuario del que informa una presencia, apunta dentro de data; NULL si no tiene
+    unsigned char data[];       // LWS_PRE bytes libres seguidos del JSON
+} OutboundFrame;
+
+// Cola de tramas de un carril
+typedef struct {
+    OutboundFrame *head;        // Primera trama pendiente
+    OutboundFrame *tail;        // Ultima trama pendiente
+} OutboundQueue;
+
+// Datos por sesion que libwebsockets reserva para cada conexion
+typedef struct SessionData {
+    pthread_mutex_t lock;          // Protege las colas, se encola desde otros hilos
+    OutboundQueue lanes[OUT_LANES]; // Tramas pendientes de cada carril
+    int lane;                      // Carril que tiene el turno de escritura
+    int lane_used;                 // Tramas que ya escribio el carril en este turno
+    size_t queued_bytes;           // Bytes pendientes de escribir en el socket, sumando todos los carriles
+    int evict;                     // 1 si se debe desconectar por consumidor lento
+    int evict_armed;               // 1 si ya se programo el cierre desde el hilo de servicio
+    int closed;                    // 1 si la conexion ya se cerro y no se aceptan mas tramas
+    unsigned long dropped_presence; // Presencias descartadas por la politica
+    unsigned long dropped_broadcast; // Broadcasts descartados por la politica
+    unsigned long superseded_presence; // Presencias reemplazadas por una mas nueva del mismo usuario
+    int reliable;                  // 1 si el cliente manda ids y recibe seq y ack
+    uint64_t next_seq;             // Ultimo seq asignado a una trama saliente
+    DedupWindow dedup;             // Ids recibidos del cliente
+    int ack_pending;               // 1 si hay un ack que todavia no viajo en ninguna trama
+    time_t ack_pending_since;      // Desde cuando espera ese ack
+    uint32_t conn_id;              // Identificador de la conexion en la captura de trafico
+    uint32_t client_slot;          // Posicion en client_hot mas 1, 0 si no hay usuario registrado; usa client_list_mutex
+    int link;                      // 1 si es un enlace entre nodos, usa link_high_water en lugar de la politica de clientes
+    unsigned long dropped_link;    // Tramas de chat o presencia descartadas por un enlace lleno
+    int offline_pending;           // 1 si quedan mensajes del buzon por entregar cuando se vacie la cola
+} SessionData;
+
+// Politica para clientes lentos: al superar cada porcentaje del limite se descarta una clase
+typedef struct {
+    size_t high_water;   // Maximo de bytes pendientes por conexion antes de desconectar
+    int presence_pct;    // Porcentaje del limite a partir del cual se descartan presencias
+    int broadcast_pct;   // Porcentaje del limite a partir del cual se descartan broadcasts
+} SlowConsumerPolicy;
+
+static SlowConsumerPolicy slow_policy = { 256 * 1024, 50, 75 };
+
+// Maximo de bytes pendientes en un enlace entre nodos; un enlace lleva el trafico de todos los usuarios del nodo
+static size_t link_high_water = 16 * 1024 * 1024;
+
+// 1 si se permiten varios usuarios desde la misma IP, por ejemplo para reproducir una captura
+static int allow_shared_ip = 0;
+
+#define SLOW_CONSUMER_REASON "Consumidor lento"
+
+static inline void federation_announce(const char *type, const char *username);
+static inline void resume_offline_messages(struct lws *wsi, SessionData *pss);
+
+// Asegura lugar para un cliente mas en client_hot, se llama con client_list_mutex tomado
+// Retorna 0 si hay lugar o -1 si no hay memoria
+static inline int client_hot_reserve(void) {
+    if (client_count < client_hot_capacity) return 0;
+    size_t capacity = client_hot_capacity ? client_hot_capacity * 2 : 64;
+    ClientHot *grown = (ClientHot *)heap_realloc(client_hot, capacity * sizeof(ClientHot));
+    if (!grown) return -1;
+    client_hot = grown;
+    client_hot_capacity = capacity;
+    return 0;
+}
+
+// Cliente registrado en la conexion wsi, o NULL si no hay; se llama con client_list_mutex tomado
+static inline ClientHot *client_hot_by_wsi(struct lws *wsi) {
+    SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+    if (!pss || pss->client_slot == 0) return NULL;
+    return &client_hot[pss->client_slot - 1];
+}
 
-// Agrega un nuevo cliente a la lista. Retorna 0 si se agregó exitosamente,
+// Agrega un nuevo cliente conectado en wsi. Retorna 0 si se agregó exitosamente,
 // o -1 si ya existe un cliente con el mismo nombre o con la misma IP.
-static inline int add_client(Client *new_client) {
+// En una federacion el nombre tampoco puede estar conectado en otro nodo
+static inline int add_client(Client *new_client, struct lws *wsi) {
     int ret = 0;
-    pthread_mutex_lock(&client_list_mutex); // Bloquea el mutex para acceso exclusivo a la lista.
-    Client *curr = client_list; // Inicia el recorrido en la cabeza de la lista.
-    while (curr != NULL) { // Recorre cada cliente en la lista.
-        // Verifica si el nombre de usuario ya existe o si la dirección IP ya está registrada.
-        if (strcmp(curr->username, new_client->username) == 0 || 
-            strcmp(curr->ip, new_client->ip) == 0) {
-            ret = -1; // Si se encuentra duplicado (nombre o IP), se marca error.
-            break;
-        }
-        curr = curr->next; // Avanza al siguiente cliente.
+    pthread_mutex_lock(&client_list_mutex); // Bloquea el mutex para acceso exclusivo a los clientes.
+    // Una conexion registra un solo usuario; un segundo registro pisaria client_slot y dejaria el primero huerfano
+    SessionData *own = (SessionData *)lws_wsi_user(wsi);
+    if (own && own->client_slot != 0)
+        ret = -1;
+    // Verifica si el nombre de usuario ya existe, el indice ordenado lo resuelve sin recorrer los clientes
+    if (ret == 0 && roster_find(new_client->username))
+        ret = -1;
+    for (size_t i = 0; ret == 0 && !allow_shared_ip && i < client_count; i++) {
+        // Verifica si la dirección IP ya está registrada.
+        if (client_addr_equal(&client_hot[i].client->ip, &new_client->ip))
+            ret = -1; // Si se encuentra duplicado, se marca error.
     }
+    if (ret == 0 && directory_owner(new_client->username) >= 0)
+        ret = -1; // El nombre ya esta conectado en otro nodo
+    // Se reserva lugar en client_hot y en el indice ordenado de list_users, -1 si no hay memoria
+    if (ret == 0 && (client_hot_reserve() != 0 ||
+                     roster_insert(new_client->username, new_client, CLIENT_ACTIVE) != 0))
+        ret = -1;
+    char username[MAX_FIELD_LENGTH];
     if (ret == 0) { // Si no se encontró duplicado, se añade el nuevo cliente.
-        new_client->next = client_list; // Inserta el nuevo cliente al inicio de la lista.
-        client_list = new_client; // Actualiza la cabeza de la lista.
+        new_client->slot = (uint32_t)client_count;
+        ClientHot *hot = &client_hot[client_count++];
+        hot->wsi = wsi;
+        hot->client = new_client;
+        hot->last_activity = time(NULL);
+        hot->status = CLIENT_ACTIVE;
+        if (own) own->client_slot = new_client->slot + 1;
+        if (new_client->presence_mode == PRESENCE_ALL) presence_all_count++;
+        strncpy(username, new_client->username, MAX_FIELD_LENGTH - 1);
+        username[MAX_FIELD_LENGTH - 1] = '\0';
     }
     pthread_mutex_unlock(&client_list_mutex); // Libera el mutex.
+    // Los demas nodos anotan al usuario en su directorio
+    if (ret == 0) federation_announce(MSG_TYPE_NODE_USER_ADD, username);
     return ret; // Retorna 0 en éxito o -1 si se detectó duplicado.
 }
 
 
-// Elimina el cliente identificado por username de la lista retorna 0 si se elimino o -1 si no se encontro
+// Elimina el cliente identificado por username retorna 0 si se elimino o -1 si no se encontro
 static inline int remove_client(const char *username) {
     int ret = -1; // Inicializa el resultado en -1 no encontrado
-    pthread_mutex_lock(&client_list_mutex); // Bloquea el mutex para acceso seguro a la lista
-    Client *curr = client_list; // Inicia el recorrido en la cabeza de la lista
-    Client *prev = NULL; // Puntero para el cliente anterior, inicialmente nulo
-    while (curr != NULL) {
-        if (strcmp(curr->username, username) == 0) {
-            if (prev == NULL)
-                client_list = curr->next; // Si es el primer cliente, actualiza la cabeza de la lista
-            else
-                prev->next = curr->next; // Si no, enlaza el cliente anterior con el siguiente
-            free(curr); // Libera la memoria del cliente eliminado
-            ret = 0; // establece el resultado en 0 encontrado y eliminado
-            break;
+    pthread_mutex_lock(&client_list_mutex); // Bloquea el mutex para acceso seguro a los clientes
+    Client *curr = (Client *)roster_find(username);
+    if (curr != NULL) {
+        ClientHot *hot = &client_hot[curr->slot];
+        SessionData *pss = (SessionData *)lws_wsi_user(hot->wsi);
+        if (pss) pss->client_slot = 0;
+        roster_remove(curr->username, hot->status); // Lo quita del indice de list_users
+        // El ultimo cliente ocupa el lugar que queda libre, asi client_hot no tiene huecos
+        *hot = client_hot[--client_count];
+        if (hot != &client_hot[client_count]) {
+            hot->client->slot = curr->slot;
+            SessionData *moved = (SessionData *)lws_wsi_user(hot->wsi);
+            if (moved) moved->client_slot = curr->slot + 1;
         }
-        prev = curr;
-        curr = curr->next;
+        if (curr->presence_mode == PRESENCE_ALL) presence_all_count--;
+        presence_clear(&curr->subscriptions); // Cancela sus suscripciones de presencia
+        intern_release(curr->username);
+        pool_free(&client_pool, curr); // Devuelve el registro al pool
+        ret = 0; // establece el resultado en 0 encontrado y eliminado
     }
     // libera el mutex
     pthread_mutex_unlock(&client_list_mutex);
+    // Los demas nodos lo quitan de su directorio
+    if (ret == 0) federation_announce(MSG_TYPE_NODE_USER_REMOVE, username);
     return ret;
 }
 
 // Busca y retorna un puntero al cliente cuyo username coincide
 static inline Client* find_client(const char *username) {
-    Client *found = NULL; // Inicializa el resultado en null
     pthread_mutex_lock(&client_list_mutex); // bloquea el mutex
-    Client *curr = client_list; // Inicia el recorrido en la cabeza de la lista
-    while (curr != NULL) {
-        if (strcmp(curr->username, username) == 0) {
-            found = curr; // guarda el puntero del cliente
-            break;
-        }
-        curr = curr->next;
-    }
+    Client *found = (Client *)roster_find(username); // Busqueda binaria en el indice ordenado
     // libera el mutex
     pthread_mutex_unlock(&client_list_mutex);
     return found;
 }
 
-// Manda un mensaje a la conexión WebSocket especificada serializa el mensaje a JSON y lo envia
+// Determina la clase de salida de un mensaje segun su tipo
+static inline OutboundClass classify_message(const ProtocolMessage *msg) {
+    if (strcmp(msg->type, MSG_TYPE_STATUS_UPDATE) == 0 ||
+        strcmp(msg->type, MSG_TYPE_USER_DISCONNECTED) == 0)
+        return OUT_PRESENCE;
+    if (strcmp(msg->type, MSG_TYPE_BROADCAST) == 0)
+        return OUT_BROADCAST;
+    if (strcmp(msg->type, MSG_TYPE_PRIVATE) == 0)
+        return OUT_PRIVATE;
+    return OUT_CONTROL;
+}
+
+// Carril por el que sale cada clase de trama
+static inline OutboundLane outbound_lane(OutboundClass cls) {
+    if (cls == OUT_CONTROL) return LANE_CONTROL;
+    if (cls == OUT_PRESENCE) return LANE_PRESENCE;
+    return LANE_CHAT;
+}
+
+// 1 si la sesion tiene tramas pendientes en algun carril, se llama con pss->lock tomado
+static inline int outbound_pending_locked(const SessionData *pss) {
+    for (int i = 0; i < OUT_LANES; i++)
+        if (pss->lanes[i].head) return 1;
+    return 0;
+}
+
+// Libera todas las tramas pendientes de una sesion, se llama con pss->lock tomado
+static inline void drop_outbound_locked(SessionData *pss) {
+    for (int i = 0; i < OUT_LANES; i++) {
+        OutboundFrame *f = pss->lanes[i].head;
+        while (f != NULL) {
+            OutboundFrame *next = f->next;
+            buffer_free(f, f->pool_class);
+            f = next;
+        }
+        pss->lanes[i].head = pss->lanes[i].tail = NULL;
+    }
+    pss->queued_bytes = 0;
+}
+
+// Bytes de la presencia pendiente sobre key, 0 si no hay una; con pss->lock tomado
+static inline size_t presence_pending_bytes_locked(SessionData *pss, const char *key) {
+    for (OutboundFrame *f = pss->lanes[LANE_PRESENCE].head; f != NULL; f = f->next)
+        if (f->key && strcmp(f->key, key) == 0) return f->len;
+    return 0;
+}
+
+// Quita del carril de presencias la trama pendiente sobre key, la nueva la deja vieja; con pss->lock tomado
+static inline void supersede_presence_locked(SessionData *pss, const char *key) {
+    OutboundQueue *q = &pss->lanes[LANE_PRESENCE];
+    OutboundFrame *prev = NULL;
+    for (OutboundFrame *f = q->head; f != NULL; prev = f, f = f->next) {
+        if (!f->key || strcmp(f->key, key) != 0) continue;
+        if (prev) prev->next = f->next;
+        else q->head = f->next;
+        if (q->tail == f) q->tail = prev;
+        pss->queued_bytes -= f->len;
+        pss->superseded_presence++;
+        buffer_free(f, f->pool_class);
+        return; // Cada encolado reemplaza a la anterior, no puede haber mas de una
+    }
+}
+
+// Saca la siguiente trama a escribir, se llama con pss->lock tomado
+// Los carriles se turnan: cada uno escribe hasta su peso en tramas seguidas y cede el turno,
+// asi el chat no bloquea las respuestas y tampoco se queda sin salida cuando hay muchas respuestas
+static inline OutboundFrame *outbound_pop_locked(SessionData *pss) {
+    for (int i = 0; i <= OUT_LANES; i++) {
+        OutboundQueue *q = &pss->lanes[pss->lane];
+        if (q->head && pss->lane_used < outbound_lane_weight[pss->lane]) {
+            OutboundFrame *f = q->head;
+            q->head = f->next;
+            if (!q->head) q->tail = NULL;
+            pss->lane_used++;
+            pss->queued_bytes -= f->len;
+            return f;
+        }
+        // Carril vacio o sin turno: pasa al siguiente
+        pss->lane = (pss->lane + 1) % OUT_LANES;
+        pss->lane_used = 0;
+    }
+    // Sin tramas pendientes el proximo turno empieza por las respuestas
+    pss->lane = LANE_CONTROL;
+    pss->lane_used = 0;
+    return NULL;
+}
+
+// Programa el cierre de una conexion marcada como consumidor lento, solo desde el hilo de servicio
+static inline void arm_eviction(struct lws *wsi, SessionData *pss) {
+    if (pss->evict_armed) return;
+    pss->evict_armed = 1;
+    lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION,
+                     (unsigned char *)SLOW_CONSUMER_REASON, strlen(SLOW_CONSUMER_REASON));
+    lws_set_timeout(wsi, PENDING_TIMEOUT_CLOSE_SEND, 1);
+}
+
+// Pide a libwebsockets que avise cuando se pueda escribir, desde otros hilos se despierta el bucle de servicio
+static inline void request_writable(struct lws *wsi) {
+    if (pthread_equal(pthread_self(), service_thread))
+        lws_callback_on_writable(wsi);
+    else
+        lws_cancel_service(lws_get_context(wsi)); // LWS_CALLBACK_EVENT_WAIT_CANCELLED revisa las colas
+}
+
+// Encola un JSON ya serializado en la conexion aplicando la politica de consumidores lentos
+// key es el usuario de una presencia, reemplaza a la presencia del mismo usuario que todavia no se escribio
+// Los enlaces entre nodos no se desalojan: desalojar uno haria que el vecino diera por desconectados a todos los
+// usuarios de este nodo. Pasado link_high_water descartan chat y presencias, y las tramas de control (cambios
+// de directorio) se encolan siempre para que los directorios no diverjan
+// Retorna la longitud encolada, 0 si la politica descarto la trama o -1 si la conexion se desaloja
+static inline int enqueue_keyed_frame(struct lws *wsi, const char *json, size_t len, OutboundClass cls,
+                                      const char *key) {
+    SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+    if (!pss) return -1;
+    int ret = (int)len;
+    int evicted = 0;
+    int link_full = 0;
+    pthread_mutex_lock(&pss->lock);
+    // La politica mira la cola como queda despues de encolar: una presencia que reemplaza a otra pendiente
+    // solo suma la diferencia, asi el reemplazo no descarta presencias nuevas que caben en lugar de las viejas
+    size_t replaced = key ? presence_pending_bytes_locked(pss, key) : 0;
+    size_t pending = pss->queued_bytes - replaced + len;
+    if (pss->closed || pss->evict) {
+        ret = -1; // Ya no se aceptan tramas para esta conexion
+    } else if (pss->link) {
+        if (cls != OUT_CONTROL && pending > link_high_water) {
+            link_full = pss->dropped_link++ % 1000 == 0; // Se avisa cada mil tramas descartadas
+            ret = 0;
+        }
+    } else if (cls == OUT_PRESENCE &&
+               pending > slow_policy.high_water * slow_policy.presence_pct / 100) {
+        pss->dropped_presence++; // Primer nivel: se descartan las presencias
+        ret = 0;
+    } else if (cls == OUT_BROADCAST &&
+               pending > slow_policy.high_water * slow_policy.broadcast_pct / 100) {
+        pss->dropped_broadcast++; // Segundo nivel: se descartan los broadcasts
+        ret = 0;
+    } else if (pending > slow_policy.high_water) {
+        pss->evict = 1; // Ultimo nivel: se desconecta y se libera la memoria pendiente
+        drop_outbound_locked(pss);
+        evicted = 1;
+        ret = -1;
+    }
+    if (ret > 0) {
+        int pool_class;
+        size_t key_len = key ? strlen(key) + 1 : 0;
+        // Se reserva espacio al final para agregar seq y ack al momento de escribir, y despues va la clave
+        OutboundFrame *f = (OutboundFrame *)buffer_alloc(sizeof(OutboundFrame) + LWS_PRE + len + DELIVERY_TRAILER_ROOM +
+                                                         key_len, &pool_class);
+        if (!f) {
+            ret = -1;
+        } else {
+            f->next = NULL;
+            f->len = len;
+            f->cls = cls;
+            f->pool_class = pool_class;
+            f->key = NULL;
+            memcpy(&f->data[LWS_PRE], json, len); // Respeta el offset LWS_PRE
+            if (key) {
+                char *copy = (char *)&f->data[LWS_PRE + len + DELIVERY_TRAILER_ROOM];
+                memcpy(copy, key, key_len);
+                f->key = copy;
+                supersede_presence_locked(pss, key);
+            }
+            OutboundQueue *q = &pss->lanes[outbound_lane(cls)];
+            if (q->tail) q->tail->next = f;
+            else q->head = f;
+            q->tail = f;
+            pss->queued_bytes += len;
+        }
+    }
+    pthread_mutex_unlock(&pss->lock);
+
+    if (evicted) {
+        lwsl_user("Cliente lento desalojado (%lu presencias y %lu broadcasts descartados).\n",
+                  pss->dropped_presence, pss->dropped_broadcast);
+        if (pthread_equal(pthread_self(), service_thread))
+            arm_eviction(wsi, pss);
+        else
+            lws_cancel_service(lws_get_context(wsi));
+    } else if (ret > 0) {
+        request_writable(wsi);
+    } else if (link_full) {
+        lwsl_warn("Enlace entre nodos lleno (%zu bytes pendientes), %lu tramas de chat o presencia descartadas.\n",
+                  link_high_water, pss->dropped_link);
+    }
+    return ret;
+}
+
+// Encola un JSON ya serializado en la conexion, igual que enqueue_keyed_frame sin clave
+static inline int enqueue_frame(struct lws *wsi, const char *json, size_t len, OutboundClass cls) {
+    return enqueue_keyed_frame(wsi, json, len, cls, NULL);
+}
+
+// Manda un mensaje a la conexión WebSocket especificada serializa el mensaje a JSON y lo encola
+// La escritura real ocurre en LWS_CALLBACK_SERVER_WRITEABLE para que un cliente lento no bloquee a los demas
 static inline int send_message(struct lws *wsi, const ProtocolMessage *msg) {
-    char *json = serialize_message(msg); // Convierte el mensaje a una cadena JSON
-    if (!json) return -1; // -1 si falla la serializacion
-    int len = strlen(json); // Calcula la longitud del JSON
-    // lws_write requiere que el buffer de datos comience en un offset LWS_PRE,por lo que se utiliza un buffer temporal que incluye ese espacio
-    // Reserva un buffer con el espacio requerido por LWS_PRE
-    unsigned char buffer[LWS_PRE + MAX_MESSAGE_LENGTH];
-    // Inicializa el buffer con ceros
-    memset(buffer, 0, sizeof(buffer));
-    // Copia el JSON en el buffer, respetando el offset LWS_PRE
-    memcpy(&buffer[LWS_PRE], json, len);
-    // Manda el mensaje a través del WebSocket
-    int n = lws_write(wsi, &buffer[LWS_PRE], len, LWS_WRITE_TEXT);
-    free(json); // libera la memoria del JSON
-    return n; // retorna el resultado de lws_write
+    char json[MAX_JSON_LENGTH];
+    int len = serialize_message_into(msg, json, sizeof(json)); // Convierte el mensaje a JSON en la pila
+    if (len < 0) return -1; // -1 si falla la serializacion
+    return enqueue_frame(wsi, json, (size_t)len, classify_message(msg));
+}
+
+// Encola un JSON en el enlace saliente hacia node, retorna -1 si el enlace esta caido o 0 si esta lleno
+static inline int node_send(int node, const char *json, size_t len, OutboundClass cls) {
+    int ret = -1;
+    pthread_mutex_lock(&directory_mutex);
+    if (fed_nodes[node].out_wsi)
+        ret = enqueue_frame(fed_nodes[node].out_wsi, json, len, cls);
+    pthread_mutex_unlock(&directory_mutex);
+    return ret;
+}
+
+// Reenvia un mensaje una sola vez a cada nodo vecino con enlace activo
+static inline void federation_forward(const ProtocolMessage *msg) {
+    if (!federation_enabled()) return;
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(msg, json, sizeof(json)); // Se serializa una vez para todos los nodos
+    if (n < 0) return;
+    OutboundClass cls = classify_message(msg);
+    for (int i = 0; i < fed_node_count; i++)
+        node_send(i, json, (size_t)n, cls);
+}
+
+// Avisa a los nodos vecinos que username se conecto o se desconecto de este nodo
+static inline void federation_announce(const char *type, const char *username) {
+    if (!federation_enabled()) return;
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.type, type, MAX_FIELD_LENGTH);
+    strncpy(msg.sender, node_name, MAX_FIELD_LENGTH);
+    strncpy(msg.target, username, MAX_FIELD_LENGTH - 1);
+    federation_forward(&msg);
+}
+
+// Escribe las tramas pendientes mientras el socket lo permita, se llama en LWS_CALLBACK_SERVER_WRITEABLE
+// Retorna -1 si la conexion debe cerrarse
+static inline int flush_outbound(struct lws *wsi, SessionData *pss) {
+    while (1) {
+        pthread_mutex_lock(&pss->lock);
+        if (pss->evict) {
+            pthread_mutex_unlock(&pss->lock);
+            arm_eviction(wsi, pss);
+            return 0;
+        }
+        OutboundFrame *f = outbound_pop_locked(pss); // Turnos ponderados entre los carriles
+        int reliable = pss->reliable;
+        uint64_t seq = 0, ack = 0;
+        if (f) {
+            if (reliable) {
+                // El seq se asigna en orden de escritura y el ack pendiente viaja en esta trama
+                seq = ++pss->next_seq;
+                ack = dedup_cumulative_ack(&pss->dedup);
+                pss->ack_pending = 0;
+            }
+        }
+        int resume = !f && pss->offline_pending;
+        if (resume) pss->offline_pending = 0;
+        pthread_mutex_unlock(&pss->lock);
+        if (!f) {
+            // Con la cola vacia sigue la entrega del buzon que se corto por la politica
+            if (resume) resume_offline_messages(wsi, pss);
+            return 0; // No queda nada por escribir
+        }
+
+        size_t len = f->len;
+        if (reliable)
+            len = append_delivery_trailer((char *)&f->data[LWS_PRE], len, seq, ack);
+        int n = lws_write(wsi, &f->data[LWS_PRE], len, LWS_WRITE_TEXT);
+        buffer_free(f, f->pool_class);
+        if (n < (int)len) return -1; // Error de escritura se cierra la conexion
+
+        // Si el socket ya no acepta mas datos se espera al siguiente aviso de escritura
+        if (lws_send_pipe_choked(wsi)) break;
+    }
+    pthread_mutex_lock(&pss->lock);
+    int more = outbound_pending_locked(pss);
+    pthread_mutex_unlock(&pss->lock);
+    if (more) lws_callback_on_writable(wsi);
+    return 0;
+}
+
+// Revisa las colas de los clientes registrados tras un lws_cancel_service, desde el hilo de servicio
+static inline void service_pending_outbound(void) {
+    pthread_mutex_lock(&client_list_mutex);
+    for (size_t i = 0; i < client_count; i++) {
+        struct lws *wsi = client_hot[i].wsi;
+        SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+        if (pss) {
+            pthread_mutex_lock(&pss->lock);
+            int evict = pss->evict;
+            int pending = outbound_pending_locked(pss);
+            pthread_mutex_unlock(&pss->lock);
+            if (evict)
+                arm_eviction(wsi, pss);
+            else if (pending)
+                lws_callback_on_writable(wsi);
+        }
+    }
+    pthread_mutex_unlock(&client_list_mutex);
 }
 
 // Difunde un mensaje a todos los clientes conectados
 static inline void broadcast_message(const ProtocolMessage *msg) {
     pthread_mutex_lock(&client_list_mutex); // Bloquea el mutex
-    Client *curr = client_list;
-    while (curr != NULL) {
-        send_message(curr->wsi, msg); // Manda el mensaje al cliente actual
-        curr = curr->next; // Avanza al siguiente cliente
-    }
+    for (size_t i = 0; i < client_count; i++)
+        send_message(client_hot[i].wsi, msg); // Manda el mensaje al cliente actual
     pthread_mutex_unlock(&client_list_mutex); // libera el Mutex
 }
 
-// Manda un mensaje privado a un cliente especifico identificado por dest_username.
-static inline int send_private_message(const ProtocolMessage *msg, const char *dest_username) {
+// Entrega la respuesta del hilo de busqueda al usuario que hizo la consulta, si sigue conectado
+static inline void deliver_search_results(const char *username, void *reply_to, uint32_t reply_id,
+                                          const char *json, size_t len) {
+    pthread_mutex_lock(&client_list_mutex);
+    // Se busca por el nombre para no tocar reply_to si la conexion ya se cerro; solo se entrega si sigue siendo la
+    // misma conexion que consulto, no otra del mismo usuario
+    Client *client = (Client *)roster_find(username);
+    struct lws *wsi = client ? client_wsi(client) : NULL;
+    SessionData *pss = wsi == reply_to && wsi ? (SessionData *)lws_wsi_user(wsi) : NULL;
+    if (pss && pss->conn_id == reply_id) enqueue_frame(wsi, json, len, OUT_CONTROL);
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+// Manda un ack independiente a los clientes cuyo ack lleva mas de ACK_DELAY_SECONDS sin viajar en otra trama
+static inline void send_pending_acks(time_t now) {
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.type, MSG_TYPE_ACK, MAX_FIELD_LENGTH);
+    strncpy(msg.sender, "server", MAX_FIELD_LENGTH);
+    get_current_timestamp(msg.timestamp, MAX_FIELD_LENGTH);
+    pthread_mutex_lock(&client_list_mutex);
+    for (size_t i = 0; i < client_count; i++) {
+        struct lws *wsi = client_hot[i].wsi;
+        SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+        if (!pss) continue;
+        pthread_mutex_lock(&pss->lock);
+        int due = pss->ack_pending && !outbound_pending_locked(pss) &&
+                  difftime(now, pss->ack_pending_since) >= ACK_DELAY_SECONDS;
+        pthread_mutex_unlock(&pss->lock);
+        // La trama ack no lleva contenido, el ack acumulativo se agrega al escribirla
+        if (due) send_message(wsi, &msg);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+// Publica una actualizacion de presencia de username solo a quienes la deben recibir
+// Los clientes en modo PRESENCE_ALL la reciben siempre, los de modo PRESENCE_LIST solo si observan a username
+// Si un cliente todavia no recibio la presencia anterior de username, esta la reemplaza en su cola
+static inline void publish_presence(const char *username, const ProtocolMessage *msg) {
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(msg, json, sizeof(json)); // Se serializa una sola vez para todos los destinatarios
+    if (n < 0) return;
+    size_t len = (size_t)n;
+    pthread_mutex_lock(&client_list_mutex);
+    if (presence_all_count > 0) {
+        for (size_t i = 0; i < client_count; i++) {
+            if (client_hot[i].client->presence_mode == PRESENCE_ALL)
+                enqueue_keyed_frame(client_hot[i].wsi, json, len, OUT_PRESENCE, username);
+        }
+    }
+    // Observadores encontrados en el indice inverso
+    for (PresenceSub *sub = presence_watchers(username); sub != NULL; sub = sub->next_watcher) {
+        Client *watcher = sub->watcher;
+        if (watcher->presence_mode == PRESENCE_LIST)
+            enqueue_keyed_frame(client_wsi(watcher), json, len, OUT_PRESENCE, username);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+// Cambia las suscripciones de presencia del cliente conectado en wsi
+// content es un arreglo JSON de usuarios o "*" para todos; subscribe es 1 para suscribir y 0 para cancelar
+static inline int change_presence_subscriptions(struct lws *wsi, const char *content, int subscribe) {
+    int ret = -1;
+    pthread_mutex_lock(&client_list_mutex);
+    ClientHot *hot = client_hot_by_wsi(wsi);
+    Client *cli = hot ? hot->client : NULL;
+    if (cli != NULL) {
+        ret = 0;
+        PresenceMode mode = cli->presence_mode;
+        if (strcmp(content, "*") == 0) {
+            // "*" vuelve al modo de todos o deja de recibir presencias por completo
+            presence_clear(&cli->subscriptions);
+            mode = subscribe ? PRESENCE_ALL : PRESENCE_NONE;
+        } else {
+            char name[MAX_FIELD_LENGTH];
+            const char *cursor = content;
+            while (json_array_next_string(&cursor, name, sizeof(name))) {
+                if (subscribe) {
+                    if (presence_subscribe(cli, &cli->subscriptions, name) != 0) ret = -1;
+                } else {
+                    presence_unsubscribe(&cli->subscriptions, name);
+                }
+            }
+            // Al suscribirse a usuarios concretos se deja de recibir la presencia global
+            if (subscribe) mode = PRESENCE_LIST;
+        }
+        if (cli->presence_mode == PRESENCE_ALL && mode != PRESENCE_ALL) presence_all_count--;
+        if (cli->presence_mode != PRESENCE_ALL && mode == PRESENCE_ALL) presence_all_count++;
+        cli->presence_mode = mode;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    return ret;
+}
+
+// Entrega un mensaje privado a dest_username si esta conectado en este nodo
+// Si no esta conectado el mensaje se guarda en su buzon para entregarlo al registrarse
+static inline int deliver_local_private(const ProtocolMessage *msg, const char *dest_username) {
     int ret = -1; // Inicializa el resultado en -1 no encontrado
+    int found = 0;
     pthread_mutex_lock(&client_list_mutex); // bloquea el mutex
-    Client *curr = client_list;
-    while (curr != NULL) {
-        // Si encuentra el cliente con el username especificado
-        if (strcmp(curr->username, dest_username) == 0) { 
-            // manda el mensaje y guarda el resultado
-            ret = send_message(curr->wsi, msg);
-            break;
-        }
-        curr = curr->next; // Avanza al siguiente cliente
+    Client *curr = (Client *)roster_find(dest_username);
+    if (curr != NULL) {
+        // manda el mensaje y guarda el resultado
+        ret = send_message(client_wsi(curr), msg);
+        found = 1;
     }
     // Libera el mutex
     pthread_mutex_unlock(&client_list_mutex);
-    // Retorna el resultado de mandar el mensaje o -1 si no se encontro el cliente
+    // Destinatario desconectado: se guarda en su buzon, -1 si el buzon esta lleno
+    if (!found)
+        ret = mailbox_store(dest_username, msg->sender, msg->timestamp, msg->content);
+    // Retorna el resultado de mandar o guardar el mensaje
     return ret;
 }
 
+// Manda un mensaje privado a un cliente especifico identificado por dest_username.
+// Si el destinatario esta en otro nodo se reenvia por su enlace; si no esta conectado se guarda en su buzon
+static inline int send_private_message(const ProtocolMessage *msg, const char *dest_username) {
+    int node = find_client(dest_username) ? -1 : directory_owner(dest_username);
+    if (node >= 0) {
+        char json[MAX_JSON_LENGTH];
+        int n = serialize_message_into(msg, json, sizeof(json));
+        if (n >= 0 && node_send(node, json, (size_t)n, OUT_PRIVATE) > 0)
+            return 0;
+        // Enlace caido o lleno: se guarda aqui como si el destinatario estuviera desconectado
+    }
+    return deliver_local_private(msg, dest_username);
+}
+
+// Estado de cada destinatario de un privado con lista de usuarios
+enum { MULTICAST_PENDING, MULTICAST_DELIVERED, MULTICAST_FAILED, MULTICAST_REMOTE };
+
+static int multicast_compare(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Manda a node el privado fwd, cuyo target ya tiene el arreglo de destinatarios idx[0..batch)
+// Si el enlace esta caido o lleno esos destinatarios quedan pendientes y se tratan como desconectados
+static inline void multicast_node_flush(const ProtocolMessage *fwd, int node, unsigned char *state,
+                                        const int *idx, int batch) {
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(fwd, json, sizeof(json));
+    int ok = n >= 0 && node_send(node, json, (size_t)n, OUT_PRIVATE) > 0;
+    for (int b = 0; b < batch; b++)
+        state[idx[b]] = ok ? MULTICAST_DELIVERED : MULTICAST_PENDING;
+}
+
+// Manda un privado cuyo target es un arreglo JSON de usuarios
+// Los destinatarios locales se resuelven con el indice de nombres y reciben la misma trama,
+// serializada una vez y sin target. Los de otros nodos van en una trama por nodo (forward en 0 si el privado
+// ya llego de otro nodo) y los desconectados a su buzon.
+// Los nombres que no se pudieron entregar se escriben en failed como arreglo JSON si failed no es NULL
+// Retorna la cantidad de destinatarios entregados o -1 si la lista no es valida
+static inline int send_private_multicast(const ProtocolMessage *msg, const char *targets, int forward,
+                                         char *failed, size_t failed_size) {
+    // Nombres de la lista, ordenados para quitar los repetidos
+    char names_buf[MAX_JSON_LENGTH];
+    const char *names[MULTICAST_MAX_TARGETS];
+    unsigned char state[MULTICAST_MAX_TARGETS];
+    int owner[MULTICAST_MAX_TARGETS];
+    int count = 0;
+    size_t used = 0;
+    const char *cursor = targets;
+    while (used < sizeof(names_buf) &&
+           json_array_next_string(&cursor, names_buf + used, sizeof(names_buf) - used)) {
+        if (names_buf[used] == '\0') continue;
+        if (count == MULTICAST_MAX_TARGETS) return -1;
+        names[count++] = names_buf + used;
+        used += strlen(names_buf + used) + 1;
+    }
+    if (count == 0) return -1;
+    qsort(names, count, sizeof(names[0]), multicast_compare);
+    int unique = 1;
+    for (int i = 1; i < count; i++)
+        if (strcmp(names[i], names[unique - 1]) != 0) names[unique++] = names[i];
+    count = unique;
+    memset(state, MULTICAST_PENDING, sizeof(state));
+
+    // La trama que reciben los destinatarios locales, una sola serializacion para todos
+    ProtocolMessage shared = *msg;
+    shared.target[0] = '\0';
+    shared.targetIsList = 0;
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(&shared, json, sizeof(json));
+    if (n < 0) return -1;
+
+    // Cada destinatario se busca en el indice de nombres: k busquedas en lugar de recorrer todos los clientes
+    pthread_mutex_lock(&client_list_mutex);
+    for (int i = 0; i < count; i++) {
+        Client *curr = (Client *)roster_find(names[i]);
+        if (!curr) continue;
+        state[i] = enqueue_frame(client_wsi(curr), json, (size_t)n, OUT_PRIVATE) > 0 ? MULTICAST_DELIVERED : MULTICAST_FAILED;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+
+    // Destinatarios conectados en otros nodos: se agrupan en tramas por nodo que quepan en target
+    if (forward && federation_enabled()) {
+        for (int i = 0; i < count; i++) {
+            if (state[i] != MULTICAST_PENDING) continue;
+            owner[i] = directory_owner(names[i]);
+            if (owner[i] >= 0) state[i] = MULTICAST_REMOTE;
+        }
+        ProtocolMessage fwd = shared;
+        fwd.targetIsList = 1;
+        int idx[MULTICAST_MAX_TARGETS];
+        for (int node = 0; node < fed_node_count; node++) {
+            int batch = 0;
+            size_t off = 0;
+            for (int i = 0; i < count; i++) {
+                if (state[i] != MULTICAST_REMOTE || owner[i] != node) continue;
+                // Se deja un byte para cerrar el arreglo
+                size_t mark = off;
+                if (json_put_raw(fwd.target, MAX_FIELD_LENGTH - 1, &off, batch ? "," : "[") < 0 ||
+                    json_put_string(fwd.target, MAX_FIELD_LENGTH - 1, &off, names[i]) < 0) {
+                    off = mark;
+                    if (batch == 0) continue; // El nombre solo no cabe en target, va a su buzon
+                    // target lleno: se manda lo acumulado y se reintenta este nombre en una trama nueva
+                    fwd.target[off++] = ']';
+                    fwd.target[off] = '\0';
+                    multicast_node_flush(&fwd, node, state, idx, batch);
+                    batch = 0;
+                    off = 0;
+                    i--;
+                    continue;
+                }
+                idx[batch++] = i;
+            }
+            if (batch > 0) {
+                fwd.target[off++] = ']';
+                fwd.target[off] = '\0';
+                multicast_node_flush(&fwd, node, state, idx, batch);
+            }
+        }
+    }
+
+    // Destinatarios desconectados: el mensaje se guarda en su buzon
+    int delivered = 0;
+    for (int i = 0; i < count; i++) {
+        if (state[i] == MULTICAST_PENDING || state[i] == MULTICAST_REMOTE)
+            state[i] = mailbox_store(names[i], msg->sender, msg->timestamp, msg->content) == 0
+                       ? MULTICAST_DELIVERED : MULTICAST_FAILED;
+        if (state[i] == MULTICAST_DELIVERED) delivered++;
+    }
+
+    if (failed) {
+        // Los que fallaron, hasta donde quepan en failed
+        size_t off = 0;
+        failed[0] = '\0';
+        json_put_raw(failed, failed_size - 1, &off, "[");
+        int first = 1;
+        for (int i = 0; i < count; i++) {
+            if (state[i] != MULTICAST_FAILED) continue;
+            size_t mark = off;
+            if ((!first && json_put_raw(failed, failed_size - 1, &off, ",") < 0) ||
+                json_put_string(failed, failed_size - 1, &off, names[i]) < 0) {
+                off = mark;
+                break;
+            }
+            first = 0;
+        }
+        failed[off++] = ']';
+        failed[off] = '\0';
+    }
+    return delivered;
+}
+
+// Entrega los mensajes privados guardados mientras el usuario estaba desconectado
+// Van en tramas de hasta MAILBOX_CHUNK_BYTES y en cada llamada se encola a lo sumo el umbral de presencias de la
+// politica, asi el buzon nunca desaloja al cliente; lo demas vuelve al buzon y sigue cuando se vacia la cola
+static inline void deliver_offline_messages(struct lws *wsi, const char *username) {
+    size_t len = 0;
+    char *records = mailbox_take(username, &len);
+    if (!records) return; // No habia mensajes pendientes
+    size_t budget = slow_policy.high_water * slow_policy.presence_pct / 100;
+    size_t limit = budget < MAILBOX_CHUNK_BYTES ? budget : MAILBOX_CHUNK_BYTES;
+    char *frame = (char *)heap_malloc(limit + MAILBOX_RECORD_MAX_JSON + MAX_FIELD_LENGTH);
+    size_t pos = 0, queued = 0;
+    while (frame && pos < len) {
+        size_t next = pos;
+        size_t n = mailbox_format_chunk(records, len, &next, frame, limit);
+        if (n == 0) { // Solo quedaban registros truncados
+            pos = len;
+            break;
+        }
+        if (queued > 0 && queued + n > budget) {
+            // El resto se entrega cuando el cliente haya leido lo encolado
+            SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+            if (pss) {
+                pthread_mutex_lock(&pss->lock);
+                pss->offline_pending = 1;
+                pthread_mutex_unlock(&pss->lock);
+            }
+            break;
+        }
+        if (enqueue_frame(wsi, frame, n, OUT_CONTROL) <= 0) break;
+        queued += n;
+        pos = next;
+    }
+    // Lo que no se encolo vuelve al buzon, se entrega en el proximo registro o al vaciarse la cola
+    if (pos < len && mailbox_put_back(username, records + pos, len - pos) != 0)
+        lwsl_err("Se perdieron mensajes del buzon de %s.\n", username);
+    free(frame);
+    free(records);
+}
+
+// Sigue la entrega del buzon del usuario registrado en wsi, se llama desde el hilo de servicio
+static inline void resume_offline_messages(struct lws *wsi, SessionData *pss) {
+    char username[MAX_FIELD_LENGTH] = "";
+    pthread_mutex_lock(&client_list_mutex);
+    if (pss->client_slot != 0 && pss->client_slot <= client_count &&
+        client_hot[pss->client_slot - 1].wsi == wsi)
+        strncpy(username, client_hot[pss->client_slot - 1].client->username, MAX_FIELD_LENGTH - 1);
+    pthread_mutex_unlock(&client_list_mutex);
+    if (username[0]) deliver_offline_messages(wsi, username);
+}
+
 // Manda un mensaje de registro exitoso al cliente que se acaba de registrar se construye un arreglo JSON con el listado de usuarios conectados
 static inline void send_register_success(struct lws *wsi, const char *message) {
     ProtocolMessage msg;
@@ -148,16 +919,18 @@ static inline void send_register_success(struct lws *wsi, const char *message) {
     
     pthread_mutex_lock(&client_list_mutex); // Bloquea con el mutex
     char users_json[MAX_MESSAGE_LENGTH] = "["; // Inicia el arreglo JSON para la lista de usuarios
-    Client *curr = client_list; // Comienza a recorrer la lista de clientes
-    while (curr != NULL) {
-        strcat(users_json, "\""); // Agrega comillas al inicio
-        strcat(users_json, curr->username); // Agrega el nombre del usuario
-        strcat(users_json, "\""); // Agrega comillas al final
-        if (curr->next != NULL)
-            strcat(users_json, ","); // Separa con coma al siguiente usuario
-        curr = curr->next; // Pasa al siguiente usuario
-    }
-    strcat(users_json, "]"); // Cierra el arreglo JSON
+    size_t off = 1;
+    for (size_t i = 0; i < client_count; i++) { // Recorre los clientes conectados
+        // Se deja lugar para el cierre; si no caben todos los nombres la lista se corta
+        size_t mark = off;
+        if ((i > 0 && json_put_raw(users_json, sizeof(users_json) - 1, &off, ",") < 0) ||
+            json_put_string(users_json, sizeof(users_json) - 1, &off, client_hot[i].client->username) < 0) {
+            off = mark;
+            break;
+        }
+    }
+    users_json[off++] = ']'; // Cierra el arreglo JSON
+    users_json[off] = '\0';
     pthread_mutex_unlock(&client_list_mutex); // Libera el mutex
     
     strncpy(msg.userList, users_json, MAX_MESSAGE_LENGTH); // // Copia la lista de usuarios al mensaje
@@ -166,33 +939,94 @@ static inline void send_register_success(struct lws *wsi, const char *message) {
 }
 
 
-// Manda al cliente solicitante el listado de usuarios conectados
-static inline void send_list_users(struct lws *wsi) {
-    ProtocolMessage msg;
-    memset(&msg, 0, sizeof(msg));
-    strncpy(msg.type, MSG_TYPE_LIST_USERS_RESPONSE, MAX_FIELD_LENGTH); // Define el tipo como list_users_response
-    strncpy(msg.sender, "server", MAX_FIELD_LENGTH); // Remitente es server
-    get_current_timestamp(msg.timestamp, MAX_FIELD_LENGTH); // Establece la hora actual
-    
+// Manda al cliente solicitante el listado de usuarios conectados, ordenado por nombre
+// filter es el content de la peticion: vacio para el listado simple, o un objeto con los campos opcionales
+// prefix, status, limit y cursor. Con filtro la respuesta es {"users": [...], "next": ...}; next es el cursor
+// para pedir la pagina siguiente o null si no hay mas usuarios
+static inline void send_list_users(struct lws *wsi, const char *filter) {
+    char prefix[MAX_FIELD_LENGTH] = "";
+    char status[MAX_FIELD_LENGTH] = "";
+    char cursor[MAX_FIELD_LENGTH] = "";
+    char number[32];
+    int paged = filter[0] == '{';
+    size_t limit = ROSTER_MAX_LIMIT; // Sin filtro se mandan los que quepan en la trama
+    if (paged) {
+        extract_json_value(filter, "prefix", prefix, sizeof(prefix));
+        extract_json_value(filter, "status", status, sizeof(status));
+        extract_json_value(filter, "cursor", cursor, sizeof(cursor));
+        limit = ROSTER_DEFAULT_LIMIT;
+        if (extract_json_value(filter, "limit", number, sizeof(number)) == 0 && atol(number) > 0)
+            limit = (size_t)atol(number) < ROSTER_MAX_LIMIT ? (size_t)atol(number) : ROSTER_MAX_LIMIT;
+    }
+
+    // La trama se arma directamente, el listado puede superar el tamaño de content
+    char json[MAX_JSON_LENGTH];
+    size_t off = 0;
+    size_t room = sizeof(json) - 64; // Lugar para cerrar el arreglo y agregar el timestamp
+    json_put_raw(json, sizeof(json), &off, "{\"type\": \"" MSG_TYPE_LIST_USERS_RESPONSE "\", \"sender\": \"server\", \"content\": ");
+    json_put_raw(json, sizeof(json), &off, paged ? "{\"users\": [" : "[");
+
+    char next[MAX_FIELD_LENGTH] = "";
+    size_t count = 0;
     pthread_mutex_lock(&client_list_mutex); // bloquea el mutex
-    // Mismo proceso que en la funcion send_register_success
-    char users_json[MAX_MESSAGE_LENGTH] = "[";
-    Client *curr = client_list;
-    while (curr != NULL) {
-        strcat(users_json, "\"");
-        strcat(users_json, curr->username);
-        strcat(users_json, "\"");
-        if (curr->next != NULL)
-            strcat(users_json, ",");
-        curr = curr->next;
-    }
-    strcat(users_json, "]"); // Cierra el arreglo JSON
+    // Cada estado tiene su propio indice; un estado desconocido no tiene usuarios
+    int s = status[0] ? client_status_parse(status) : -1;
+    const RosterIndex *ix = &roster[s >= 0 ? roster_status_index(s) : ROSTER_ALL];
+    int none = status[0] && s < 0;
+    // La pagina empieza en el prefijo o despues del cursor, lo que este mas adelante
+    size_t pos = roster_lower_bound(ix, strcmp(cursor, prefix) > 0 ? cursor : prefix);
+    if (cursor[0] && pos < ix->count && strcmp(ix->items[pos].name, cursor) == 0) pos++;
+    size_t prefix_len = strlen(prefix);
+    const char *last = NULL;
+    int more = 0;
+    for (; !none && pos < ix->count; pos++) {
+        const RosterEntry *e = &ix->items[pos];
+        if (strncmp(e->name, prefix, prefix_len) != 0) break; // Se termino el rango del prefijo
+        if (count == limit) {
+            more = 1;
+            break;
+        }
+        size_t mark = off;
+        // Con filtro tambien debe caber el nombre repetido como cursor de la pagina siguiente
+        if ((count > 0 && json_put_raw(json, room, &off, ",") < 0) ||
+            json_put_string(json, room, &off, e->name) < 0 ||
+            (paged && off + (off - mark) + 16 >= room)) {
+            off = mark;
+            json[off] = '\0';
+            more = 1;
+            break;
+        }
+        count++;
+        last = e->name;
+    }
+    if (more && last) strncpy(next, last, MAX_FIELD_LENGTH - 1);
     pthread_mutex_unlock(&client_list_mutex); // libera el mutex
-    
-    strncpy(msg.content, users_json, MAX_MESSAGE_LENGTH); // Asigna la lista de usuarios al contenido
-    send_message(wsi, &msg); // Manda el mensaje al cliente
+
+    json_put_raw(json, sizeof(json), &off, "]");
+    if (paged) {
+        json_put_raw(json, sizeof(json), &off, ", \"next\": ");
+        if (next[0]) json_put_string(json, sizeof(json), &off, next);
+        else json_put_raw(json, sizeof(json), &off, "null");
+        json_put_raw(json, sizeof(json), &off, "}");
+    }
+    char timestamp[MAX_FIELD_LENGTH];
+    get_current_timestamp(timestamp, sizeof(timestamp)); // Establece la hora actual
+    json_put_raw(json, sizeof(json), &off, ", \"timestamp\": ");
+    json_put_string(json, sizeof(json), &off, timestamp);
+    json_put_raw(json, sizeof(json), &off, "}");
+    enqueue_frame(wsi, json, off, OUT_CONTROL); // Manda el mensaje al cliente
 }
 
+// Escribe en content la info de un cliente como objeto JSON, se llama con client_list_mutex tomado
+static inline int put_user_info(char *content, size_t size, size_t *off, const Client *client) {
+    char ip[INET6_ADDRSTRLEN];
+    client_addr_format(&client->ip, ip, sizeof(ip));
+    return json_put_raw(content, size, off, "{\"ip\": ") < 0 ||
+           json_put_string(content, size, off, ip) < 0 ||
+           json_put_raw(content, size, off, ", \"status\": ") < 0 ||
+           json_put_string(content, size, off, client_status_names[client_hot[client->slot].status]) < 0 ||
+           json_put_raw(content, size, off, "}") < 0 ? -1 : 0;
+}
 
 // Manada al solicitante la información IP y status de un usuario especifico
 static inline void send_user_info(struct lws *wsi, const char *target_username) {
@@ -200,44 +1034,105 @@ static inline void send_user_info(struct lws *wsi, const char *target_username)
     memset(&msg, 0, sizeof(msg));
     strncpy(msg.type, MSG_TYPE_USER_INFO_RESPONSE, MAX_FIELD_LENGTH); // Define el tipo como user_info_response
     strncpy(msg.sender, "server", MAX_FIELD_LENGTH); // Remitente es server
-    strncpy(msg.target, target_username, MAX_FIELD_LENGTH); // Establece el usuario objetivo
+    strncpy(msg.target, target_username, MAX_FIELD_LENGTH - 1); // Establece el usuario objetivo
     get_current_timestamp(msg.timestamp, MAX_FIELD_LENGTH); // Guarda la hora actual
     
-    Client *client = find_client(target_username);  // Busca el cliente con el username indicado
-    if (client) {
-        char info_json[MAX_MESSAGE_LENGTH];
-        snprintf(info_json, MAX_MESSAGE_LENGTH, "{\"ip\": \"%s\", \"status\": \"%s\"}", client->ip, client->status); // Formatea la info en JSON
-        strncpy(msg.content, info_json, MAX_MESSAGE_LENGTH); // Asigna la info al contenido
-    } else {
+    // El cliente se lee con el mutex tomado, asi no se libera mientras se copia su info
+    pthread_mutex_lock(&client_list_mutex);
+    Client *client = (Client *)roster_find(target_username);  // Busca el cliente con el username indicado
+    size_t off = 0;
+    if (!client || put_user_info(msg.content, MAX_MESSAGE_LENGTH, &off, client) < 0)
         strncpy(msg.content, "null", MAX_MESSAGE_LENGTH);
-    }
+    else
+        msg.contentIsJson = 1;
+    pthread_mutex_unlock(&client_list_mutex);
     send_message(wsi, &msg); // Manda el mensaje al solicitante
 }
 
-// Actualiza el status de un cliente y difunde la actualizacion
-static inline void update_client_status(const char *username, const char *new_status) {
+// Manda en una sola respuesta la info de varios usuarios; targets es un arreglo JSON de nombres
+// content es un objeto que asocia cada nombre con su info, o con null si no esta conectado en este nodo.
+// Si no caben todos se responden los primeros y target lista solo a los que se respondieron
+static inline void send_user_info_batch(struct lws *wsi, const char *targets) {
+    char json[MAX_JSON_LENGTH];
+    char names[MAX_JSON_LENGTH];
+    size_t off = 0, names_off = 0;
+    size_t room = sizeof(json) - 64; // Lugar para el timestamp
+    json_put_raw(json, sizeof(json), &off, "{\"type\": \"" MSG_TYPE_USER_INFO_RESPONSE "\", \"sender\": \"server\", \"content\": {");
+    json_put_raw(names, sizeof(names), &names_off, "[");
+
+    char name[MAX_FIELD_LENGTH];
+    const char *cursor = targets;
+    int count = 0;
     pthread_mutex_lock(&client_list_mutex);
-    // Buscar el cliente en la lista por nombre y actualizar su status
-    Client *curr = client_list;
-    while (curr != NULL) {
-        if (strcmp(curr->username, username) == 0) {
-            strncpy(curr->status, new_status, MAX_FIELD_LENGTH); // actualiza su estado
+    while (json_array_next_string(&cursor, name, sizeof(name))) {
+        const Client *client = (const Client *)roster_find(name);
+        size_t mark = off, names_mark = names_off;
+        if ((count > 0 && json_put_raw(json, room, &off, ", ") < 0) ||
+            json_put_string(json, room, &off, name) < 0 ||
+            json_put_raw(json, room, &off, ": ") < 0 ||
+            (client ? put_user_info(json, room, &off, client) : json_put_raw(json, room, &off, "null")) < 0 ||
+            (count > 0 && json_put_raw(names, sizeof(names) - 1, &names_off, ",") < 0) ||
+            json_put_string(names, sizeof(names) - 1, &names_off, name) < 0) {
+            off = mark;
+            names_off = names_mark;
             break;
         }
-        curr = curr->next; // Avanza al siguiente cliente
+        count++;
     }
-    pthread_mutex_unlock(&client_list_mutex); // libera el mutex
+    pthread_mutex_unlock(&client_list_mutex);
+    json[off] = '\0';
+    names[names_off++] = ']';
+    names[names_off] = '\0';
 
-    // Difundir la actualización del status a todos los clientes
+    // El timestamp y la lista de respondidos se agregan al final; si la lista no cabe se omite
+    char timestamp[MAX_FIELD_LENGTH];
+    get_current_timestamp(timestamp, sizeof(timestamp));
+    json_put_raw(json, sizeof(json), &off, "}");
+    size_t mark = off;
+    if (json_put_raw(json, room, &off, ", \"target\": ") < 0 || json_put_raw(json, room, &off, names) < 0)
+        off = mark;
+    json_put_raw(json, sizeof(json), &off, ", \"timestamp\": ");
+    json_put_string(json, sizeof(json), &off, timestamp);
+    json_put_raw(json, sizeof(json), &off, "}");
+    enqueue_frame(wsi, json, off, OUT_CONTROL);
+}
+
+// Cambia el estado de un cliente y lo mueve al indice de su nuevo estado, se llama con client_list_mutex tomado
+static inline void client_set_status(ClientHot *hot, ClientStatus new_status) {
+    roster_set_status(hot->client->username, hot->client, hot->status, new_status);
+    hot->status = (uint8_t)new_status;
+}
+
+// Manda el nuevo status de username a sus observadores y a los demas nodos
+static inline void publish_status(const char *username, ClientStatus new_status) {
     ProtocolMessage msg;
     memset(&msg, 0, sizeof(msg));
     strncpy(msg.type, MSG_TYPE_STATUS_UPDATE, MAX_FIELD_LENGTH); // Define el tipo como status_update
     strncpy(msg.sender, "server", MAX_FIELD_LENGTH); // El remitente es server
-    char status_json[MAX_MESSAGE_LENGTH];
-    snprintf(status_json, MAX_MESSAGE_LENGTH, "{\"user\": \"%s\", \"status\": \"%s\"}", username, new_status);  // Formatea la actualización en JSON
-    strncpy(msg.content, status_json, MAX_MESSAGE_LENGTH); // Asigna la actualizacion al contenido
+    // Formatea la actualización en JSON, escapando el nombre
+    size_t off = 0;
+    if (json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, "{\"user\": ") < 0 ||
+        json_put_string(msg.content, MAX_MESSAGE_LENGTH, &off, username) < 0 ||
+        json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, ", \"status\": ") < 0 ||
+        json_put_string(msg.content, MAX_MESSAGE_LENGTH, &off, client_status_names[new_status]) < 0 ||
+        json_put_raw(msg.content, MAX_MESSAGE_LENGTH, &off, "}") < 0)
+        return;
+    msg.contentIsJson = 1;
     get_current_timestamp(msg.timestamp, MAX_FIELD_LENGTH);
-    broadcast_message(&msg); // Difunde la actualizacion a todos los clientes
+    publish_presence(username, &msg); // Manda la actualizacion a los observadores del usuario
+    // Los demas nodos la publican a sus propios observadores; target indica de quien es la presencia
+    strncpy(msg.target, username, MAX_FIELD_LENGTH - 1);
+    federation_forward(&msg);
+}
+
+// Actualiza el status de un cliente y la manda a sus observadores
+static inline void update_client_status(const char *username, ClientStatus new_status) {
+    pthread_mutex_lock(&client_list_mutex);
+    // Buscar el cliente por nombre en el indice y actualizar su estado
+    Client *curr = (Client *)roster_find(username);
+    if (curr != NULL) client_set_status(&client_hot[curr->slot], new_status);
+    pthread_mutex_unlock(&client_list_mutex); // libera el mutex
+    publish_status(username, new_status);
 }
 
 // wsi: Puntero a la conexión WebSocket del cliente.
@@ -257,23 +1152,56 @@ static inline void handle_incoming_message(struct lws *wsi, const char *json_str
         return;
     }
     
-    if (strcmp(msg.type, MSG_TYPE_REGISTER) == 0) {
+    // Entrega confiable: los ids repetidos o fuera de ventana no se vuelven a procesar
+    if (msg.id != 0) {
+        SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+        pthread_mutex_lock(&pss->lock);
+        pss->reliable = 1;
+        DedupResult result = dedup_accept(&pss->dedup, msg.id);
+        if (result != DEDUP_OUT_OF_WINDOW && !pss->ack_pending) {
+            // El ack se manda en la proxima trama hacia el cliente
+            pss->ack_pending = 1;
+            pss->ack_pending_since = time(NULL);
+        }
+        pthread_mutex_unlock(&pss->lock);
+        if (result != DEDUP_NEW) return;
+    }
+    msg.ack = 0; // El servidor no guarda tramas para reenviar, el ack del cliente se ignora y no se reenvia
+    
+    SessionData *session = (SessionData *)lws_wsi_user(wsi);
+    if (strcmp(msg.type, MSG_TYPE_REGISTER) == 0 && session && session->client_slot != 0) {
+        // La conexion ya tiene un usuario, se rechaza el segundo registro sin tocar el primero
+        ProtocolMessage error_msg;
+        memset(&error_msg, 0, sizeof(error_msg));
+        strncpy(error_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+        strncpy(error_msg.sender, "server", MAX_FIELD_LENGTH);
+        strncpy(error_msg.content, "La conexion ya tiene un usuario registrado.", MAX_MESSAGE_LENGTH);
+        get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
+        send_message(wsi, &error_msg);
+    }
+
+    else if (strcmp(msg.type, MSG_TYPE_REGISTER) == 0) {
         // Registro de usuario sender contiene el nombre del usuario
-        Client *new_client = (Client *)malloc(sizeof(Client));
+        Client *new_client = (Client *)pool_alloc(&client_pool);
         if (!new_client) return;
         memset(new_client, 0, sizeof(Client));
-        strncpy(new_client->username, msg.sender, MAX_FIELD_LENGTH); // Copia el nombre de usuario
+        new_client->username = intern_acquire(msg.sender); // Comparte el nombre de usuario internado
+        if (!new_client->username) {
+            pool_free(&client_pool, new_client);
+            return;
+        }
         
         // Obtener la IP real del cliente esto también es util para entornos remotos
         char client_ip[128] = {0};
         lws_get_peer_simple(wsi, client_ip, sizeof(client_ip)); // Extrae la IP del cliente
-        strncpy(new_client->ip, client_ip, MAX_FIELD_LENGTH); // Copia la IP en la estructura
+        client_addr_parse(&new_client->ip, client_ip); // Guarda la IP en binario
         
-        strncpy(new_client->status, STATUS_ACTIVE, MAX_FIELD_LENGTH); // Establece el estado a ACTIVO
-        new_client->wsi = wsi;
-        if (add_client(new_client) == 0) {
+        // El cliente queda ACTIVO y asociado a wsi al agregarlo
+        if (add_client(new_client, wsi) == 0) {
             // Si el registro es exitoso manda un mensaje de registro exitoso
             send_register_success(wsi, "Registro exitoso");
+            // Entrega los mensajes privados que llegaron mientras estaba desconectado
+            deliver_offline_messages(wsi, msg.sender);
         } else {
             // Si ya existe el usuario o la IP, envía un mensaje de error y cierra la conexion
             ProtocolMessage error_msg;
@@ -283,7 +1211,8 @@ static inline void handle_incoming_message(struct lws *wsi, const char *json_str
             strncpy(error_msg.content, "Nombre de usuario o IP ya existente.", MAX_MESSAGE_LENGTH);
             get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
             send_message(wsi, &error_msg);
-            free(new_client);
+            intern_release(new_client->username);
+            pool_free(&client_pool, new_client);
             // Cerrar la conexion para rechazar la solicitud de registro duplicado
             lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION,
                              (unsigned char *)"Nombre de usuario duplicado", strlen("Nombre de usuario duplicado"));
@@ -294,18 +1223,90 @@ static inline void handle_incoming_message(struct lws *wsi, const char *json_str
     else if (strcmp(msg.type, MSG_TYPE_BROADCAST) == 0) {
         // Mensaje broadcast difunde el mensaje a todos los clientes
         broadcast_message(&msg);
+        federation_forward(&msg); // Una copia por nodo vecino, no una por usuario remoto
+        // El hilo de busqueda lo agrega al indice de mensajes recientes
+        search_submit(0, msg.sender, msg.content, msg.timestamp, NULL, 0);
+    } else if (strcmp(msg.type, MSG_TYPE_SEARCH) == 0) {
+        // Busqueda en los broadcasts recientes, la respuesta llega despues desde el hilo de busqueda
+        // La respuesta vuelve a esta conexion y al usuario registrado en ella, no al sender que diga el mensaje
+        char username[MAX_FIELD_LENGTH] = "";
+        pthread_mutex_lock(&client_list_mutex);
+        ClientHot *hot = client_hot_by_wsi(wsi);
+        if (hot) strncpy(username, hot->client->username, MAX_FIELD_LENGTH - 1);
+        pthread_mutex_unlock(&client_list_mutex);
+        const char *error = NULL;
+        if (!username[0])
+            error = "Debe registrarse antes de buscar.";
+        else if (search_submit(1, username, msg.content, NULL, wsi, session ? session->conn_id : 0) != 0)
+            error = "Busqueda no disponible, intente de nuevo.";
+        if (error) {
+            ProtocolMessage error_msg;
+            memset(&error_msg, 0, sizeof(error_msg));
+            strncpy(error_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+            strncpy(error_msg.sender, "server", MAX_FIELD_LENGTH);
+            strncpy(error_msg.content, error, MAX_MESSAGE_LENGTH);
+            get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
+            send_message(wsi, &error_msg);
+        }
+    } else if (strcmp(msg.type, MSG_TYPE_PRIVATE) == 0 && msg.targetIsList) {
+        // Privado a una lista de usuarios: msg.target puede venir cortado, se relee el arreglo completo
+        char targets[MAX_JSON_LENGTH];
+        char failed[MAX_MESSAGE_LENGTH - 64];
+        ProtocolMessage resp_msg;
+        memset(&resp_msg, 0, sizeof(resp_msg));
+        strncpy(resp_msg.sender, "server", MAX_FIELD_LENGTH);
+        get_current_timestamp(resp_msg.timestamp, MAX_FIELD_LENGTH);
+        int delivered = extract_json_value(json_str, "target", targets, sizeof(targets)) == 0
+                        ? send_private_multicast(&msg, targets, 1, failed, sizeof(failed)) : -1;
+        if (delivered < 0) {
+            strncpy(resp_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+            snprintf(resp_msg.content, MAX_MESSAGE_LENGTH,
+                     "Lista de destinatarios invalida o con mas de %d usuarios.", MULTICAST_MAX_TARGETS);
+        } else {
+            // Una sola respuesta con los destinatarios que no se pudieron entregar
+            strncpy(resp_msg.type, MSG_TYPE_PRIVATE_RESPONSE, MAX_FIELD_LENGTH);
+            snprintf(resp_msg.content, MAX_MESSAGE_LENGTH, "{\"delivered\": %d, \"failed\": %s}", delivered, failed);
+            resp_msg.contentIsJson = 1;
+        }
+        send_message(wsi, &resp_msg);
     } else if (strcmp(msg.type, MSG_TYPE_PRIVATE) == 0) {
-        // manda el mensaje unicamente al usuario destino
-        send_private_message(&msg, msg.target);
+        // manda el mensaje unicamente al usuario destino o lo guarda en su buzon
+        if (send_private_message(&msg, msg.target) < 0) {
+            ProtocolMessage error_msg;
+            memset(&error_msg, 0, sizeof(error_msg));
+            strncpy(error_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+            strncpy(error_msg.sender, "server", MAX_FIELD_LENGTH);
+            snprintf(error_msg.content, MAX_MESSAGE_LENGTH, "No se pudo entregar el mensaje a %s.", msg.target);
+            get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
+            send_message(wsi, &error_msg);
+        }
     } else if (strcmp(msg.type, MSG_TYPE_LIST_USERS) == 0) {
         // Solicitud de listado de usuarios manda la lista al cliente solicitante
-        send_list_users(wsi);
+        send_list_users(wsi, msg.content);
     } else if (strcmp(msg.type, MSG_TYPE_USER_INFO) == 0) {
         // Solicitud de info de un usuario manda la info correspondiente
-        send_user_info(wsi, msg.target);
+        if (msg.targetIsList) {
+            // Varios usuarios en una sola respuesta; msg.target puede venir cortado, se relee el arreglo
+            char targets[MAX_JSON_LENGTH];
+            if (extract_json_value(json_str, "target", targets, sizeof(targets)) == 0)
+                send_user_info_batch(wsi, targets);
+        } else {
+            send_user_info(wsi, msg.target);
+        }
     } else if (strcmp(msg.type, MSG_TYPE_CHANGE_STATUS) == 0) {
-        //Cambio de estado solicitado actualiza el estado del usuario
-        update_client_status(msg.sender, msg.content);
+        //Cambio de estado solicitado actualiza el estado del usuario, solo se aceptan los estados conocidos
+        int status = client_status_parse(msg.content);
+        if (status >= 0) {
+            update_client_status(msg.sender, (ClientStatus)status);
+        } else {
+            ProtocolMessage error_msg;
+            memset(&error_msg, 0, sizeof(error_msg));
+            strncpy(error_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+            strncpy(error_msg.sender, "server", MAX_FIELD_LENGTH);
+            strncpy(error_msg.content, "Estado no valido.", MAX_MESSAGE_LENGTH);
+            get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
+            send_message(wsi, &error_msg);
+        }
         // elimina al usuario y difunde la notificacion de salida
     } else if (strcmp(msg.type, MSG_TYPE_DISCONNECT) == 0) {
         remove_client(msg.sender);
@@ -315,7 +1316,20 @@ static inline void handle_incoming_message(struct lws *wsi, const char *json_str
         strncpy(disc_msg.sender, "server", MAX_FIELD_LENGTH);
         snprintf(disc_msg.content, MAX_MESSAGE_LENGTH, "%s ha salido", msg.sender);
         get_current_timestamp(disc_msg.timestamp, MAX_FIELD_LENGTH);
-        broadcast_message(&disc_msg); // Difunde el mensaje a todos los clientes
+        publish_presence(msg.sender, &disc_msg); // Notifica la salida a los observadores
+    } else if (strcmp(msg.type, MSG_TYPE_SUBSCRIBE_PRESENCE) == 0 ||
+               strcmp(msg.type, MSG_TYPE_UNSUBSCRIBE_PRESENCE) == 0) {
+        // Suscripcion a la presencia de una lista de contactos
+        int subscribe = strcmp(msg.type, MSG_TYPE_SUBSCRIBE_PRESENCE) == 0;
+        if (change_presence_subscriptions(wsi, msg.content, subscribe) != 0) {
+            ProtocolMessage error_msg;
+            memset(&error_msg, 0, sizeof(error_msg));
+            strncpy(error_msg.type, MSG_TYPE_ERROR, MAX_FIELD_LENGTH);
+            strncpy(error_msg.sender, "server", MAX_FIELD_LENGTH);
+            strncpy(error_msg.content, "No se pudo cambiar la suscripcion de presencia.", MAX_MESSAGE_LENGTH);
+            get_current_timestamp(error_msg.timestamp, MAX_FIELD_LENGTH);
+            send_message(wsi, &error_msg);
+        }
     } else {
         // Tipo de mensaje desconocido manda un mensaje de error
         ProtocolMessage error_msg;
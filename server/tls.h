@@ -0,0 +1,76 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <libwebsockets.h>
+
+// TLS nativo del servidor: reanudacion de sesiones por cache y tickets, y descarga a kTLS si el kernel lo soporta
+// Solo aplica cuando libwebsockets se compilo con OpenSSL
+
+#if (defined(LWS_OPENSSL_SUPPORT) || defined(LWS_WITH_TLS)) && !defined(LWS_WITH_MBEDTLS)
+#define CHAT_WITH_OPENSSL 1
+#include <openssl/ssl.h>
+#endif
+
+#ifndef TLS_SESSION_CACHE_SIZE
+#define TLS_SESSION_CACHE_SIZE 20480 // Sesiones guardadas para reanudar sin handshake completo
+#endif
+#ifndef TLS_SESSION_TIMEOUT
+#define TLS_SESSION_TIMEOUT    3600  // Segundos que una sesion o ticket sigue siendo valido
+#endif
+#define TLS_TICKET_KEYS_LENGTH 80    // Nombre, clave HMAC y clave AES de los tickets
+
+static const char *tls_cert_path = NULL;     // Certificado del servidor, NULL si no se usa TLS
+static const char *tls_key_path = NULL;      // Clave privada del certificado
+static const char *tls_ticket_keys_path = NULL; // Archivo con las claves de tickets compartidas entre procesos
+
+#ifdef CHAT_WITH_OPENSSL
+static SSL_CTX *tls_server_ctx = NULL;       // Contexto TLS del vhost, para las estadisticas
+
+// Configura el SSL_CTX que creo libwebsockets para el vhost
+// Se llama desde LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS
+static inline void tls_configure_server_ctx(SSL_CTX *ctx) {
+    static const unsigned char session_id_ctx[] = "chat-protocol";
+    tls_server_ctx = ctx;
+    // Cache de sesiones del lado del servidor para reanudar por identificador de sesion
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, session_id_ctx, sizeof(session_id_ctx) - 1);
+    // Tickets de sesion: la reanudacion no depende de la cache y sobrevive a varios procesos
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    if (tls_ticket_keys_path) {
+        // Claves compartidas: un proceso nuevo tras una actualizacion acepta los tickets del anterior
+        unsigned char keys[TLS_TICKET_KEYS_LENGTH];
+        FILE *f = fopen(tls_ticket_keys_path, "rb");
+        size_t n = f ? fread(keys, 1, sizeof(keys), f) : 0;
+        if (f) fclose(f);
+        if (n == sizeof(keys) && SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys)) == 1)
+            lwsl_user("Claves de tickets TLS cargadas de %s.\n", tls_ticket_keys_path);
+        else
+            lwsl_err("No se pudieron cargar las claves de tickets de %s, se usan claves propias.\n",
+                     tls_ticket_keys_path);
+        memset(keys, 0, sizeof(keys));
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    // El cifrado simetrico lo hace el kernel cuando el modulo tls esta disponible
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+// Muestra cuantos handshakes fueron completos y cuantos reanudaron una sesion
+static inline void tls_log_stats(void) {
+    if (!tls_server_ctx) return;
+    long accepted = SSL_CTX_sess_accept_good(tls_server_ctx);
+    long resumed = SSL_CTX_sess_hits(tls_server_ctx);
+    lwsl_user("TLS: %ld handshakes, %ld reanudados, %ld completos.\n",
+              accepted, resumed, accepted - resumed);
+}
+#else
+// Sin OpenSSL no hay opciones adicionales que configurar
+static inline void tls_log_stats(void) {
+}
+#endif
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "server.h"
+
+// Actualizacion sin cortes: el proceso en ejecucion entrega su socket de escucha a un binario nuevo
+// por un socket Unix (SCM_RIGHTS), deja de aceptar conexiones, pide a los clientes que se reconecten
+// de forma escalonada y termina cuando vacio sus colas de salida
+
+#ifndef UPGRADE_DRAIN_TIMEOUT
+#define UPGRADE_DRAIN_TIMEOUT 10 // Segundos maximos para vaciar las colas antes de salir
+#endif
+
+static int listen_fd = -1;            // Socket de escucha propio, se adopta en libwebsockets
+static struct lws *listen_wsi = NULL; // Conexion de libwebsockets que vigila listen_fd
+static int control_fd = -1;           // Socket Unix donde un proceso nuevo pide el socket de escucha
+static const char *control_path = NULL; // Ruta del socket de control, NULL si no se usa
+static int upgrade_spread_ms = 5000;  // Ventana en la que se reparten las reconexiones de los clientes
+static int draining = 0;              // 1 si el servidor ya no acepta conexiones y esta vaciando colas
+static int handed_off = 0;            // 1 si el socket de escucha ya se entrego a otro proceso
+static time_t drain_deadline = 0;     // Momento limite para terminar de vaciar las colas
+
+// Crea el socket de escucha TCP del servidor, no bloqueante como lo espera libwebsockets
+static inline int create_listen_socket(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int v6 = fd >= 0;
+    if (!v6) fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    int rc;
+    if (v6) {
+        // Escucha en IPv4 e IPv6 a la vez
+        int off = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons((unsigned short)port);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((unsigned short)port);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (rc != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Crea el socket Unix de control en path, reemplazando uno anterior si existia
+static inline int create_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path); // El proceso anterior ya entrego su socket o no existe
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Manda el descriptor fd por el socket Unix sock usando SCM_RIGHTS
+static inline int send_fd(int sock, int fd) {
+    char byte = 'L';
+    struct iovec iov = { &byte, 1 };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    return sendmsg(sock, &mh, 0) == 1 ? 0 : -1;
+}
+
+// Recibe un descriptor por el socket Unix sock, retorna el descriptor o -1
+static inline int recv_fd(int sock) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != 1) return -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    return fd;
+}
+
+// Se conecta al socket de control del proceso en ejecucion y recibe su socket de escucha
+static inline int takeover_listen_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        fd = recv_fd(sock);
+    close(sock);
+    if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Avisa a cada cliente que el servidor se reinicia y en cuantos milisegundos debe reconectarse
+// Los retrasos se reparten en upgrade_spread_ms para no provocar una avalancha contra el proceso nuevo
+static inline void notify_restart(void) {
+    pthread_mutex_lock(&client_list_mutex);
+    int total = (int)client_count;
+    for (int i = 0; i < total; i++) {
+        ProtocolMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        strncpy(msg.type, MSG_TYPE_SERVER_RESTART, MAX_FIELD_LENGTH);
+        strncpy(msg.sender, "server", MAX_FIELD_LENGTH);
+        long delay = total > 0 ? (long)upgrade_spread_ms * i / total : 0;
+        snprintf(msg.content, MAX_MESSAGE_LENGTH, "{\"reconnect_ms\": %ld}", delay);
+        msg.contentIsJson = 1;
+        get_current_timestamp(msg.timestamp, MAX_FIELD_LENGTH);
+        send_message(client_hot[i].wsi, &msg);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+// Empieza a vaciar el servidor: deja de aceptar conexiones y avisa a los clientes, solo desde el hilo de servicio
+static inline void begin_drain(void) {
+    if (draining) return;
+    draining = 1;
+    drain_deadline = time(NULL) + UPGRADE_DRAIN_TIMEOUT;
+    lwsl_user("Dejando de aceptar conexiones, vaciando colas de salida.\n");
+    // Cierra el socket de escucha de este proceso, si se entrego el proceso nuevo conserva su copia
+    if (listen_wsi) lws_set_timeout(listen_wsi, PENDING_TIMEOUT_CLOSE_SEND, 1);
+    // El proceso nuevo lee los buzones del disco; lo que llegue mientras se vacia se vuelca al terminar
+    mailbox_flush_all();
+    notify_restart();
+}
+
+// Retorna 1 cuando ya no quedan tramas pendientes para ningun cliente registrado
+static inline int drain_finished(void) {
+    int pending = 0;
+    pthread_mutex_lock(&client_list_mutex);
+    for (size_t i = 0; i < client_count && !pending; i++) {
+        struct lws *wsi = client_hot[i].wsi;
+        SessionData *pss = (SessionData *)lws_wsi_user(wsi);
+        if (!pss) continue;
+        pthread_mutex_lock(&pss->lock);
+        pending = outbound_pending_locked(pss);
+        pthread_mutex_unlock(&pss->lock);
+        // Tambien cuenta lo que libwebsockets no pudo escribir todavia
+        if (lws_send_pipe_choked(wsi)) pending = 1;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    return !pending;
+}
+
+// Atiende una peticion en el socket de control: entrega el socket de escucha y empieza a vaciar
+static inline void handle_upgrade_request(void) {
+    int conn = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) return;
+    if (draining) {
+        close(conn); // Ya se entrego el socket o se esta cerrando
+        return;
+    }
+    if (send_fd(conn, listen_fd) == 0) {
+        lwsl_user("Socket de escucha entregado al proceso nuevo.\n");
+        handed_off = 1;
+        begin_drain();
+    } else {
+        lwsl_err("No se pudo entregar el socket de escucha: %s\n", strerror(errno));
+    }
+    close(conn);
+}
+
+// Acepta las conexiones pendientes del socket de escucha y las entrega a libwebsockets
+static inline void accept_pending_connections(struct lws *listen_wsi) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) break; // EAGAIN: no quedan conexiones en la cola
+        if (!lws_adopt_socket_vhost(lws_get_vhost(listen_wsi), fd))
+            lwsl_err("No se pudo adoptar una conexion entrante.\n");
+    }
+}
+
+#endif
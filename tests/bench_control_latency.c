@@ -0,0 +1,122 @@
+#include "harness.h"
+
+// Latencia de las respuestas del servidor con el chat saturado
+// Un proceso hijo abre F conexiones que mandan broadcasts sin pausa; el medidor recibe todos esos broadcasts y
+// entre tanto pide user_info sobre si mismo, midiendo hasta que llega user_info_response
+// Se informa p50, p90, p99 y maximo primero sin carga y despues con el chat saturado
+// Uso: bench_control_latency [consultas] [conexiones de carga] [bytes por broadcast]
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, int n, double p) {
+    int i = (int)(p * (n - 1) + 0.5);
+    return (double)sorted[i] / 1e6;
+}
+
+// Mide count consultas; retorna cuantas respondieron
+static int measure(WsConn *c, int count, uint64_t *lat) {
+    int done = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t start = harness_now_ns();
+        if (chat_send(c, MSG_TYPE_USER_INFO, "medidor", "medidor", NULL) != 0) break;
+        // ws_expect descarta los broadcasts que llegan antes de la respuesta
+        if (ws_expect(c, MSG_TYPE_USER_INFO_RESPONSE, NULL, NULL, 0, HARNESS_WAIT_MS) != 1) break;
+        lat[done++] = harness_now_ns() - start;
+    }
+    return done;
+}
+
+static void report(const char *label, uint64_t *lat, int n) {
+    if (n == 0) {
+        printf("%-10s sin respuestas\n", label);
+        return;
+    }
+    qsort(lat, (size_t)n, sizeof(uint64_t), cmp_u64);
+    printf("%-10s %6d  p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", label, n,
+           percentile_ms(lat, n, 0.50), percentile_ms(lat, n, 0.90), percentile_ms(lat, n, 0.99),
+           (double)lat[n - 1] / 1e6);
+}
+
+// Carga: cada conexion manda un broadcast por vuelta y lee sus ecos sin esperar, hasta que la maten
+static void flood(int port, int conns, int size) {
+    WsConn **c = (WsConn **)calloc((size_t)conns, sizeof(WsConn *));
+    char *content = (char *)malloc((size_t)size + 1);
+    char frame[MAX_JSON_LENGTH + 128];
+    if (!c || !content) _exit(2);
+    memset(content, 'x', (size_t)size);
+    content[size] = '\0';
+    for (int i = 0; i < conns; i++) {
+        char name[MAX_FIELD_LENGTH];
+        snprintf(name, sizeof(name), "carga%d", i);
+        c[i] = chat_login(port, name, 0);
+        if (!c[i]) _exit(1);
+    }
+    while (1) {
+        for (int i = 0; i < conns; i++) {
+            char name[MAX_FIELD_LENGTH];
+            snprintf(name, sizeof(name), "carga%d", i);
+            if (chat_send(c[i], MSG_TYPE_BROADCAST, name, NULL, content) != 0) _exit(1);
+            while (ws_recv(c[i], frame, sizeof(frame), 0) > 0) {}
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    int conns = argc > 2 ? atoi(argv[2]) : 4;
+    int size = argc > 3 ? atoi(argv[3]) : 512;
+    if (count < 1 || conns < 1 || size < 1 || size >= MAX_MESSAGE_LENGTH) {
+        fprintf(stderr, "Uso: %s [consultas] [conexiones de carga] [bytes por broadcast]\n", argv[0]);
+        return 2;
+    }
+
+    const char *dir = harness_tmpdir("chat_bench_latency");
+    if (!dir) return 2;
+    char mail[300], log[300], port_text[16];
+    snprintf(mail, sizeof(mail), "%s/buzones", dir);
+    snprintf(log, sizeof(log), "%s/server.log", dir);
+    int port = harness_port(11);
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    const char *args[] = { "-I", "-m", mail, port_text, NULL };
+    pid_t server = server_start(args, port, log);
+    if (server <= 0) {
+        fprintf(stderr, "No arranco el servidor (log en %s)\n", log);
+        return 1;
+    }
+
+    uint64_t *idle = (uint64_t *)calloc((size_t)count, sizeof(uint64_t));
+    uint64_t *busy = (uint64_t *)calloc((size_t)count, sizeof(uint64_t));
+    WsConn *c = chat_login(port, "medidor", 0);
+    if (!idle || !busy || !c) {
+        fprintf(stderr, "No se pudo registrar el medidor (log en %s)\n", log);
+        server_stop(server, SIGKILL);
+        return 1;
+    }
+
+    int idle_n = measure(c, count, idle);
+
+    pid_t loader = fork();
+    if (loader == 0) flood(port, conns, size);
+    if (loader < 0) {
+        server_stop(server, SIGKILL);
+        return 2;
+    }
+    harness_sleep_ms(500); // La carga llena las colas antes de medir
+    int busy_n = measure(c, count, busy);
+    kill(loader, SIGKILL);
+    waitpid(loader, NULL, 0);
+
+    printf("Consultas user_info, %d conexiones de carga con broadcasts de %d bytes\n", conns, size);
+    report("sin carga", idle, idle_n);
+    report("saturado", busy, busy_n);
+    CHECK(idle_n == count && busy_n == count, "respondieron %d y %d de %d consultas", idle_n, busy_n, count);
+
+    ws_free(c);
+    server_stop(server, SIGINT);
+    free(idle);
+    free(busy);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "json_escape.h"
+
+// Microbenchmark de json_escape por nivel de vectorizacion contra un escape byte a byte
+// Mide MB/s de entrada para tamaños tipicos de un mensaje de chat y para texto con muchos escapes
+// Uso: bench_json_escape [milisegundos por caso]
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Escape byte a byte, como el que se usaba antes de los recorridos vectorizados
+static int bytewise_escape(char *dst, size_t dst_size, const char *src, size_t len) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (out + 7 >= dst_size) return -1;
+        if (c == '"' || c == '\\') {
+            dst[out++] = '\\';
+            dst[out++] = (char)c;
+        } else if (c == '\n') {
+            dst[out++] = '\\';
+            dst[out++] = 'n';
+        } else if (c < 0x20) {
+            out += (size_t)snprintf(dst + out, dst_size - out, "\\u%04x", c);
+        } else {
+            dst[out++] = (char)c;
+        }
+    }
+    dst[out] = '\0';
+    return (int)out;
+}
+
+typedef int (*escape_fn)(char *, size_t, const char *, size_t);
+
+static volatile int sink;
+
+// Corre fn sobre src durante ms milisegundos y retorna MB/s
+static double run(escape_fn fn, const char *src, size_t len, int ms) {
+    static char dst[6 * 4096 + 1];
+    size_t iters = 0;
+    double start = now_sec(), elapsed;
+    do {
+        for (int k = 0; k < 1000; k++) sink += fn(dst, sizeof(dst), src, len);
+        iters += 1000;
+        elapsed = now_sec() - start;
+    } while (elapsed * 1000 < ms);
+    return (double)iters * len / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int ms = argc > 1 ? atoi(argv[1]) : 200;
+    static const size_t sizes[] = { 15, 31, 64, 256, 1024, 4096 };
+    static char plain[4096], escaped[4096];
+    const char *words = "hola a todos, nos vemos en la reunion de las diez ";
+    for (size_t i = 0; i < sizeof(plain); i++) {
+        plain[i] = words[i % strlen(words)];
+        // Una comilla o salto de linea cada 8 bytes
+        escaped[i] = i % 8 == 7 ? (i % 16 == 7 ? '"' : '\n') : plain[i];
+    }
+
+    int detected = json_simd();
+    static const char *names[] = { "escalar", "sse2", "avx2" };
+    printf("%-8s %-10s %6s %12s\n", "texto", "variante", "bytes", "MB/s");
+    for (int kind = 0; kind < 2; kind++) {
+        const char *src = kind ? escaped : plain;
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            printf("%-8s %-10s %6zu %12.1f\n", kind ? "escapes" : "comun", "bytewise", sizes[s],
+                   run(bytewise_escape, src, sizes[s], ms));
+            for (int level = JSON_SIMD_SCALAR; level <= detected; level++) {
+#ifdef JSON_SIMD_X86
+                if (level == JSON_SIMD_SCALAR) continue;
+#endif
+                json_simd_level = level;
+                printf("%-8s %-10s %6zu %12.1f\n", kind ? "escapes" : "comun", names[level], sizes[s],
+                       run(json_escape, src, sizes[s], ms));
+            }
+            json_simd_level = detected;
+        }
+    }
+    return 0;
+}
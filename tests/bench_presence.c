@@ -0,0 +1,193 @@
+#define _GNU_SOURCE // memmem
+#include <sys/resource.h>
+#include "harness.h"
+
+// Bytes de presencia que manda el servidor con muchos usuarios conectados
+// Registra N usuarios (10000 por defecto) y mide lo que reciben todos juntos cuando C de ellos cambian de estado:
+// - todos: cada usuario en modo subscribe *, cada cambio llega a los N
+// - lista: cada usuario observa a K contactos (los K siguientes en orden), cada cambio llega a unos K
+// Cada fase empieza con todos activos y termina antes de los 15 s de inactividad, asi el servidor no agrega sus
+// propios cambios a INACTIVO
+// Necesita un limite de descriptores mayor que N para este proceso y el servidor, que lo hereda; se sube solo
+// hasta el limite duro (ulimit -Hn)
+// Uso: bench_presence [usuarios] [cambios] [contactos]
+
+#define QUIET_MS 500 // Sin bytes durante este tiempo se da por terminada una fase
+
+static int *fds;
+static int user_count;
+static WsConn *tx; // Conexion de envio, se le cambia el fd para mandar por cada usuario
+
+// Lee de todos los sockets hasta que pasen QUIET_MS sin datos; retorna los bytes leidos y suma las presencias
+static uint64_t drain_all(uint64_t *presence_frames) {
+    static struct pollfd *pfds;
+    static char buf[65536];
+    if (!pfds) pfds = (struct pollfd *)calloc((size_t)user_count, sizeof(struct pollfd));
+    uint64_t bytes = 0;
+    uint64_t last = harness_now_ns();
+    for (int i = 0; i < user_count; i++) pfds[i].fd = fds[i], pfds[i].events = POLLIN;
+    while (harness_now_ns() - last < (uint64_t)QUIET_MS * 1000000ull) {
+        if (poll(pfds, (nfds_t)user_count, 50) <= 0) continue;
+        for (int i = 0; i < user_count; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            ssize_t n;
+            while ((n = recv(pfds[i].fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                bytes += (uint64_t)n;
+                // Las cabeceras de las tramas pueden tener ceros, se busca con memmem
+                // Una trama partida entre dos lecturas se puede perder en la cuenta, no en los bytes
+                const char *p = buf, *end = buf + n;
+                while (presence_frames && (p = memmem(p, (size_t)(end - p), MSG_TYPE_STATUS_UPDATE,
+                                                      sizeof(MSG_TYPE_STATUS_UPDATE) - 1)) != NULL) {
+                    (*presence_frames)++;
+                    p++;
+                }
+            }
+            last = harness_now_ns();
+        }
+    }
+    return bytes;
+}
+
+static void user_name(int i, char *out, size_t size) {
+    snprintf(out, size, "u%05d", i);
+}
+
+// Manda un mensaje del protocolo en nombre del usuario i
+static void user_send(int i, const char *type, const char *content, int content_is_json) {
+    char name[MAX_FIELD_LENGTH];
+    user_name(i, name, sizeof(name));
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.type, sizeof(msg.type), "%s", type);
+    snprintf(msg.sender, sizeof(msg.sender), "%s", name);
+    snprintf(msg.content, sizeof(msg.content), "%s", content);
+    msg.contentIsJson = content_is_json;
+    get_current_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(&msg, json, sizeof(json));
+    tx->fd = fds[i];
+    if (n > 0) ws_send_frame(tx, 0x1, json, (size_t)n);
+}
+
+// Todos dejan de recibir presencias y cuentan como activos de nuevo
+// Un usuario que quedo INACTIVO durante los registros vuelve a ACTIVO aca, sin nadie que reciba ese cambio
+static void reset_all(void) {
+    for (int i = 0; i < user_count; i++) user_send(i, MSG_TYPE_UNSUBSCRIBE_PRESENCE, "*", 0);
+    drain_all(NULL);
+}
+
+// C usuarios repartidos entre todos cambian a OCUPADO; retorna los bytes que recibieron todos
+static uint64_t run_changes(int changes, uint64_t *frames, double *seconds) {
+    drain_all(NULL); // Respuestas a las suscripciones
+    *frames = 0;
+    uint64_t start = harness_now_ns();
+    for (int c = 0; c < changes; c++)
+        user_send((int)((uint64_t)c * (uint64_t)user_count / (uint64_t)changes), MSG_TYPE_CHANGE_STATUS, STATUS_BUSY, 0);
+    uint64_t bytes = drain_all(frames);
+    *seconds = (double)(harness_now_ns() - start) / 1e9 - QUIET_MS / 1000.0;
+    // Vuelven a ACTIVO para la fase siguiente
+    for (int c = 0; c < changes; c++)
+        user_send((int)((uint64_t)c * (uint64_t)user_count / (uint64_t)changes), MSG_TYPE_CHANGE_STATUS, STATUS_ACTIVE, 0);
+    drain_all(NULL);
+    return bytes;
+}
+
+int main(int argc, char **argv) {
+    user_count = argc > 1 ? atoi(argv[1]) : 10000;
+    int changes = argc > 2 ? atoi(argv[2]) : 100;
+    int contacts = argc > 3 ? atoi(argv[3]) : 10;
+    if (user_count < 2 || changes < 1 || changes > user_count || contacts < 1 || contacts >= user_count) {
+        fprintf(stderr, "Uso: %s [usuarios] [cambios] [contactos]\n", argv[0]);
+        return 2;
+    }
+
+    // Un descriptor por usuario en cada lado, mas margen para el servidor
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)user_count + 64) {
+        fprintf(stderr, "Limite de descriptores %llu, no alcanza para %d usuarios (ulimit -Hn)\n",
+                (unsigned long long)rl.rlim_cur, user_count);
+        return 2;
+    }
+
+    const char *dir = harness_tmpdir("chat_bench_presence");
+    if (!dir) return 2;
+    char mail[300], log[300], port_text[16];
+    snprintf(mail, sizeof(mail), "%s/buzones", dir);
+    snprintf(log, sizeof(log), "%s/server.log", dir);
+    int port = harness_port(10);
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    const char *args[] = { "-I", "-m", mail, port_text, NULL };
+    pid_t server = server_start(args, port, log);
+    if (server <= 0) {
+        fprintf(stderr, "No arranco el servidor (log en %s)\n", log);
+        return 1;
+    }
+
+    fds = (int *)calloc((size_t)user_count, sizeof(int));
+    tx = (WsConn *)calloc(1, sizeof(WsConn));
+    if (!fds || !tx) return 2;
+    // Cada usuario deja de recibir presencias apenas se registra, asi los registros no cuestan N^2 tramas
+    uint64_t start = harness_now_ns();
+    for (int i = 0; i < user_count; i++) {
+        char name[MAX_FIELD_LENGTH];
+        user_name(i, name, sizeof(name));
+        WsConn *c = chat_login(port, name, 0);
+        if (!c) {
+            fprintf(stderr, "No se pudo registrar %s (log en %s)\n", name, log);
+            server_stop(server, SIGKILL);
+            return 1;
+        }
+        fds[i] = c->fd;
+        free(c); // Solo se conserva el socket, lo que quede en el buffer se descarta
+        user_send(i, MSG_TYPE_UNSUBSCRIBE_PRESENCE, "*", 0);
+    }
+    printf("%d usuarios registrados en %.1f s\n", user_count, (double)(harness_now_ns() - start) / 1e9);
+
+    // Fase todos
+    reset_all();
+    for (int i = 0; i < user_count; i++) user_send(i, MSG_TYPE_SUBSCRIBE_PRESENCE, "*", 0);
+    uint64_t all_frames, list_frames;
+    double all_s, list_s;
+    uint64_t all_bytes = run_changes(changes, &all_frames, &all_s);
+
+    // Fase lista: los K siguientes de cada usuario
+    reset_all();
+    for (int i = 0; i < user_count; i++) {
+        char list[MAX_MESSAGE_LENGTH];
+        size_t off = 0;
+        json_put_raw(list, sizeof(list), &off, "[");
+        for (int k = 1; k <= contacts; k++) {
+            char name[MAX_FIELD_LENGTH];
+            user_name((i + k) % user_count, name, sizeof(name));
+            if ((k > 1 && json_put_raw(list, sizeof(list), &off, ", ") < 0) ||
+                json_put_string(list, sizeof(list), &off, name) < 0)
+                break;
+        }
+        json_put_raw(list, sizeof(list), &off, "]");
+        user_send(i, MSG_TYPE_SUBSCRIBE_PRESENCE, list, 1);
+    }
+    uint64_t list_bytes = run_changes(changes, &list_frames, &list_s);
+
+    printf("%-8s %8s %14s %12s %14s %10s\n", "modo", "cambios", "bytes", "tramas", "bytes/cambio", "segundos");
+    printf("%-8s %8d %14llu %12llu %14.0f %10.2f\n", "todos", changes, (unsigned long long)all_bytes,
+           (unsigned long long)all_frames, (double)all_bytes / changes, all_s);
+    printf("%-8s %8d %14llu %12llu %14.0f %10.2f\n", "lista", changes, (unsigned long long)list_bytes,
+           (unsigned long long)list_frames, (double)list_bytes / changes, list_s);
+    if (list_bytes > 0)
+        printf("Con %d contactos por usuario la presencia usa %.0f veces menos bytes\n", contacts,
+               (double)all_bytes / (double)list_bytes);
+
+    // En modo lista cada cambio llega a unos K usuarios en lugar de N
+    CHECK(list_frames <= (uint64_t)changes * (uint64_t)contacts, "modo lista: %llu presencias para %d cambios",
+          (unsigned long long)list_frames, changes);
+    CHECK(all_frames > list_frames, "el modo lista no redujo las presencias");
+
+    for (int i = 0; i < user_count; i++) close(fds[i]);
+    server_stop(server, SIGKILL); // Sin esperar los user_disconnected de todos
+    free(fds);
+    free(tx);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,275 @@
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "harness.h"
+
+// Handshakes TLS completos contra reanudados y rendimiento de una conexion wss
+// Genera un certificado autofirmado con openssl, levanta server_chat -c/-k y mide:
+// - N handshakes completos, cada uno en una conexion TCP nueva y sin sesion previa
+// - N handshakes reanudados, cada uno con el ticket de sesion que dejo la conexion anterior
+// - un usuario que manda M broadcasts de B bytes por wss y lee sus ecos, en MB/s
+// OpenSSL no usa dos veces el mismo ticket de TLS 1.3, asi que cada conexion espera su ticket antes de cerrarse,
+// como un cliente que despues se reconecta; la espera cuenta en las dos mediciones
+// Uso: bench_tls_resume [handshakes] [broadcasts] [bytes por broadcast]
+
+static SSL_SESSION *saved_session; // Ultima sesion que emitio el servidor, para reanudar
+static int tickets_seen;           // Sesiones recibidas desde el inicio
+
+// El cliente guarda la sesion en lugar de la cache interna; con TLS 1.3 el ticket llega despues del handshake
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    (void)ssl;
+    if (saved_session) SSL_SESSION_free(saved_session);
+    saved_session = session;
+    tickets_seen++;
+    return 1; // La referencia queda en saved_session
+}
+
+static void tls_close(SSL *ssl) {
+    int fd = SSL_get_fd(ssl);
+    SSL_shutdown(ssl); // Solo manda close_notify, no espera la respuesta
+    SSL_free(ssl);
+    close(fd);
+}
+
+// Abre una conexion TCP y hace el handshake TLS, reanudando session si no es NULL; NULL si fallo
+static SSL *tls_open(SSL_CTX *ctx, int port, SSL_SESSION *session) {
+    int fd = harness_tcp_connect("127.0.0.1", port, 0);
+    if (fd < 0) return NULL;
+    SSL *ssl = SSL_new(ctx);
+    if (!ssl) {
+        close(fd);
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, "localhost");
+    SSL_set1_host(ssl, "localhost"); // El CN del certificado generado
+    if (session) SSL_set_session(ssl, session);
+    if (SSL_connect(ssl) != 1) {
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+    return ssl;
+}
+
+// Espera el ticket que el servidor manda despues del handshake de TLS 1.3; retorna 0 si llego
+// En TLS 1.2 el ticket viaja dentro del handshake y ya se recibio
+static int tls_await_ticket(SSL *ssl, int before) {
+    int fd = SSL_get_fd(ssl);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    uint64_t deadline = harness_now_ns() + (uint64_t)HARNESS_WAIT_MS * 1000000ull;
+    char byte;
+    while (tickets_seen == before && harness_now_ns() < deadline) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        if (SSL_read(ssl, &byte, 1) <= 0 && SSL_get_error(ssl, -1) != SSL_ERROR_WANT_READ) break;
+    }
+    return tickets_seen > before ? 0 : -1;
+}
+
+static int tls_write_all(SSL *ssl, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        int n = SSL_write(ssl, p, len > INT32_MAX ? INT32_MAX : (int)len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Lee del socket TLS al buffer de c sin esperar mas de timeout_ms; retorna bytes leidos, 0 si no llego nada o -1
+static int tls_fill(SSL *ssl, WsConn *c, int timeout_ms) {
+    if (c->len == sizeof(c->buf)) return 0;
+    if (SSL_pending(ssl) == 0) {
+        struct pollfd pfd = { SSL_get_fd(ssl), POLLIN, 0 };
+        if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+    }
+    int n = SSL_read(ssl, c->buf + c->len, (int)(sizeof(c->buf) - c->len));
+    if (n <= 0) return SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ ? 0 : -1;
+    c->len += (size_t)n;
+    return n;
+}
+
+static int tls_send_frame(SSL *ssl, const char *json, size_t len) {
+    size_t n;
+    unsigned char *frame = ws_encode_frame(0x1, json, len, &n);
+    if (!frame) return -1;
+    int ret = tls_write_all(ssl, frame, n);
+    free(frame);
+    return ret;
+}
+
+static int tls_chat_send(SSL *ssl, const char *type, const char *sender, const char *content) {
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.type, sizeof(msg.type), "%s", type);
+    snprintf(msg.sender, sizeof(msg.sender), "%s", sender);
+    if (content) snprintf(msg.content, sizeof(msg.content), "%s", content);
+    get_current_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(&msg, json, sizeof(json));
+    return n < 0 ? -1 : tls_send_frame(ssl, json, (size_t)n);
+}
+
+// Hace el handshake WebSocket sobre ssl y registra a name; c queda con lo que llego despues del registro
+// c->fd es -1: las tramas se leen con tls_fill y ws_next_frame no puede contestar pings en claro
+static int tls_login(SSL *ssl, WsConn *c, const char *name) {
+    char request[512];
+    int n = snprintf(request, sizeof(request),
+                     "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+                     "Sec-WebSocket-Protocol: chat-protocol\r\nOrigin: https://localhost\r\n\r\n");
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    if (tls_write_all(ssl, request, (size_t)n) != 0) return -1;
+    uint64_t deadline = harness_now_ns() + (uint64_t)HARNESS_WAIT_MS * 1000000ull;
+    char *end = NULL;
+    while (!end && harness_now_ns() < deadline) {
+        c->buf[c->len] = '\0';
+        end = strstr((char *)c->buf, "\r\n\r\n");
+        if (!end && (c->len == sizeof(c->buf) - 1 || tls_fill(ssl, c, 100) < 0)) return -1;
+    }
+    if (!end || strncmp((char *)c->buf, "HTTP/1.1 101", 12) != 0) return -1;
+    size_t header = (size_t)(end + 4 - (char *)c->buf);
+    memmove(c->buf, c->buf + header, c->len - header);
+    c->len -= header;
+
+    if (tls_chat_send(ssl, MSG_TYPE_REGISTER, name, NULL) != 0) return -1;
+    char frame[MAX_JSON_LENGTH + 128], type[MAX_FIELD_LENGTH];
+    while (harness_now_ns() < deadline) {
+        int r = ws_next_frame(c, frame, sizeof(frame));
+        if (r == -1) return -1;
+        if (r >= 0 && extract_json_value(frame, "type", type, sizeof(type)) == 0 &&
+            strcmp(type, MSG_TYPE_REGISTER_SUCCESS) == 0)
+            return 0;
+        if (r == -2 && tls_fill(ssl, c, 100) < 0) return -1;
+    }
+    return -1;
+}
+
+// Saca las tramas completas de c y suma los broadcasts y sus bytes; retorna -1 si llego el cierre
+static int count_echoes(WsConn *c, int *echoes, uint64_t *bytes) {
+    char frame[MAX_JSON_LENGTH + 128];
+    int n;
+    while ((n = ws_next_frame(c, frame, sizeof(frame))) != -2) {
+        if (n == -1) return -1;
+        if (strstr(frame, "\"" MSG_TYPE_BROADCAST "\"")) {
+            (*echoes)++;
+            *bytes += (uint64_t)n;
+        }
+    }
+    return 0;
+}
+
+// count handshakes seguidos, completos o reanudando la ultima sesion recibida; retorna cuantos se reanudaron o -1
+static int run_handshakes(SSL_CTX *ctx, int port, int count, int resume, double *seconds) {
+    int resumed = 0;
+    uint64_t start = harness_now_ns();
+    for (int i = 0; i < count; i++) {
+        int before = tickets_seen;
+        SSL *ssl = tls_open(ctx, port, resume ? saved_session : NULL);
+        if (!ssl) return -1;
+        resumed += SSL_session_reused(ssl);
+        int ticket = tls_await_ticket(ssl, before);
+        tls_close(ssl);
+        if (ticket != 0) return -1;
+    }
+    *seconds = (double)(harness_now_ns() - start) / 1e9;
+    return resumed;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    int frames = argc > 2 ? atoi(argv[2]) : 20000;
+    int size = argc > 3 ? atoi(argv[3]) : 1000;
+    if (count < 1 || frames < 1 || size < 1 || size >= MAX_MESSAGE_LENGTH) {
+        fprintf(stderr, "Uso: %s [handshakes] [broadcasts] [bytes por broadcast]\n", argv[0]);
+        return 2;
+    }
+
+    const char *dir = harness_tmpdir("chat_bench_tls");
+    if (!dir) return 2;
+    char mail[300], log[300], cert[300], key[300], cmd[1024], port_text[16];
+    snprintf(mail, sizeof(mail), "%s/buzones", dir);
+    snprintf(log, sizeof(log), "%s/server.log", dir);
+    snprintf(cert, sizeof(cert), "%s/cert.pem", dir);
+    snprintf(key, sizeof(key), "%s/key.pem", dir);
+    snprintf(cmd, sizeof(cmd), "openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost "
+                               "-keyout %s -out %s 2>/dev/null", key, cert);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "No se pudo generar el certificado con openssl\n");
+        return 2;
+    }
+    int port = harness_port(12);
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    const char *args[] = { "-I", "-c", cert, "-k", key, "-m", mail, port_text, NULL };
+    pid_t server = server_start(args, port, log);
+    if (server <= 0) {
+        fprintf(stderr, "No arranco el servidor (log en %s)\n", log);
+        return 1;
+    }
+
+    // El certificado generado es la unica autoridad aceptada
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx || SSL_CTX_load_verify_locations(ctx, cert, NULL) != 1) {
+        server_stop(server, SIGKILL);
+        return 2;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+
+    // Carga: un usuario por wss que manda broadcasts y lee sus ecos; de paso deja la sesion para reanudar
+    static WsConn conn;
+    SSL *bulk = tls_open(ctx, port, NULL);
+    if (!bulk || tls_login(bulk, &conn, "carga") != 0) {
+        fprintf(stderr, "No se pudo registrar por wss (log en %s)\n", log);
+        server_stop(server, SIGKILL);
+        return 1;
+    }
+    char *content = (char *)malloc((size_t)size + 1);
+    if (!content) return 2;
+    memset(content, 'x', (size_t)size);
+    content[size] = '\0';
+    int echoes = 0;
+    uint64_t bytes = 0;
+    uint64_t start = harness_now_ns();
+    for (int i = 0; i < frames; i++) {
+        if (tls_chat_send(bulk, MSG_TYPE_BROADCAST, "carga", content) != 0) break;
+        // Se leen los ecos al ritmo del envio para no pasar el limite de clientes lentos
+        while (tls_fill(bulk, &conn, 0) > 0) {}
+        if (count_echoes(&conn, &echoes, &bytes) != 0) break;
+    }
+    uint64_t deadline = harness_now_ns() + (uint64_t)HARNESS_WAIT_MS * 1000000ull;
+    while (echoes < frames && harness_now_ns() < deadline) {
+        if (tls_fill(bulk, &conn, 100) < 0 || count_echoes(&conn, &echoes, &bytes) != 0) break;
+    }
+    double bulk_s = (double)(harness_now_ns() - start) / 1e9;
+    tls_close(bulk);
+    free(content);
+
+    double full_s = 0, resumed_s = 0;
+    int full_resumed = run_handshakes(ctx, port, count, 0, &full_s);
+    int resumed = saved_session ? run_handshakes(ctx, port, count, 1, &resumed_s) : -1;
+
+    printf("%-12s %8s %12s %14s\n", "handshakes", "cantidad", "segundos", "por segundo");
+    if (full_resumed >= 0)
+        printf("%-12s %8d %12.2f %14.0f\n", "completos", count, full_s, count / full_s);
+    if (resumed >= 0)
+        printf("%-12s %8d %12.2f %14.0f\n", "reanudados", count, resumed_s, count / resumed_s);
+    if (full_resumed >= 0 && resumed > 0)
+        printf("Un handshake reanudado cuesta %.1f veces menos que uno completo\n",
+               (full_s / count) / (resumed_s / count));
+    printf("wss: %d broadcasts de %d bytes, %d ecos, %.2f MB/s recibidos en %.2f s\n", frames, size, echoes,
+           (double)bytes / 1e6 / bulk_s, bulk_s);
+
+    CHECK(full_resumed == 0, "handshakes completos: %d fallaron o se reanudaron", full_resumed);
+    CHECK(saved_session != NULL, "el servidor no emitio un ticket de sesion");
+    CHECK(resumed == count, "se reanudaron %d de %d handshakes", resumed, count);
+    CHECK(echoes == frames, "llegaron %d de %d ecos por wss", echoes, frames);
+
+    if (saved_session) SSL_SESSION_free(saved_session);
+    SSL_CTX_free(ctx);
+    server_stop(server, SIGINT);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,388 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "protocol.h"
+
+// Utilidades de las pruebas de punta a punta: levantan procesos server_chat y hablan con ellos con un cliente
+// WebSocket minimo sobre sockets comunes. No usan libwebsockets, asi una prueba controla cuando lee y cuando no
+// Se corren desde la raiz del repositorio con make check, que antes compila ./server_chat
+
+#define WS_BUFFER_SIZE   (2 * MAX_JSON_LENGTH + 256) // Lugar para una trama completa del servidor y la siguiente
+#define HARNESS_WAIT_MS  5000                        // Espera maxima por defecto de una respuesta
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "FALLO %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+// Conexion WebSocket del lado cliente
+typedef struct {
+    int fd;
+    size_t len;                   // Bytes recibidos en buf que todavia no se procesaron
+    int close_code;               // Codigo de la trama de cierre recibida, 0 si no llego
+    char close_reason[128];       // Motivo de la trama de cierre
+    unsigned char buf[WS_BUFFER_SIZE];
+} WsConn;
+
+// Reloj monotono en nanosegundos
+static inline uint64_t harness_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void harness_sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// Escribe todo buf en fd, retorna 0 o -1 si el socket se cerro
+static inline int harness_write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Abre un socket TCP a host:port, -1 si no se pudo conectar
+// rcvbuf distinto de 0 achica el buffer de recepcion antes de conectar, asi tambien se achica la ventana TCP
+static inline int harness_tcp_connect(const char *host, int port, int rcvbuf) {
+    char port_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port_text, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// Conecta y hace el handshake WebSocket con el subprotocolo indicado
+// rcvbuf distinto de 0 achica el buffer de recepcion del socket, para simular un cliente que no lee
+// Retorna la conexion o NULL si el servidor no acepto el handshake
+static inline WsConn *ws_connect(const char *host, int port, const char *protocol, int rcvbuf) {
+    int fd = harness_tcp_connect(host, port, rcvbuf);
+    if (fd < 0) return NULL;
+    char request[512];
+    int n = snprintf(request, sizeof(request),
+                     "GET / HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+                     "Sec-WebSocket-Protocol: %s\r\nOrigin: http://%s\r\n\r\n",
+                     host, port, protocol, host);
+    WsConn *c = (WsConn *)calloc(1, sizeof(WsConn));
+    if (!c || harness_write_all(fd, request, (size_t)n) != 0) {
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    // Lee la respuesta HTTP hasta la linea vacia; lo que sigue ya son tramas
+    uint64_t deadline = harness_now_ns() + (uint64_t)HARNESS_WAIT_MS * 1000000ull;
+    char *end = NULL;
+    while (!end) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (harness_now_ns() > deadline || poll(&pfd, 1, 100) < 0) break;
+        if (!(pfd.revents & (POLLIN | POLLHUP))) continue;
+        ssize_t r = recv(fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+        if (r <= 0) break;
+        c->len += (size_t)r;
+        c->buf[c->len] = '\0';
+        end = strstr((char *)c->buf, "\r\n\r\n");
+    }
+    if (!end || strncmp((char *)c->buf, "HTTP/1.1 101", 12) != 0) {
+        close(fd);
+        free(c);
+        return NULL;
+    }
+    size_t header = (size_t)(end + 4 - (char *)c->buf);
+    memmove(c->buf, c->buf + header, c->len - header);
+    c->len -= header;
+    return c;
+}
+
+// Cierra el socket sin handshake de cierre y libera la conexion
+static inline void ws_free(WsConn *c) {
+    if (!c) return;
+    close(c->fd);
+    free(c);
+}
+
+// Arma una trama con el opcode indicado, enmascarada como corresponde a un cliente
+// Retorna la trama en memoria dinamica con su largo en out_len, o NULL si no hay memoria
+static inline unsigned char *ws_encode_frame(int opcode, const void *data, size_t len, size_t *out_len) {
+    unsigned char header[14];
+    size_t h = 0;
+    header[h++] = (unsigned char)(0x80 | opcode);
+    if (len < 126) {
+        header[h++] = (unsigned char)(0x80 | len);
+    } else if (len < 65536) {
+        header[h++] = 0x80 | 126;
+        header[h++] = (unsigned char)(len >> 8);
+        header[h++] = (unsigned char)len;
+    } else {
+        header[h++] = 0x80 | 127;
+        for (int i = 7; i >= 0; i--) header[h++] = (unsigned char)((uint64_t)len >> (8 * i));
+    }
+    uint32_t mask = (uint32_t)rand();
+    memcpy(header + h, &mask, 4);
+    const unsigned char *key = header + h;
+    h += 4;
+    unsigned char *masked = (unsigned char *)malloc(h + len);
+    if (!masked) return NULL;
+    memcpy(masked, header, h);
+    for (size_t i = 0; i < len; i++) masked[h + i] = ((const unsigned char *)data)[i] ^ key[i & 3];
+    *out_len = h + len;
+    return masked;
+}
+
+// Manda una trama con el opcode indicado
+static inline int ws_send_frame(WsConn *c, int opcode, const void *data, size_t len) {
+    size_t n;
+    unsigned char *frame = ws_encode_frame(opcode, data, len, &n);
+    if (!frame) return -1;
+    int ret = harness_write_all(c->fd, frame, n);
+    free(frame);
+    return ret;
+}
+
+// Manda un texto
+static inline int ws_send(WsConn *c, const char *text) {
+    return ws_send_frame(c, 0x1, text, strlen(text));
+}
+
+// Saca de buf la proxima trama de texto completa, responde pings y registra cierres
+// Retorna la longitud copiada en out, -2 si no hay una trama completa o -1 si llego el cierre
+static inline int ws_next_frame(WsConn *c, char *out, size_t out_size) {
+    while (1) {
+        if (c->len < 2) return -2;
+        int opcode = c->buf[0] & 0x0F;
+        uint64_t len = c->buf[1] & 0x7F;
+        size_t h = 2;
+        if (len == 126) {
+            if (c->len < 4) return -2;
+            len = ((uint64_t)c->buf[2] << 8) | c->buf[3];
+            h = 4;
+        } else if (len == 127) {
+            if (c->len < 10) return -2;
+            len = 0;
+            for (int i = 0; i < 8; i++) len = (len << 8) | c->buf[2 + i];
+            h = 10;
+        }
+        if (h + len > sizeof(c->buf)) return -1; // Trama mas grande de lo que manda el servidor
+        if (c->len < h + len) return -2;
+        const unsigned char *payload = c->buf + h;
+        int ret = -3;
+        if (opcode == 0x8) {
+            // Cierre: codigo y motivo
+            c->close_code = len >= 2 ? (payload[0] << 8) | payload[1] : 1005;
+            size_t rlen = len > 2 ? (size_t)len - 2 : 0;
+            if (rlen >= sizeof(c->close_reason)) rlen = sizeof(c->close_reason) - 1;
+            memcpy(c->close_reason, payload + 2, rlen);
+            c->close_reason[rlen] = '\0';
+            ret = -1;
+        } else if (opcode == 0x9) {
+            ws_send_frame(c, 0xA, payload, (size_t)len);
+        } else if (opcode == 0x1 || opcode == 0x0) {
+            size_t n = (size_t)len < out_size - 1 ? (size_t)len : out_size - 1;
+            memcpy(out, payload, n);
+            out[n] = '\0';
+            ret = (int)n;
+        }
+        memmove(c->buf, c->buf + h + len, c->len - h - (size_t)len);
+        c->len -= h + (size_t)len;
+        if (ret != -3) return ret;
+    }
+}
+
+// Lee lo que haya en el socket sin esperar mas de timeout_ms; retorna bytes leidos, 0 si no llego nada o -1 si se cerro
+static inline int ws_fill(WsConn *c, int timeout_ms) {
+    if (c->len == sizeof(c->buf)) return 0;
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r <= 0) return 0;
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
+    if (n == 0) return -1;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    c->len += (size_t)n;
+    return (int)n;
+}
+
+// Espera una trama de texto hasta timeout_ms; retorna su longitud, 0 si no llego o -1 si la conexion se cerro
+static inline int ws_recv(WsConn *c, char *out, size_t out_size, int timeout_ms) {
+    uint64_t deadline = harness_now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    while (1) {
+        int n = ws_next_frame(c, out, out_size);
+        if (n >= 0) return n == 0 ? 1 : n;
+        if (n == -1) return -1;
+        uint64_t now = harness_now_ns();
+        if (now >= deadline) return 0;
+        if (ws_fill(c, (int)((deadline - now) / 1000000ull) + 1) < 0) return -1;
+    }
+}
+
+// Espera una trama cuyo type sea type (y cuyo content contenga needle si no es NULL), descartando las demas
+// Retorna 1 si llego, 0 si se agoto el tiempo o -1 si la conexion se cerro
+static inline int ws_expect(WsConn *c, const char *type, const char *needle, char *out, size_t out_size, int timeout_ms) {
+    char frame[MAX_JSON_LENGTH + 128];
+    char got_type[MAX_FIELD_LENGTH];
+    uint64_t deadline = harness_now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    while (1) {
+        uint64_t now = harness_now_ns();
+        int left = now >= deadline ? 0 : (int)((deadline - now) / 1000000ull);
+        int n = ws_recv(c, frame, sizeof(frame), left);
+        if (n <= 0) return n;
+        if (extract_json_value(frame, "type", got_type, sizeof(got_type)) == 0 && strcmp(got_type, type) == 0 &&
+            (!needle || strstr(frame, needle))) {
+            if (out) snprintf(out, out_size, "%s", frame);
+            return 1;
+        }
+    }
+}
+
+// Manda un mensaje del protocolo armado con ProtocolMessage
+static inline int chat_send(WsConn *c, const char *type, const char *sender, const char *target, const char *content) {
+    ProtocolMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.type, sizeof(msg.type), "%s", type);
+    snprintf(msg.sender, sizeof(msg.sender), "%s", sender);
+    if (target) snprintf(msg.target, sizeof(msg.target), "%s", target);
+    if (content) snprintf(msg.content, sizeof(msg.content), "%s", content);
+    get_current_timestamp(msg.timestamp, sizeof(msg.timestamp));
+    char json[MAX_JSON_LENGTH];
+    int n = serialize_message_into(&msg, json, sizeof(json));
+    return n < 0 ? -1 : ws_send_frame(c, 0x1, json, (size_t)n);
+}
+
+// Conecta un usuario y espera register_success; rcvbuf como en ws_connect. NULL si el registro fallo
+static inline WsConn *chat_login(int port, const char *name, int rcvbuf) {
+    WsConn *c = ws_connect("127.0.0.1", port, "chat-protocol", rcvbuf);
+    if (!c) return NULL;
+    if (chat_send(c, MSG_TYPE_REGISTER, name, NULL, NULL) != 0 ||
+        ws_expect(c, MSG_TYPE_REGISTER_SUCCESS, NULL, NULL, 0, HARNESS_WAIT_MS) != 1) {
+        ws_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Puerto base de las pruebas, se cambia con CHAT_TEST_PORT para correr varias a la vez
+static inline int harness_port(int offset) {
+    const char *env = getenv("CHAT_TEST_PORT");
+    return (env ? atoi(env) : 18400) + offset;
+}
+
+// Levanta ./server_chat con los argumentos args (terminados en NULL) y la salida en log
+// Espera a que acepte conexiones en port; retorna el pid o -1
+static inline pid_t server_start(const char *const *args, int port, const char *log) {
+    const char *argv[32];
+    int argc = 0;
+    argv[argc++] = "./server_chat";
+    for (int i = 0; args[i] && argc < 31; i++) argv[argc++] = args[i];
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int fd = open(log ? log : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+    for (int i = 0; i < HARNESS_WAIT_MS / 50; i++) {
+        int fd = harness_tcp_connect("127.0.0.1", port, 0);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) return -1; // El servidor no arranco
+        harness_sleep_ms(50);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// Termina un servidor con sig y espera que salga; si no sale en HARNESS_WAIT_MS se lo mata
+// Retorna el estado de salida, o -1 si hubo que matarlo
+static inline int server_stop(pid_t pid, int sig) {
+    if (pid <= 0) return -1;
+    kill(pid, sig);
+    for (int i = 0; i < HARNESS_WAIT_MS / 20; i++) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        harness_sleep_ms(20);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// 1 si el archivo path contiene text
+static inline int file_contains(const char *path, const char *text) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char line[1024];
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f)) found = strstr(line, text) != NULL;
+    fclose(f);
+    return found;
+}
+
+// Crea un directorio temporal para buzones, logs y secretos de una prueba
+static inline const char *harness_tmpdir(const char *name) {
+    static char dir[256];
+    snprintf(dir, sizeof(dir), "/tmp/%s.XXXXXX", name);
+    return mkdtemp(dir);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "harness.h"
+
+// Federacion de dos nodos en localhost
+// - broadcasts y privados cruzan los enlaces en ambos sentidos
+// - un nombre conectado en un nodo no se puede registrar en el otro
+// - un enlace que no presenta el secreto compartido se cierra y no puede inyectar tramas
+// - una rafaga por encima de -w no desaloja al enlace: el directorio sigue y los privados se entregan
+
+#define BURST_FRAMES  20000 // Broadcasts de la rafaga, unos 20 MB con el nodo b detenido, mas que los buffers del socket
+#define BURST_CONTENT 1000
+
+// Espera a que un broadcast de from llegue a to, reintentando mientras el enlace se establece
+static int wait_link(WsConn *from, const char *from_name, WsConn *to, const char *tag) {
+    for (int i = 0; i < 40; i++) {
+        chat_send(from, MSG_TYPE_BROADCAST, from_name, NULL, tag);
+        if (ws_expect(to, MSG_TYPE_BROADCAST, tag, NULL, 0, 250) == 1) return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    const char *dir = harness_tmpdir("chat_federation");
+    if (!dir) return 2;
+    char secret[300], mail_a[300], mail_b[300], log_a[300], log_b[300], peer_a[64], peer_b[64], port_a[16], port_b[16];
+    snprintf(secret, sizeof(secret), "%s/secreto", dir);
+    snprintf(mail_a, sizeof(mail_a), "%s/buzones_a", dir);
+    snprintf(mail_b, sizeof(mail_b), "%s/buzones_b", dir);
+    snprintf(log_a, sizeof(log_a), "%s/a.log", dir);
+    snprintf(log_b, sizeof(log_b), "%s/b.log", dir);
+    int pa = harness_port(0), pb = harness_port(1);
+    snprintf(port_a, sizeof(port_a), "%d", pa);
+    snprintf(port_b, sizeof(port_b), "%d", pb);
+    snprintf(peer_a, sizeof(peer_a), "a@127.0.0.1:%d", pa);
+    snprintf(peer_b, sizeof(peer_b), "b@127.0.0.1:%d", pb);
+    FILE *f = fopen(secret, "w");
+    if (!f) return 2;
+    fputs("secreto-de-prueba-de-la-federacion\n", f);
+    fclose(f);
+
+    // -w chico: con la politica de clientes la rafaga desalojaria al enlace; -L lo deja crecer hasta 2 MB
+    const char *args_a[] = { "-n", "a", "-P", peer_b, "-S", secret, "-I", "-w", "8192", "-L", "2097152", "-m", mail_a, port_a, NULL };
+    const char *args_b[] = { "-n", "b", "-P", peer_a, "-S", secret, "-I", "-w", "8192", "-L", "2097152", "-m", mail_b, port_b, NULL };
+    pid_t a = server_start(args_a, pa, log_a);
+    pid_t b = server_start(args_b, pb, log_b);
+    CHECK(a > 0 && b > 0, "no arrancaron los nodos (logs en %s)", dir);
+    if (a <= 0 || b <= 0) {
+        server_stop(a, SIGINT);
+        server_stop(b, SIGINT);
+        return 1;
+    }
+
+    WsConn *ana = chat_login(pa, "ana", 0);
+    WsConn *bob = chat_login(pb, "bob", 0);
+    CHECK(ana && bob, "no se pudieron registrar ana y bob");
+    if (!ana || !bob) goto done;
+
+    // Enlaces en ambos sentidos
+    CHECK(wait_link(ana, "ana", bob, "enlace a->b"), "el broadcast de a no llego a b");
+    CHECK(wait_link(bob, "bob", ana, "enlace b->a"), "el broadcast de b no llego a a");
+
+    // Privado entre nodos
+    chat_send(ana, MSG_TYPE_PRIVATE, "ana", "bob", "privado \"entre\" nodos");
+    CHECK(ws_expect(bob, MSG_TYPE_PRIVATE, "privado \\\"entre\\\" nodos", NULL, 0, HARNESS_WAIT_MS) == 1,
+          "el privado de ana no llego a bob");
+
+    // bob ya esta en b, el mismo nombre no se acepta en a
+    WsConn *dup = chat_login(pa, "bob", 0);
+    CHECK(dup == NULL, "bob se pudo registrar en los dos nodos");
+    ws_free(dup);
+
+    // Un enlace sin el secreto: el saludo se rechaza y lo que siga no llega a los clientes
+    WsConn *intruder = ws_connect("127.0.0.1", pa, "chat-federation", 0);
+    CHECK(intruder != NULL, "no se pudo abrir el subprotocolo de federacion");
+    if (intruder) {
+        ws_send(intruder, "{\"type\": \"node_hello\", \"sender\": \"b\", \"target\": \"a\", "
+                          "\"content\": {\"seq\": 99999999999999, \"mac\": \"00\"}, \"timestamp\": \"\"}");
+        ws_send(intruder, "{\"type\": \"node_user_add\", \"sender\": \"b\", \"target\": \"ana\", \"timestamp\": \"\"}");
+        ws_send(intruder, "{\"type\": \"broadcast\", \"sender\": \"admin\", \"content\": \"inyectado\", \"timestamp\": \"\"}");
+        char frame[MAX_JSON_LENGTH];
+        int closed = 0;
+        for (int i = 0; i < 20 && !closed; i++) closed = ws_recv(intruder, frame, sizeof(frame), 100) < 0;
+        CHECK(closed, "el enlace sin secreto no se cerro");
+        ws_free(intruder);
+    }
+    CHECK(ws_expect(ana, MSG_TYPE_BROADCAST, "inyectado", NULL, 0, 500) == 0, "un enlace sin secreto inyecto un broadcast");
+    CHECK(ws_expect(ana, MSG_TYPE_ERROR, NULL, NULL, 0, 200) == 0, "un enlace sin secreto desalojo a ana");
+
+    // Rafaga con b detenido: el enlace a->b se llena por encima de -w y de -L
+    kill(b, SIGSTOP);
+    char content[BURST_CONTENT + 1];
+    memset(content, 'x', BURST_CONTENT);
+    content[BURST_CONTENT] = '\0';
+    char frame[MAX_JSON_LENGTH + 128];
+    for (int i = 0; i < BURST_FRAMES && ana; i++) {
+        if (chat_send(ana, MSG_TYPE_BROADCAST, "ana", NULL, content) != 0) break;
+        while (ws_recv(ana, frame, sizeof(frame), 0) > 0) {} // ana lee sus propios ecos
+    }
+    harness_sleep_ms(500);
+    kill(b, SIGCONT);
+    CHECK(file_contains(log_a, "Enlace entre nodos lleno"), "la rafaga no llego al limite -L del enlace");
+
+    // Si a hubiera desalojado el enlace, b daria a ana por desconectada hasta el proximo reintento
+    harness_sleep_ms(200);
+    dup = chat_login(pb, "ana", 0);
+    CHECK(dup == NULL, "b olvido que ana esta en a tras la rafaga");
+    ws_free(dup);
+    dup = chat_login(pa, "bob", 0);
+    CHECK(dup == NULL, "a olvido que bob esta en b tras la rafaga");
+    ws_free(dup);
+    // bob descarta lo acumulado y espera un privado nuevo
+    chat_send(ana, MSG_TYPE_PRIVATE, "ana", "bob", "despues de la rafaga");
+    CHECK(ws_expect(bob, MSG_TYPE_PRIVATE, "despues de la rafaga", NULL, 0, 3 * HARNESS_WAIT_MS) == 1,
+          "el privado posterior a la rafaga no llego a bob");
+
+done:
+    ws_free(ana);
+    ws_free(bob);
+    server_stop(a, SIGINT);
+    server_stop(b, SIGINT);
+    if (failures) {
+        fprintf(stderr, "test_federation: %d fallos (logs en %s)\n", failures, dir);
+        return 1;
+    }
+    printf("test_federation: ok\n");
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "json_escape.h"
+
+// Compara el escape y los recorridos vectorizados contra una version escalar de referencia
+// Cada entrada se copia a un bloque de su largo exacto, asi una lectura de mas se nota con -fsanitize=address
+// Uso: test_json_escape [semilla] [rondas]
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "FALLO %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64, reproducible con la semilla
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Escape de referencia, byte a byte
+static size_t ref_escape(char *dst, const unsigned char *src, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = src[i];
+        switch (c) {
+            case '"':  dst[out++] = '\\'; dst[out++] = '"'; break;
+            case '\\': dst[out++] = '\\'; dst[out++] = '\\'; break;
+            case '\n': dst[out++] = '\\'; dst[out++] = 'n'; break;
+            case '\r': dst[out++] = '\\'; dst[out++] = 'r'; break;
+            case '\t': dst[out++] = '\\'; dst[out++] = 't'; break;
+            case '\b': dst[out++] = '\\'; dst[out++] = 'b'; break;
+            case '\f': dst[out++] = '\\'; dst[out++] = 'f'; break;
+            default:
+                if (c < 0x20) {
+                    memcpy(dst + out, "\\u00", 4);
+                    dst[out + 4] = hex[c >> 4];
+                    dst[out + 5] = hex[c & 0xF];
+                    out += 6;
+                } else {
+                    dst[out++] = (char)c;
+                }
+        }
+    }
+    dst[out] = '\0';
+    return out;
+}
+
+static size_t ref_scan_escape(const unsigned char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] < 0x20 || s[i] == '"' || s[i] == '\\') return i;
+    return len;
+}
+
+static size_t ref_scan_quote(const unsigned char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] == '"' || s[i] == '\\') return i;
+    return len;
+}
+
+static size_t ref_scan_ascii(const unsigned char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] >= 0x80) return i;
+    return len;
+}
+
+// Verifica una entrada con el nivel de vectorizacion que este activo
+static void check_input(const unsigned char *data, size_t len, const char *what) {
+    // Copia exacta, sin relleno, para que el sanitizador vea lecturas fuera del bloque
+    char *src = (char *)malloc(len ? len : 1);
+    if (!src) exit(2);
+    memcpy(src, data, len);
+
+    CHECK(json_scan_escape(src, len) == ref_scan_escape(data, len), "%s: json_scan_escape len=%zu", what, len);
+    CHECK(json_scan_quote(src, len) == ref_scan_quote(data, len), "%s: json_scan_quote len=%zu", what, len);
+    CHECK(json_scan_ascii(src, len) == ref_scan_ascii(data, len), "%s: json_scan_ascii len=%zu", what, len);
+    CHECK(json_scan_escape_scalar(src, len) == ref_scan_escape(data, len), "%s: escalar escape len=%zu", what, len);
+
+    char *expect = (char *)malloc(len * 6 + 1);
+    char *got = (char *)malloc(len * 6 + 1);
+    if (!expect || !got) exit(2);
+    size_t n = ref_escape(expect, data, len);
+    int r = json_escape(got, len * 6 + 1, src, len);
+    CHECK(r == (int)n && memcmp(got, expect, n + 1) == 0, "%s: json_escape len=%zu", what, len);
+
+    // Un destino justo del largo escapado entra; uno menos debe fallar dejando dst terminado
+    r = json_escape(got, n + 1, src, len);
+    CHECK(r == (int)n, "%s: json_escape destino justo len=%zu", what, len);
+    if (n > 0) {
+        r = json_escape(got, n, src, len);
+        CHECK(r == -1 && strlen(got) < n, "%s: json_escape destino corto len=%zu", what, len);
+    }
+
+    // Ida y vuelta: el texto escapado y entre comillas se decodifica al original
+    char *quoted = (char *)malloc(n + 1);
+    char *back = (char *)malloc(len + 1);
+    if (!quoted || !back) exit(2);
+    memcpy(quoted, expect, n);
+    quoted[n] = '"';
+    if (utf8_validate(src, len)) {
+        const char *end = json_unescape(quoted, n + 1, back, len + 1);
+        CHECK(end == quoted + n && memcmp(back, data, len) == 0, "%s: json_unescape len=%zu", what, len);
+    }
+
+    free(src);
+    free(expect);
+    free(got);
+    free(quoted);
+    free(back);
+}
+
+// Largos que cubren los bloques de 16 y 32 bytes y las colas de cada uno
+static void run_edge_cases(const char *level) {
+    static const unsigned char specials[] = { '"', '\\', '\n', '\r', '\t', '\b', '\f', 0x00, 0x01, 0x1F, 0x7F, 0x80, 0xC3, 0xFF, ' ' };
+    unsigned char buf[160];
+    char what[64];
+    for (size_t len = 0; len <= 100; len++) {
+        memset(buf, 'a', len);
+        snprintf(what, sizeof(what), "%s ascii", level);
+        check_input(buf, len, what);
+        // Un byte especial en cada posicion, incluida la primera y la ultima de cada cola
+        for (size_t s = 0; s < sizeof(specials); s++) {
+            for (size_t pos = 0; pos < len; pos++) {
+                memset(buf, 'a', len);
+                buf[pos] = specials[s];
+                snprintf(what, sizeof(what), "%s byte 0x%02x pos %zu", level, specials[s], pos);
+                check_input(buf, len, what);
+            }
+        }
+    }
+    // Texto con acentos validos en UTF-8 y solo caracteres a escapar
+    const char *utf8 = "ma\xc3\xb1" "ana \xe2\x82\xac \xf0\x9f\x98\x80 \"cita\" \\ fin";
+    snprintf(what, sizeof(what), "%s utf8", level);
+    check_input((const unsigned char *)utf8, strlen(utf8), what);
+    memset(buf, '"', sizeof(buf));
+    snprintf(what, sizeof(what), "%s comillas", level);
+    check_input(buf, sizeof(buf), what);
+}
+
+// Entradas al azar: mezcla de texto comun, bytes a escapar y bytes altos
+static void run_random(const char *level, int rounds) {
+    unsigned char buf[600];
+    char what[64];
+    for (int r = 0; r < rounds; r++) {
+        size_t len = (size_t)(rng_next() % sizeof(buf));
+        int density = (int)(rng_next() % 4);
+        for (size_t i = 0; i < len; i++) {
+            uint64_t x = rng_next();
+            if (density == 0 || x % 16 > (uint64_t)density) buf[i] = (unsigned char)(' ' + x % 95);
+            else buf[i] = (unsigned char)(x >> 8);
+        }
+        snprintf(what, sizeof(what), "%s azar %d", level, r);
+        check_input(buf, len, what);
+    }
+}
+
+// Compara utf8_validate con la validacion secuencia por secuencia
+static void run_utf8(int rounds) {
+    unsigned char buf[80];
+    for (int r = 0; r < rounds; r++) {
+        size_t len = (size_t)(rng_next() % sizeof(buf));
+        for (size_t i = 0; i < len; i++) buf[i] = (unsigned char)rng_next();
+        // Mitad de las veces casi todo ASCII, para que haya tramos largos que saltar
+        if (r & 1)
+            for (size_t i = 0; i < len; i++)
+                if (rng_next() % 8) buf[i] &= 0x7F;
+        int expect = 1;
+        for (size_t i = 0; i < len && expect;) {
+            size_t n = utf8_sequence_length(buf + i, len - i);
+            if (n == 0) expect = 0;
+            i += n;
+        }
+        CHECK(utf8_validate((const char *)buf, len) == expect, "utf8_validate ronda %d len=%zu", r, len);
+    }
+}
+
+// json_unescape con destinos cortos: un escape que no entra corta el texto ahi, sin saltearlo
+static void run_unescape_truncated(void) {
+    static const char *inputs[] = {
+        "abc\\u00e9def\"",          // U+00E9, dos bytes en UTF-8
+        "ab\\ud83d\\ude00cd\"",     // Par de sustitutos, cuatro bytes
+        "x\\u20ac\\n\\u00e9y\\\"z\"", // Escapes seguidos
+    };
+    for (size_t t = 0; t < sizeof(inputs) / sizeof(inputs[0]); t++) {
+        const char *src = inputs[t];
+        size_t src_len = strlen(src);
+        char full[64], part[64];
+        const char *end = json_unescape(src, src_len, full, sizeof(full));
+        CHECK(end == src + src_len - 1, "json_unescape entrada %zu sin cortar", t);
+        size_t full_len = strlen(full);
+        // Con cada tamano de destino el resultado es un prefijo del texto completo
+        for (size_t size = 1; size <= full_len + 1; size++) {
+            end = json_unescape(src, src_len, part, size);
+            size_t n = strlen(part);
+            CHECK(end == src + src_len - 1 && n < size && memcmp(part, full, n) == 0 && utf8_validate(part, n),
+                  "json_unescape entrada %zu destino %zu: \"%s\"", t, size, part);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) rng_state = strtoull(argv[1], NULL, 0) | 1;
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+
+    // Cada nivel disponible en este procesador se prueba forzando json_simd_level
+    int detected = json_simd();
+    for (int level = JSON_SIMD_SCALAR; level <= detected; level++) {
+#ifdef JSON_SIMD_X86
+        if (level == JSON_SIMD_SCALAR) continue; // En x86-64 siempre hay al menos SSE2
+#endif
+        static const char *names[] = { "escalar", "sse2", "avx2" };
+        json_simd_level = level;
+        run_edge_cases(names[level]);
+        run_random(names[level], rounds);
+    }
+    json_simd_level = detected;
+    run_utf8(rounds * 10);
+    run_unescape_truncated();
+
+    if (failures) {
+        fprintf(stderr, "test_json_escape: %d fallos\n", failures);
+        return 1;
+    }
+    printf("test_json_escape: ok (nivel detectado %d)\n", detected);
+    return 0;
+}
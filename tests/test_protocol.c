@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+
+// Serializacion de ProtocolMessage: un content o target que llega como texto nunca se reenvia sin escapar
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "FALLO %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+// Deserializa json, lo vuelve a serializar y verifica que la trama nueva sea JSON valido
+static void roundtrip(const char *json, ProtocolMessage *msg, char *out, size_t out_size) {
+    memset(msg, 0, sizeof(*msg));
+    CHECK(deserialize_message(json, msg) == 0, "no se pudo deserializar %s", json);
+    int n = serialize_message_into(msg, out, out_size);
+    CHECK(n > 0, "no se pudo serializar %s", json);
+    if (n <= 0) {
+        out[0] = '\0';
+        return;
+    }
+    CHECK(json_skip_value(out, out + n, 0) == out + n, "trama invalida: %s", out);
+}
+
+int main(void) {
+    ProtocolMessage msg, again;
+    char out[MAX_JSON_LENGTH];
+
+    // Un texto que parece el final de un objeto no agrega campos al reenviarse
+    roundtrip("{\"type\": \"broadcast\", \"sender\": \"ana\", "
+              "\"content\": \"{\\\"x\\\":1}, \\\"sender\\\": \\\"admin\\\", \\\"z\\\": {\", \"timestamp\": \"t\"}",
+              &msg, out, sizeof(out));
+    CHECK(!msg.contentIsJson, "un content en cadena quedo marcado como JSON");
+    roundtrip(out, &again, out, sizeof(out));
+    CHECK(strcmp(again.sender, "ana") == 0, "el sender cambio a %s", again.sender);
+    CHECK(strcmp(again.content, msg.content) == 0, "el content cambio: %s", again.content);
+
+    // Un arreglo que no cierra se trata como texto
+    roundtrip("{\"type\": \"broadcast\", \"sender\": \"ana\", \"content\": \"[oops\"}", &msg, out, sizeof(out));
+    CHECK(!msg.contentIsJson && strcmp(msg.content, "[oops") == 0, "content [oops mal tratado");
+    CHECK(strstr(out, "\"content\": \"[oops\"") != NULL, "content [oops no se escapo: %s", out);
+
+    // Un content que es objeto JSON se conserva como objeto
+    roundtrip("{\"type\": \"list_users\", \"sender\": \"ana\", \"content\": {\"prefix\": \"a\", \"limit\": 10}}",
+              &msg, out, sizeof(out));
+    CHECK(msg.contentIsJson, "un content objeto no quedo marcado como JSON");
+    CHECK(strstr(out, "\"content\": {\"prefix\": \"a\", \"limit\": 10}") != NULL, "objeto cambiado: %s", out);
+
+    // Objetos mal formados, aunque tengan llaves balanceadas
+    static const char *invalid[] = {
+        "{\"a\" 1}", "{\"a\": }", "{a: 1}", "[1,]", "[1 2]", "{\"a\": 01}", "[tru]", "[\"\\x\"]", "[\"a\nb\"]",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        char json[256];
+        snprintf(json, sizeof(json), "{\"type\": \"broadcast\", \"sender\": \"ana\", \"content\": %s}", invalid[i]);
+        memset(&msg, 0, sizeof(msg));
+        deserialize_message(json, &msg);
+        CHECK(!msg.contentIsJson, "content invalido aceptado: %s", invalid[i]);
+        int n = serialize_message_into(&msg, out, sizeof(out));
+        CHECK(n < 0 || json_skip_value(out, out + n, 0) == out + n, "trama invalida para %s: %s", invalid[i], out);
+    }
+    static const char *valid[] = {
+        "{}", "[]", "[1, -2.5e+3, true, false, null]", "{\"a\": [{\"b\": \"\\u00e9\\\"\"}]}", " [ \"x\" , { } ] ",
+    };
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        const char *v = valid[i];
+        while (*v == ' ') v++;
+        CHECK(json_composite_length(v) > 0, "JSON valido rechazado: %s", valid[i]);
+    }
+
+    // Anidamiento mas profundo que JSON_MAX_DEPTH se rechaza sin recursion sin limite
+    char deep[2 * JSON_MAX_DEPTH + 8];
+    size_t d = 0;
+    for (int i = 0; i <= JSON_MAX_DEPTH; i++) deep[d++] = '[';
+    for (int i = 0; i <= JSON_MAX_DEPTH; i++) deep[d++] = ']';
+    deep[d] = '\0';
+    CHECK(json_composite_length(deep) == 0, "anidamiento excesivo aceptado");
+
+    // target: un arreglo valido es lista, un texto con corchete es un nombre
+    roundtrip("{\"type\": \"private\", \"sender\": \"ana\", \"target\": [\"bob\", \"eva\"], \"content\": \"hola\"}",
+              &msg, out, sizeof(out));
+    CHECK(msg.targetIsList && strstr(out, "\"target\": [\"bob\", \"eva\"]") != NULL, "target lista: %s", out);
+    roundtrip("{\"type\": \"private\", \"sender\": \"ana\", \"target\": [\"bob\", \"content\": \"x\"}", &msg, out, sizeof(out));
+    CHECK(!msg.targetIsList, "target invalido marcado como lista");
+
+    // Un target lista que no cabe en el campo no se reenvia cortado
+    char big[MAX_JSON_LENGTH];
+    size_t off = 0;
+    json_put_raw(big, sizeof(big), &off, "{\"type\": \"private\", \"sender\": \"ana\", \"target\": [");
+    for (int i = 0; i < 40; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s\"usuario_%02d\"", i ? ", " : "", i);
+        json_put_raw(big, sizeof(big), &off, name);
+    }
+    json_put_raw(big, sizeof(big), &off, "], \"content\": \"hola\"}");
+    roundtrip(big, &msg, out, sizeof(out));
+    CHECK(msg.targetIsList && msg.target[0] == '\0', "target lista largo quedo cortado: %s", msg.target);
+
+    // userList solo se reenvia si era un arreglo valido
+    roundtrip("{\"type\": \"register_success\", \"sender\": \"server\", \"userList\": [\"a\", 1}", &msg, out, sizeof(out));
+    CHECK(!msg.hasUserList, "userList invalido aceptado");
+    roundtrip("{\"type\": \"register_success\", \"sender\": \"server\", \"userList\": [\"a\", \"b\"]}", &msg, out, sizeof(out));
+    CHECK(msg.hasUserList && strstr(out, "\"userList\": [\"a\", \"b\"]") != NULL, "userList valido perdido: %s", out);
+
+    if (failures) {
+        fprintf(stderr, "test_protocol: %d fallos\n", failures);
+        return 1;
+    }
+    printf("test_protocol: ok\n");
+    return 0;
+}
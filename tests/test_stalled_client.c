@@ -0,0 +1,95 @@
+#include "harness.h"
+
+// Un cliente que deja de leer no frena a los demas
+// - lento se registra con un buffer de recepcion chico y no lee nunca mas
+// - emisor le manda privados (que nunca se descartan) y broadcasts a todos hasta pasar el limite -w
+// - rapido recibe todos los broadcasts mientras tanto
+// - lento se desaloja con la razon "Consumidor lento" y su nombre queda libre
+
+#define ROUNDS        1000 // Privados a lento y broadcasts a todos, unos 2 MB contra un limite de 64 KB
+#define FRAME_CONTENT 1000
+#define SLOW_REASON   "Consumidor lento" // SLOW_CONSUMER_REASON del servidor
+
+// Cuenta los broadcasts de la rafaga que llegan a c, esperando hasta timeout_ms solo por el primero
+static int count_burst(WsConn *c, int *count, int timeout_ms) {
+    char frame[MAX_JSON_LENGTH + 128], type[MAX_FIELD_LENGTH];
+    int n;
+    while ((n = ws_recv(c, frame, sizeof(frame), timeout_ms)) > 0) {
+        if (extract_json_value(frame, "type", type, sizeof(type)) == 0 && strcmp(type, MSG_TYPE_BROADCAST) == 0 &&
+            strstr(frame, "rafaga"))
+            (*count)++;
+        timeout_ms = 0;
+    }
+    return n;
+}
+
+int main(void) {
+    const char *dir = harness_tmpdir("chat_stalled");
+    if (!dir) return 2;
+    char mail[300], log[300], port_text[16];
+    snprintf(mail, sizeof(mail), "%s/buzones", dir);
+    snprintf(log, sizeof(log), "%s/server.log", dir);
+    int port = harness_port(2);
+    snprintf(port_text, sizeof(port_text), "%d", port);
+
+    const char *args[] = { "-I", "-w", "65536", "-m", mail, port_text, NULL };
+    pid_t server = server_start(args, port, log);
+    CHECK(server > 0, "no arranco el servidor (log en %s)", log);
+    if (server <= 0) return 1;
+
+    WsConn *slow = chat_login(port, "lento", 4096);
+    WsConn *fast = chat_login(port, "rapido", 0);
+    WsConn *sender = chat_login(port, "emisor", 0);
+    CHECK(slow && fast && sender, "no se pudieron registrar los tres clientes");
+    if (!slow || !fast || !sender) goto done;
+
+    char content[FRAME_CONTENT + 1];
+    memset(content, 'x', FRAME_CONTENT);
+    memcpy(content, "rafaga ", 7);
+    content[FRAME_CONTENT] = '\0';
+    int fast_count = 0, sender_count = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        if (chat_send(sender, MSG_TYPE_PRIVATE, "emisor", "lento", content) != 0 ||
+            chat_send(sender, MSG_TYPE_BROADCAST, "emisor", NULL, content) != 0)
+            break;
+        // rapido y emisor leen al ritmo de la rafaga, lento no lee
+        count_burst(fast, &fast_count, 0);
+        count_burst(sender, &sender_count, 0);
+    }
+    for (int i = 0; i < 50 && fast_count < ROUNDS; i++) count_burst(fast, &fast_count, 100);
+    CHECK(fast_count == ROUNDS, "rapido recibio %d de %d broadcasts con lento detenido", fast_count, ROUNDS);
+
+    // lento lee por primera vez: lo encolado antes del desalojo y despues la trama de cierre
+    char frame[MAX_JSON_LENGTH + 128];
+    int n = 0;
+    uint64_t deadline = harness_now_ns() + 3ull * HARNESS_WAIT_MS * 1000000ull;
+    while (harness_now_ns() < deadline && (n = ws_recv(slow, frame, sizeof(frame), 200)) >= 0) {}
+    CHECK(n < 0, "lento no se desconecto");
+    CHECK(slow->close_code == 1008 && strcmp(slow->close_reason, SLOW_REASON) == 0,
+          "lento se cerro con %d \"%s\" en lugar de 1008 \"" SLOW_REASON "\"",
+          slow->close_code, slow->close_reason);
+
+    // El desalojo libero el nombre y rapido sigue recibiendo
+    WsConn *again = NULL;
+    for (int i = 0; i < 20 && !again; i++) {
+        again = chat_login(port, "lento", 0);
+        if (!again) harness_sleep_ms(100);
+    }
+    CHECK(again != NULL, "el nombre de lento sigue ocupado tras el desalojo");
+    ws_free(again);
+    chat_send(sender, MSG_TYPE_BROADCAST, "emisor", NULL, "despues del desalojo");
+    CHECK(ws_expect(fast, MSG_TYPE_BROADCAST, "despues del desalojo", NULL, 0, HARNESS_WAIT_MS) == 1,
+          "rapido no recibio el broadcast posterior al desalojo");
+
+done:
+    ws_free(slow);
+    ws_free(fast);
+    ws_free(sender);
+    server_stop(server, SIGINT);
+    if (failures) {
+        fprintf(stderr, "test_stalled_client: %d fallos (log en %s)\n", failures, log);
+        return 1;
+    }
+    printf("test_stalled_client: ok\n");
+    return 0;
+}